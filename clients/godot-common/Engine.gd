@@ -45,9 +45,7 @@ func _ready():
 
 func recv_messages():
 	if repclient == null: return cells
-	while true:
-		var id_and_msg = repclient.try_get_msg()
-		if id_and_msg == null: break
+	for id_and_msg in repclient.try_get_msgs():
 		cells[id_and_msg[0]] = process_message(id_and_msg[1])
 	return cells
 
@@ -57,31 +55,32 @@ func process_message(message):
 	var numpoints = bytestou64(message.subarray(16, 23))
 	var status = bytestou64(message.subarray(24, 31))
 
-	var cell_position = morton_2_decode(cell_code)
-	cell_position = Vector2(cell_position.x, cell_position.y)
+	var context = net_cell_context(cell_code, cell_level)
+	var cell_position = Vector2(context[0].x, context[0].y)
 	var cell_size = (1 << cell_level)
 	var cell_info = [cell_position, cell_size, status]
 
 	var points = []
 	for i in range(numpoints):
-		var position = net_decode_position(bytestou32(message.subarray(CLIENT_HEADER_SIZE + i*POINT_SIZE, CLIENT_HEADER_SIZE + i*POINT_SIZE + 4 - 1)), cell_code, cell_level)
+		var position = net_decode_position(bytestou32(message.subarray(CLIENT_HEADER_SIZE + i*POINT_SIZE, CLIENT_HEADER_SIZE + i*POINT_SIZE + 4 - 1)), context)
 		var color    = net_decode_color(bytestou32(message.subarray(CLIENT_HEADER_SIZE + i*POINT_SIZE + 4, CLIENT_HEADER_SIZE + i*POINT_SIZE + 4 + 4 - 1)))
 		points.append([position, color, 6])
 	return [cell_info, points]
 
-func net_decode_position(p, cell_code, cell_level):
-	var cell_xyz = morton_2_decode(cell_code)
-	var cell_dim = 1 << cell_level
+# The cell's corner and the size of a position step in it, worked out once per message
+# rather than for every point
+func net_cell_context(cell_code, cell_level):
+	return [morton_2_decode(cell_code), float(1 << cell_level) / (1 << 10)]
+
+func net_decode_position(p, context):
 	var v = Vector3(
 		(p >>  0) & ((1 << 10) - 1),
 		(p >> 10) & ((1 << 10) - 1),
 		(p >> 20) & ((1 << 10) - 1))
-	return (v / (1 << 10)) * cell_dim + cell_xyz
+	return v * context[1] + context[0]
 
-func net_encode_position(v, cell_code, cell_level):
-	var size = 1 << cell_level
-	var c = morton_2_decode(cell_code)
-	v = ((v - c) / size) * (1 << 10)
+func net_encode_position(v, context):
+	v = (v - context[0]) / context[1]
 	return (v.x << 0) | (v.y << 10) | (v.z << 20)
 
 func net_decode_color(c):
@@ -95,15 +95,17 @@ godot_variant aether_repclient_init_playback(godot_object *p_instance, void *p_m
     printf("here: %s\n", here);
     free(here);
 
+    struct repclient_options opts = {0};
+    opts.mmap_playback = true;
     if (p_num_args == 1) {
         godot_string file_str = api->godot_variant_as_string(p_args[0]);
         godot_char_string file_charstr = api->godot_string_ascii(&file_str);
 
-        *s = repclient_init_playback(api->godot_char_string_get_data(&file_charstr));
+        *s = repclient_init_playback_opts(api->godot_char_string_get_data(&file_charstr), &opts);
         api->godot_char_string_destroy(&file_charstr);
         api->godot_string_destroy(&file_str);
     } else if (p_num_args == 0)
-        *s = repclient_init_playback(NULL);
+        *s = repclient_init_playback_opts(NULL, &opts);
     else
         abort();
 
@@ -176,6 +178,54 @@ godot_variant aether_repclient_try_get_msg(godot_object *p_instance, void *p_met
     return ret;
 }
 
+// Like try_get_msg, but returns every message that is ready as an array of [id, bytes]
+// pairs, so a frame costs one call however many workers have sent something
+godot_variant aether_repclient_try_get_msgs(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+    if (p_num_args != 0) abort();
+    auto s = (repclient_state *) p_user_data;
+    assert(s->sockfd != -1);
+
+    godot_array retarr;
+    api->godot_array_new(&retarr);
+    size_t num_msgs;
+    do {
+        static struct repclient_message msgs[256];
+        num_msgs = repclient_tick_batch(s, msgs, sizeof(msgs) / sizeof(msgs[0]));
+        for (size_t i = 0; i < num_msgs; i++) {
+            godot_variant id_var;
+            api->godot_variant_new_uint(&id_var, msgs[i].worker_id);
+
+            godot_pool_byte_array pba;
+            api->godot_pool_byte_array_new(&pba);
+            api->godot_pool_byte_array_resize(&pba, msgs[i].len);
+            godot_pool_byte_array_write_access *write_access = api->godot_pool_byte_array_write(&pba);
+            uint8_t *ptr = api->godot_pool_byte_array_write_access_ptr(write_access);
+            memcpy(ptr, msgs[i].data, msgs[i].len);
+            api->godot_pool_byte_array_write_access_destroy(write_access);
+            godot_variant pba_var;
+            api->godot_variant_new_pool_byte_array(&pba_var, &pba);
+            api->godot_pool_byte_array_destroy(&pba);
+
+            godot_array pair;
+            api->godot_array_new(&pair);
+            api->godot_array_append(&pair, &id_var);
+            api->godot_array_append(&pair, &pba_var);
+            api->godot_variant_destroy(&id_var);
+            api->godot_variant_destroy(&pba_var);
+            godot_variant pair_var;
+            api->godot_variant_new_array(&pair_var, &pair);
+            api->godot_array_destroy(&pair);
+            api->godot_array_append(&retarr, &pair_var);
+            api->godot_variant_destroy(&pair_var);
+        }
+    } while (num_msgs);
+
+    godot_variant ret;
+    api->godot_variant_new_array(&ret, &retarr);
+    api->godot_array_destroy(&retarr);
+    return ret;
+}
+
 void GDN_EXPORT godot_nativescript_init(void *p_handle) {
     printf("nativescript_init\n");
     godot_method_attributes norpc = { GODOT_METHOD_RPC_MODE_DISABLED };
@@ -188,6 +238,9 @@ void GDN_EXPORT godot_nativescript_init(void *p_handle) {
         godot_instance_method try_get_msg = { aether_repclient_try_get_msg, NULL, NULL };
         nativescript_api->godot_nativescript_register_method(p_handle, "AetherRepClient", "try_get_msg", norpc, try_get_msg);
 
+        godot_instance_method try_get_msgs = { aether_repclient_try_get_msgs, NULL, NULL };
+        nativescript_api->godot_nativescript_register_method(p_handle, "AetherRepClient", "try_get_msgs", norpc, try_get_msgs);
+
         godot_instance_method send_message = { aether_repclient_send_message, NULL, NULL };
         nativescript_api->godot_nativescript_register_method(p_handle, "AetherRepClient", "send_message", norpc, send_message);
 
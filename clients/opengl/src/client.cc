@@ -33,17 +33,22 @@
 #include <net.hh>
 #include <morton.hh>
 #include <repclient.hh>
+#include <worker_table.hh>
 #include <event.hh>
 #include <colour.hh>
 
-struct ui_point {
-    vec3f p;
-    struct colour c;
-    float size;
+// The point shader's per-point attributes, each a float array of its own
+enum point_component {
+    POINT_X, POINT_Y, POINT_R, POINT_G, POINT_B, POINT_COMPONENTS,
 };
 
+#define POINT_SIZE 64.0f
+
 struct worker_info {
-    std::vector<ui_point> points;
+    // The components one after another, num_points each, as decoded and as uploaded
+    std::vector<float> points;
+    std::vector<uint32_t> ids;
+    size_t num_points;
     client_stats stats;
 };
 
@@ -81,6 +86,26 @@ static void push_event(aether_event_t event) {
     click_events.push_back(event);
 }
 
+// Seconds to jump by when replaying a recording
+static float seek_by = 0;
+// Pausing, and the factor to change the speed of a replay by
+static bool toggle_pause = false;
+static float speed_by = 1;
+
+static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (action == GLFW_PRESS && key == GLFW_KEY_PAGE_UP) {
+        seek_by += 5;
+    } else if (action == GLFW_PRESS && key == GLFW_KEY_PAGE_DOWN) {
+        seek_by -= 5;
+    } else if (action == GLFW_PRESS && key == GLFW_KEY_P) {
+        toggle_pause = !toggle_pause;
+    } else if (action == GLFW_PRESS && key == GLFW_KEY_RIGHT_BRACKET) {
+        speed_by *= 2;
+    } else if (action == GLFW_PRESS && key == GLFW_KEY_LEFT_BRACKET) {
+        speed_by /= 2;
+    }
+}
+
 static void cursor_callback(GLFWwindow* window, const double x, const double y) {
     aether_event_t event;
     event.type = EVENT_CURSOR_MOVE,
@@ -128,33 +153,34 @@ static void glhUnProjectf(float winx, float winy, float winwidth, float winheigh
     objectCoordinate[2]=ray_wor[2];
 }
 
-static uint64_t num_workers = 0;
+// cells and vertices are indexed by worker slot
+static struct worker_table workers;
 static std::vector<net_tree_cell> cells;
 
 static void process_packet(uint64_t id, struct client_message *message) {
-    if (id + 1 > num_workers) {
-        cells.resize(id + 1);
-        for (uint64_t i = num_workers; i < id + 1; i++) {
-            cells[i].code = 0;
-            cells[i].level = -1;
-        }
-        num_workers = id + 1;
-        vertices.resize(num_workers);
+    const uint32_t slot = worker_table_insert(&workers, id);
+    if (slot == cells.size()) {
+        net_tree_cell dead;
+        dead.code = 0;
+        dead.level = -1;
+        cells.push_back(dead);
+        vertices.resize(cells.size());
     }
-    vertices[id].stats = message->stats;
+    vertices[slot].stats = message->stats;
     if (message->cell_status == CELL_ALIVE) {
-        cells[id] = message->cell;
-        vertices[id].points.resize(message->num_points);
-        auto &points = vertices[id].points;
-        for (uint64_t i = 0; i < message->num_points; ++i) {
-            const vec2f position = net_decode_position_2f(message->points[i].net_encoded_position, message->cell);
-            points[i].p = { position.x, position.y, 0.0 };
-            points[i].size = 64;
-            points[i].c = net_decode_color(message->points[i].net_encoded_color);
-        }
+        cells[slot] = message->cell;
+        worker_info &worker = vertices[slot];
+        const size_t n = message->num_points;
+        worker.num_points = n;
+        worker.points.resize(POINT_COMPONENTS * n);
+        worker.ids.resize(n);
+        float *const points = worker.points.data();
+        const net_points_soa soa = { points + POINT_X * n, points + POINT_Y * n, NULL,
+                                     points + POINT_R * n, points + POINT_G * n, points + POINT_B * n, worker.ids.data() };
+        net_decode_points(message, net_cell_context_make<2>(message->cell), &soa);
     } else if (message->cell_status == CELL_DYING) {
-        cells[id].code = 0;
-        cells[id].level = -1;
+        cells[slot].code = 0;
+        cells[slot].level = -1;
     } else {
         assert(0 && "process_packet: unhandled cell status");
     }
@@ -215,13 +241,26 @@ int main(int argc, char **argv) {
     glewInit();
 
     struct repclient_state repstate;
+    // Keep reading the socket while a frame is being drawn, using io_uring where the
+    // kernel has it
+    struct repclient_options repopts = {0};
+    repopts.threaded = true;
+    repopts.backend = backend_io_uring;
+    // Each message redraws its worker's cell outright, so after a stall only the newest matters
+    repopts.latest_only = true;
+    // Replays are served straight out of the page cache
+    repopts.mmap_playback = true;
+    // Consecutive messages from a worker barely differ, so recordings shrink several-fold
+    repopts.compress_recording = true;
+    // Positions are decoded as 2D
+    repopts.record_dims = 2;
 
     if (argc == 2)
-        repstate = repclient_init_playback(argv[1]);
+        repstate = repclient_init_playback_opts(argv[1], &repopts);
     else if (argc == 3)
-        repstate = repclient_init(argv[1], argv[2]);
+        repstate = repclient_init_opts(argv[1], argv[2], &repopts);
     else if (argc == 4)
-        repstate = repclient_init_record(argv[1], argv[2], argv[3]);
+        repstate = repclient_init_record_opts(argv[1], argv[2], argv[3], &repopts);
 
     //create lines array
     vec3f line_vertices[4] = {
@@ -236,8 +275,11 @@ int main(int argc, char **argv) {
     #define QUOTE(...) #__VA_ARGS__
     static const char* point_vertex_shader_text = VERSION QUOTE(
         uniform mat4 mvp;
-        in vec3 vcol;
-        in vec3 vpos;
+        in float vx;
+        in float vy;
+        in float vr;
+        in float vg;
+        in float vb;
         in float vsize;
         out vec3 color;
         out gl_PerVertex {
@@ -245,10 +287,10 @@ int main(int argc, char **argv) {
             float gl_PointSize;
         };
         void main() {
-            vec4 pos = mvp * vec4(vpos, 1.0);
+            vec4 pos = mvp * vec4(vx, vy, 0.0, 1.0);
             gl_Position = pos;
             gl_PointSize = vsize / pos.z;
-            color = vcol;
+            color = vec3(vr, vg, vb);
         }
     );
     static const char* point_fragment_shader_text = VERSION QUOTE(
@@ -329,15 +371,17 @@ int main(int argc, char **argv) {
     glBindBuffer(GL_ARRAY_BUFFER, buffer_point_vertices);
     glBufferData(GL_ARRAY_BUFFER, 0, NULL, GL_DYNAMIC_DRAW);
     GLint p_mvp_location = glGetUniformLocation(program_point_vertex, "mvp");
-    GLint vpos_location = glGetAttribLocation(program_point_vertex, "vpos");
-    GLint vcol_location = glGetAttribLocation(program_point_vertex, "vcol");
+    // Pointed at each worker's arrays as it is drawn
+    static const char *const point_attributes[POINT_COMPONENTS] = { "vx", "vy", "vr", "vg", "vb" };
+    GLint point_locations[POINT_COMPONENTS];
+    for (int k = 0; k < POINT_COMPONENTS; k++) {
+        point_locations[k] = glGetAttribLocation(program_point_vertex, point_attributes[k]);
+        glEnableVertexAttribArray(point_locations[k]);
+    }
+    // Every point is the same size, so that one comes from the attribute's current value
     GLint vsize_location = glGetAttribLocation(program_point_vertex, "vsize");
-    glEnableVertexAttribArray(vpos_location);
-    glEnableVertexAttribArray(vcol_location);
-    glEnableVertexAttribArray(vsize_location);
-    glVertexAttribPointer(vpos_location, 3, GL_FLOAT, GL_FALSE, sizeof(struct ui_point), (void*)offsetof(struct ui_point, p));
-    glVertexAttribPointer(vcol_location, 3, GL_FLOAT, GL_FALSE, sizeof(struct ui_point), (void*)offsetof(struct ui_point, c));
-    glVertexAttribPointer(vsize_location, 1, GL_FLOAT, GL_FALSE, sizeof(struct ui_point), (void*)offsetof(struct ui_point, size));
+    glDisableVertexAttribArray(vsize_location);
+    glVertexAttrib1f(vsize_location, POINT_SIZE);
 
     //setup vao line
     GLuint vao_line;
@@ -362,6 +406,7 @@ int main(int argc, char **argv) {
 
     glfwSetMouseButtonCallback(window, mouse_button_callback);
     glfwSetCursorPosCallback(window, cursor_callback);
+    glfwSetKeyCallback(window, key_callback);
 
     glfwSetTime(0);
     vec3f camera_pos = {0, 0, 16};
@@ -370,10 +415,23 @@ int main(int argc, char **argv) {
         if (frames % 20 == 0)  {
             const statistic stat = stats.get_sample_per_second(1.0);
             printf("Data in: %f KB/s\n", stat.bytes / 1024.0);
+            if (repstate.counters.messages) {
+                printf("Syscalls per message: %f\n",
+                       (double)(repstate.counters.read_calls + repstate.counters.write_calls + repstate.counters.uring_enters) / repstate.counters.messages);
+            }
+            if (repstate.counters.dropped) {
+                printf("Stale messages skipped: %lu\n", repstate.counters.dropped);
+            }
+            if (repstate.counters.record_dropped) {
+                printf("Messages missing from the recording: %lu\n", repstate.counters.record_dropped);
+            }
+            if (repstate.counters.oversized) {
+                printf("Messages too big to take: %lu\n", repstate.counters.oversized);
+            }
             client_stats client_stats_accum = { 0 };
             for(size_t i = 0; i < vertices.size(); ++i) {
               if (cells[i].level != static_cast<uint64_t>(-1)) {
-                printf("Worker %li: num_agents=%lu, num_ghost=%lu\n", i, vertices[i].stats.num_agents, vertices[i].stats.num_agents_ghost);
+                printf("Worker %lu: num_agents=%lu, num_ghost=%lu\n", workers.worker_ids[i], vertices[i].stats.num_agents, vertices[i].stats.num_agents_ghost);
                 client_stats_accum.num_agents += vertices[i].stats.num_agents;
                 client_stats_accum.num_agents_ghost += vertices[i].stats.num_agents_ghost;
               }
@@ -399,6 +457,23 @@ int main(int argc, char **argv) {
         if (glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) || glfwGetKey(window, GLFW_KEY_DOWN))
             camera_pos.y -= 0.1;
 
+        if (seek_by != 0 && repstate.mode == playback) {
+            repclient_seek(&repstate, (int64_t) repstate.current_packet_time + (int64_t) (seek_by * 1e9));
+        }
+        seek_by = 0;
+        if (toggle_pause && repstate.mode == playback) {
+            if (repstate.paused)
+                repclient_resume(&repstate);
+            else
+                repclient_pause(&repstate);
+        }
+        toggle_pause = false;
+        if (speed_by != 1 && repstate.mode == playback) {
+            const float speed = repstate.opts.playback_speed > 0 ? repstate.opts.playback_speed : 1;
+            repclient_set_speed(&repstate, speed * speed_by);
+        }
+        speed_by = 1;
+
         if (glfwWindowShouldClose(window)) {
             glfwDestroyWindow(window);
             return 0;
@@ -428,19 +503,19 @@ int main(int argc, char **argv) {
 
         glClearColor(0.0, 0.0, 0.0, 1);
         glClear(GL_COLOR_BUFFER_BIT);
-        struct client_message *msg = NULL;
+        size_t num_msgs;
         do {
-            uint64_t id;
-            size_t msg_size;
-            msg = static_cast<struct client_message*>(repclient_tick(&repstate, &id, &msg_size));
-            if (msg) {
-                process_packet(id, msg);
-                statistic stat;
-                stat.bytes = msg_size;
+            static struct repclient_message msgs[256];
+            num_msgs = repclient_tick_batch(&repstate, msgs, sizeof(msgs) / sizeof(msgs[0]));
+            statistic stat;
+            for (size_t i = 0; i < num_msgs; i++) {
+                process_packet(msgs[i].worker_id, static_cast<struct client_message*>(msgs[i].data));
+                stat.bytes += msgs[i].len;
+            }
+            if (num_msgs) {
                 stats += stat;
-
             }
-        } while (msg);
+        } while (num_msgs);
 
         const bool debug_interaction = false;
         if (debug_interaction && frames % 100 == 0) {
@@ -455,15 +530,15 @@ int main(int argc, char **argv) {
             repclient_send_message(&repstate, &buf[0], buf.size());
         }
 
-        for (uint64_t i = 0; i < num_workers; i++) {
+        for (uint64_t i = 0; i < workers.count; i++) {
             if (cells[i].level != (uint64_t)-1) {
                 //setup model matrix for lines
-                vec2f m_vec = morton_2_decode(cells[i].code);
+                const net_cell_context<2> cell = net_cell_context_make<2>(cells[i]);
                 mat4x4_identity(model);
                 for (int j = 0; j < 3; j++)
-                    model[j][j] = 1<<cells[i].level;
-                model[3][0] = m_vec.x;
-                model[3][1] = m_vec.y;
+                    model[j][j] = cell.size;
+                model[3][0] = cell.origin.x;
+                model[3][1] = cell.origin.y;
                 model[3][2] = 0.0;
                 mat4x4_mul(mvp, projection, view);
                 mat4x4_mul(mvp, mvp, model);
@@ -478,7 +553,7 @@ int main(int argc, char **argv) {
                 glDrawArrays(GL_LINE_LOOP, 0, sizeof(line_vertices) / sizeof(line_vertices[0]));
             }
         }
-        for (uint64_t i = 0; i < num_workers; i++) {
+        for (uint64_t i = 0; i < workers.count; i++) {
             if (cells[i].level != (uint64_t)-1) {
                 //setup mvp matrix for entities
                 mat4x4_mul(mvp, projection, view);
@@ -486,8 +561,11 @@ int main(int argc, char **argv) {
                 //render entities
                 glBindVertexArray(vao_point);
                 glBindBuffer(GL_ARRAY_BUFFER, buffer_point_vertices);
-                const size_t num_points = vertices[i].points.size();
-                glBufferData(GL_ARRAY_BUFFER, sizeof(struct ui_point) * num_points, &vertices[i].points[0], GL_DYNAMIC_DRAW);
+                const size_t num_points = vertices[i].num_points;
+                glBufferData(GL_ARRAY_BUFFER, sizeof(float) * POINT_COMPONENTS * num_points, vertices[i].points.data(), GL_DYNAMIC_DRAW);
+                for (int k = 0; k < POINT_COMPONENTS; k++) {
+                    glVertexAttribPointer(point_locations[k], 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)(k * num_points * sizeof(float)));
+                }
                 glBindProgramPipeline(pipeline_point);
                 glProgramUniformMatrix4fv(program_point_vertex, p_mvp_location, 1, GL_FALSE, (const GLfloat*)mvp);
                 glDrawArrays(GL_POINTS, 0, num_points);
@@ -0,0 +1,564 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <net.hh>
+#include <worker_table.hh>
+#include "repclient.hh"
+#include "codec.hh"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+// First byte of every record
+#define CODEC_STORED 0
+#define CODEC_CLIENT_MESSAGE 1
+
+#define PROB_BITS 11
+#define PROB_ONE (1 << PROB_BITS)
+#define PROB_MOVE 4 // adapt quickly, as the models only live for one record
+#define RANGE_TOP (1u << 24)
+#define LENGTH_CONTEXTS 24
+#define MAX_POINTS (1 << 24) // more than this is taken to be damage rather than a message
+#define NO_POINT UINT32_MAX
+
+// Numbers are sent as their bit length in unary, with a context per position, followed by
+// the bits below the leading one. Small numbers, which are most of them, are cheap.
+struct uint_model {
+    uint16_t length[LENGTH_CONTEXTS];
+};
+
+// The probabilities for one record, all starting at even odds
+struct models {
+    uint16_t same_id;
+    uint16_t same_top;
+    uint16_t same_colour[2]; // compared with the matching point, or else the point before
+    struct uint_model header[6]; // the client_message fields before the points
+    struct uint_model id;
+    struct uint_model position[3];
+};
+
+static void models_init(struct models *m) {
+    static_assert(sizeof(struct models) % sizeof(uint16_t) == 0, "models must be all probabilities");
+    uint16_t *const probs = (uint16_t *) m;
+    for (size_t i = 0; i < sizeof(*m) / sizeof(uint16_t); i++) {
+        probs[i] = PROB_ONE / 2;
+    }
+}
+
+struct encoder {
+    uint64_t low;
+    uint32_t range;
+    uint8_t cache;
+    uint64_t cache_size;
+    uint8_t **out;
+    size_t *out_cap;
+    size_t len;
+};
+
+struct decoder {
+    uint32_t range;
+    uint32_t code;
+    const uint8_t *in;
+    size_t pos;
+    size_t len;
+};
+
+static void reserve(uint8_t **buf, size_t *cap, size_t size) {
+    if (*cap < size) {
+        *cap = MAX(size, *cap * 2);
+        *buf = (uint8_t *) realloc(*buf, *cap);
+        assert(*buf);
+    }
+}
+
+static void put_byte(struct encoder *e, uint8_t byte) {
+    reserve(e->out, e->out_cap, e->len + 1);
+    (*e->out)[e->len++] = byte;
+}
+
+// Writes out the top byte of low, holding back runs of 0xff a carry could still reach
+static void shift_low(struct encoder *e) {
+    if ((uint32_t) e->low < 0xff000000u || (e->low >> 32) != 0) {
+        const uint8_t carry = e->low >> 32;
+        uint8_t byte = e->cache;
+        do {
+            put_byte(e, byte + carry);
+            byte = 0xff;
+        } while (--e->cache_size != 0);
+        e->cache = (uint8_t) (e->low >> 24);
+    }
+    e->cache_size++;
+    e->low = (uint32_t) e->low << 8;
+}
+
+static void encoder_init(struct encoder *e, uint8_t **out, size_t *out_cap, size_t len) {
+    e->low = 0;
+    e->range = UINT32_MAX;
+    e->cache = 0;
+    e->cache_size = 1;
+    e->out = out;
+    e->out_cap = out_cap;
+    e->len = len;
+}
+
+static void encoder_flush(struct encoder *e) {
+    for (int i = 0; i < 5; i++) {
+        shift_low(e);
+    }
+}
+
+static void encode_bit(struct encoder *e, uint16_t *prob, bool bit) {
+    const uint32_t bound = (e->range >> PROB_BITS) * *prob;
+    if (!bit) {
+        e->range = bound;
+        *prob += (PROB_ONE - *prob) >> PROB_MOVE;
+    } else {
+        e->low += bound;
+        e->range -= bound;
+        *prob -= *prob >> PROB_MOVE;
+    }
+    while (e->range < RANGE_TOP) {
+        e->range <<= 8;
+        shift_low(e);
+    }
+}
+
+// The low bits of value, at even odds
+static void encode_direct(struct encoder *e, uint64_t value, int bits) {
+    while (bits--) {
+        e->range >>= 1;
+        if ((value >> bits) & 1) {
+            e->low += e->range;
+        }
+        while (e->range < RANGE_TOP) {
+            e->range <<= 8;
+            shift_low(e);
+        }
+    }
+}
+
+static void encode_uint(struct encoder *e, struct uint_model *m, uint64_t value) {
+    const int bits = value ? 64 - __builtin_clzll(value) : 0;
+    for (int i = 0; i < bits; i++) {
+        encode_bit(e, &m->length[MIN(i, LENGTH_CONTEXTS - 1)], 1);
+    }
+    if (bits < 64) {
+        encode_bit(e, &m->length[MIN(bits, LENGTH_CONTEXTS - 1)], 0);
+    }
+    if (bits > 1) {
+        encode_direct(e, value, bits - 1);
+    }
+}
+
+static uint8_t next_byte(struct decoder *d) {
+    // Only damaged records run past the end, and they are caught afterwards
+    const uint8_t byte = d->pos < d->len ? d->in[d->pos] : 0;
+    d->pos++;
+    return byte;
+}
+
+static void decoder_init(struct decoder *d, const uint8_t *in, size_t len) {
+    d->range = UINT32_MAX;
+    d->code = 0;
+    d->in = in;
+    d->pos = 0;
+    d->len = len;
+    for (int i = 0; i < 5; i++) {
+        d->code = (d->code << 8) | next_byte(d);
+    }
+}
+
+static bool decode_bit(struct decoder *d, uint16_t *prob) {
+    const uint32_t bound = (d->range >> PROB_BITS) * *prob;
+    bool bit;
+    if (d->code < bound) {
+        d->range = bound;
+        *prob += (PROB_ONE - *prob) >> PROB_MOVE;
+        bit = 0;
+    } else {
+        d->code -= bound;
+        d->range -= bound;
+        *prob -= *prob >> PROB_MOVE;
+        bit = 1;
+    }
+    while (d->range < RANGE_TOP) {
+        d->range <<= 8;
+        d->code = (d->code << 8) | next_byte(d);
+    }
+    return bit;
+}
+
+static uint64_t decode_direct(struct decoder *d, int bits) {
+    uint64_t value = 0;
+    while (bits--) {
+        d->range >>= 1;
+        const bool bit = d->code >= d->range;
+        if (bit) {
+            d->code -= d->range;
+        }
+        value = (value << 1) | bit;
+        while (d->range < RANGE_TOP) {
+            d->range <<= 8;
+            d->code = (d->code << 8) | next_byte(d);
+        }
+    }
+    return value;
+}
+
+static uint64_t decode_uint(struct decoder *d, struct uint_model *m) {
+    int bits = 0;
+    while (bits < 64 && decode_bit(d, &m->length[MIN(bits, LENGTH_CONTEXTS - 1)])) {
+        bits++;
+    }
+    if (bits == 0) {
+        return 0;
+    }
+    return (1ULL << (bits - 1)) | (bits > 1 ? decode_direct(d, bits - 1) : 0);
+}
+
+static uint64_t zigzag(uint64_t difference) {
+    const int64_t d = (int64_t) difference;
+    return ((uint64_t) d << 1) ^ (uint64_t) (d >> 63);
+}
+
+static uint64_t unzigzag(uint64_t value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+// A coordinate's change within its 10 bits, taking the shorter way round
+static uint64_t axis_delta(uint32_t from, uint32_t to, int axis) {
+    const int32_t d = (int32_t) (((to >> (10 * axis)) - (from >> (10 * axis))) & 1023);
+    return zigzag((uint64_t) (int64_t) (d >= 512 ? d - 1024 : d));
+}
+
+static uint32_t axis_apply(uint32_t from, uint64_t delta, int axis) {
+    return (((from >> (10 * axis)) + (uint32_t) unzigzag(delta)) & 1023) << (10 * axis);
+}
+
+static bool is_client_message(const uint8_t *msg, size_t len) {
+    if (!msg || len < sizeof(struct client_message)) {
+        return false;
+    }
+    uint64_t num_points;
+    memcpy(&num_points, msg + offsetof(struct client_message, num_points), sizeof(num_points));
+    return num_points <= MAX_POINTS && len == sizeof(struct client_message) + num_points * sizeof(struct net_point);
+}
+
+static void header_fields(const uint8_t *msg, uint64_t fields[6]) {
+    struct client_message m;
+    if (msg) {
+        memcpy(&m, msg, sizeof(m));
+    } else {
+        memset(&m, 0, sizeof(m));
+    }
+    fields[0] = m.cell.code;
+    fields[1] = m.cell.level;
+    fields[2] = m.num_points;
+    fields[3] = m.cell_status;
+    fields[4] = m.stats.num_agents;
+    fields[5] = m.stats.num_agents_ghost;
+}
+
+static struct net_point point_at(const uint8_t *points, size_t i) {
+    struct net_point p;
+    memcpy(&p, points + i * sizeof(p), sizeof(p));
+    return p;
+}
+
+// Indexes the n points of a previous message by id, keeping the first of any repeats
+static void scratch_index(struct codec_scratch *s, const uint8_t *points, size_t n) {
+    if (s->cap < 2 * n || s->cap == 0) {
+        size_t cap = 64;
+        while (cap < 2 * n) {
+            cap *= 2;
+        }
+        free(s->ids);
+        free(s->indices);
+        free(s->gens);
+        s->cap = cap;
+        s->ids = (uint32_t *) malloc(cap * sizeof(*s->ids));
+        s->indices = (uint32_t *) malloc(cap * sizeof(*s->indices));
+        s->gens = (uint32_t *) calloc(cap, sizeof(*s->gens));
+        assert(s->ids && s->indices && s->gens);
+        s->gen = 0;
+    }
+    if (++s->gen == 0) {
+        memset(s->gens, 0, s->cap * sizeof(*s->gens));
+        s->gen = 1;
+    }
+    const size_t mask = s->cap - 1;
+    for (size_t j = 0; j < n; j++) {
+        const uint32_t id = point_at(points, j).id;
+        size_t i = worker_table_hash(id) & mask;
+        while (s->gens[i] == s->gen && s->ids[i] != id) {
+            i = (i + 1) & mask;
+        }
+        if (s->gens[i] != s->gen) {
+            s->gens[i] = s->gen;
+            s->ids[i] = id;
+            s->indices[i] = j;
+        }
+    }
+}
+
+static uint32_t scratch_find(const struct codec_scratch *s, uint32_t id) {
+    const size_t mask = s->cap - 1;
+    for (size_t i = worker_table_hash(id) & mask; s->gens[i] == s->gen; i = (i + 1) & mask) {
+        if (s->ids[i] == id) {
+            return s->indices[i];
+        }
+    }
+    return NO_POINT;
+}
+
+// Codes msg against prev, which is NULL for a keyframe. Returns the coded length.
+static size_t encode_message(struct codec_scratch *scratch, const uint8_t *prev, const uint8_t *msg,
+                             uint8_t **out, size_t *out_cap) {
+    struct models m;
+    models_init(&m);
+    struct encoder e;
+    reserve(out, out_cap, 64);
+    (*out)[0] = CODEC_CLIENT_MESSAGE;
+    encoder_init(&e, out, out_cap, 1);
+
+    uint64_t fields[6], prev_fields[6];
+    header_fields(msg, fields);
+    header_fields(prev, prev_fields);
+    for (int i = 0; i < 6; i++) {
+        encode_uint(&e, &m.header[i], zigzag(fields[i] - prev_fields[i]));
+    }
+
+    const uint8_t *const points = msg + sizeof(struct client_message);
+    const uint8_t *const prev_points = prev ? prev + sizeof(struct client_message) : NULL;
+    const size_t n = fields[2];
+    const size_t prev_n = prev ? prev_fields[2] : 0;
+    size_t cursor = 0;
+    bool indexed = false;
+    int64_t last_id = -1;
+    uint32_t last_colour = 0;
+    for (size_t i = 0; i < n; i++) {
+        const struct net_point p = point_at(points, i);
+        struct net_point match;
+        bool matched = false;
+        if (cursor < prev_n && point_at(prev_points, cursor).id == p.id) {
+            encode_bit(&e, &m.same_id, 1);
+            match = point_at(prev_points, cursor++);
+            matched = true;
+        } else {
+            encode_bit(&e, &m.same_id, 0);
+            encode_uint(&e, &m.id, zigzag((uint64_t) ((int64_t) p.id - (last_id + 1))));
+            if (!indexed) {
+                scratch_index(scratch, prev_points, prev_n);
+                indexed = true;
+            }
+            const uint32_t j = prev_n ? scratch_find(scratch, p.id) : NO_POINT;
+            if (j != NO_POINT) {
+                match = point_at(prev_points, j);
+                matched = true;
+                cursor = j + 1;
+            }
+        }
+
+        if (matched) {
+            for (int axis = 0; axis < 3; axis++) {
+                encode_uint(&e, &m.position[axis], axis_delta(match.net_encoded_position, p.net_encoded_position, axis));
+            }
+            const bool same_top = (p.net_encoded_position >> 30) == (match.net_encoded_position >> 30);
+            encode_bit(&e, &m.same_top, same_top);
+            if (!same_top) {
+                encode_direct(&e, p.net_encoded_position >> 30, 2);
+            }
+        } else {
+            encode_direct(&e, p.net_encoded_position, 32);
+        }
+        const uint32_t colour = matched ? match.net_encoded_color : last_colour;
+        encode_bit(&e, &m.same_colour[matched ? 0 : 1], p.net_encoded_color == colour);
+        if (p.net_encoded_color != colour) {
+            encode_direct(&e, p.net_encoded_color, 32);
+        }
+        last_id = p.id;
+        last_colour = p.net_encoded_color;
+    }
+    encoder_flush(&e);
+    return e.len;
+}
+
+// Mirrors encode_message, writing the message to w->next. Returns its length, or 0.
+static size_t decode_message(struct codec_worker *w, struct codec_scratch *scratch, const uint8_t *prev,
+                             const uint8_t *in, size_t len) {
+    struct models m;
+    models_init(&m);
+    struct decoder d;
+    decoder_init(&d, in, len);
+
+    uint64_t fields[6], prev_fields[6];
+    header_fields(prev, prev_fields);
+    for (int i = 0; i < 6; i++) {
+        fields[i] = prev_fields[i] + unzigzag(decode_uint(&d, &m.header[i]));
+    }
+    const size_t n = fields[2];
+    if (fields[2] > MAX_POINTS) {
+        return 0;
+    }
+    const size_t msg_len = sizeof(struct client_message) + n * sizeof(struct net_point);
+    reserve(&w->next, &w->next_cap, msg_len);
+    struct client_message header;
+    header.cell.code = fields[0];
+    header.cell.level = fields[1];
+    header.num_points = fields[2];
+    header.cell_status = fields[3];
+    header.stats.num_agents = fields[4];
+    header.stats.num_agents_ghost = fields[5];
+    memcpy(w->next, &header, sizeof(header));
+
+    uint8_t *const points = w->next + sizeof(struct client_message);
+    const uint8_t *const prev_points = prev ? prev + sizeof(struct client_message) : NULL;
+    const size_t prev_n = prev ? prev_fields[2] : 0;
+    size_t cursor = 0;
+    bool indexed = false;
+    int64_t last_id = -1;
+    uint32_t last_colour = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct net_point p;
+        struct net_point match;
+        bool matched = false;
+        if (decode_bit(&d, &m.same_id)) {
+            if (cursor >= prev_n) {
+                return 0;
+            }
+            match = point_at(prev_points, cursor++);
+            matched = true;
+            p.id = match.id;
+        } else {
+            p.id = (uint32_t) (last_id + 1 + (int64_t) unzigzag(decode_uint(&d, &m.id)));
+            if (!indexed) {
+                scratch_index(scratch, prev_points, prev_n);
+                indexed = true;
+            }
+            const uint32_t j = prev_n ? scratch_find(scratch, p.id) : NO_POINT;
+            if (j != NO_POINT) {
+                match = point_at(prev_points, j);
+                matched = true;
+                cursor = j + 1;
+            }
+        }
+
+        if (matched) {
+            p.net_encoded_position = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                p.net_encoded_position |= axis_apply(match.net_encoded_position, decode_uint(&d, &m.position[axis]), axis);
+            }
+            const uint32_t top = decode_bit(&d, &m.same_top) ? match.net_encoded_position >> 30 : decode_direct(&d, 2);
+            p.net_encoded_position |= top << 30;
+        } else {
+            p.net_encoded_position = decode_direct(&d, 32);
+        }
+        const uint32_t colour = matched ? match.net_encoded_color : last_colour;
+        p.net_encoded_color = decode_bit(&d, &m.same_colour[matched ? 0 : 1]) ? colour : decode_direct(&d, 32);
+        memcpy(points + i * sizeof(p), &p, sizeof(p));
+        last_id = p.id;
+        last_colour = p.net_encoded_color;
+        if (d.pos > d.len) {
+            return 0;
+        }
+    }
+    return d.pos <= d.len ? msg_len : 0;
+}
+
+static void swap_next(struct codec_worker *w, size_t len) {
+    uint8_t *const buf = w->prev;
+    const size_t cap = w->prev_cap;
+    w->prev = w->next;
+    w->prev_cap = w->next_cap;
+    w->prev_len = len;
+    w->next = buf;
+    w->next_cap = cap;
+    w->synced = true;
+}
+
+size_t codec_encode(struct codec_worker *w, struct codec_scratch *scratch,
+                    const struct repclient_segment *segments, size_t num_segments, size_t length,
+                    bool keyframe, uint8_t **out, size_t *out_cap) {
+    assert(keyframe || w->synced);
+    reserve(&w->next, &w->next_cap, MAX(length, 1));
+    size_t pos = 0;
+    for (size_t i = 0; i < num_segments; i++) {
+        memcpy(w->next + pos, segments[i].data, segments[i].len);
+        pos += segments[i].len;
+    }
+    assert(pos == length);
+
+    size_t coded = 0;
+    if (is_client_message(w->next, length)) {
+        const uint8_t *const prev = !keyframe && is_client_message(w->prev, w->prev_len) ? w->prev : NULL;
+        coded = encode_message(scratch, prev, w->next, out, out_cap);
+    }
+    // Anything the coder can't make smaller is better off stored
+    if (coded == 0 || coded > 1 + length) {
+        reserve(out, out_cap, 1 + length);
+        (*out)[0] = CODEC_STORED;
+        memcpy(*out + 1, w->next, length);
+        coded = 1 + length;
+    }
+    swap_next(w, length);
+    return coded;
+}
+
+bool codec_decode(struct codec_worker *w, struct codec_scratch *scratch,
+                  const uint8_t *in, size_t len, bool keyframe) {
+    if ((!keyframe && !w->synced) || len == 0) {
+        w->synced = false;
+        return false;
+    }
+    size_t msg_len = 0;
+    if (in[0] == CODEC_STORED) {
+        reserve(&w->next, &w->next_cap, MAX(len - 1, 1));
+        memcpy(w->next, in + 1, len - 1);
+        msg_len = len - 1;
+    } else if (in[0] == CODEC_CLIENT_MESSAGE) {
+        const uint8_t *const prev = !keyframe && is_client_message(w->prev, w->prev_len) ? w->prev : NULL;
+        msg_len = decode_message(w, scratch, prev, in + 1, len - 1);
+        if (msg_len == 0) {
+            w->synced = false;
+            return false;
+        }
+    } else {
+        w->synced = false;
+        return false;
+    }
+    swap_next(w, msg_len);
+    return true;
+}
+
+void codec_worker_free(struct codec_worker *w) {
+    free(w->prev);
+    free(w->next);
+    *w = codec_worker();
+}
+
+void codec_scratch_free(struct codec_scratch *scratch) {
+    free(scratch->ids);
+    free(scratch->indices);
+    free(scratch->gens);
+    *scratch = codec_scratch();
+}
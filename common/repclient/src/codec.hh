@@ -0,0 +1,65 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Compression for recordings. Consecutive client_messages from one worker mostly repeat
+// each other, so a message is coded against that worker's previous one: points are
+// matched up by net_point.id and only what moved is kept. The result goes through an
+// adaptive binary range coder whose probabilities start afresh with every record, so a
+// record only ever depends on the message before it. A keyframe doesn't depend on
+// anything. Payloads that aren't a well-formed client_message are stored as they are.
+
+struct repclient_segment;
+
+// The last message coded or decoded for one worker.
+// This needs to make sense when zeroed
+struct codec_worker {
+    uint8_t *prev;
+    size_t prev_len;
+    size_t prev_cap;
+    uint8_t *next; // the message being coded, swapped with prev once done
+    size_t next_cap;
+    bool synced; // prev really is the worker's previous message
+    uint64_t keyframe_time; // of the worker's last keyframe, when recording
+};
+
+// Finds points of a previous message by id. Shared by every worker.
+// This needs to make sense when zeroed
+struct codec_scratch {
+    uint32_t *ids;
+    uint32_t *indices;
+    uint32_t *gens;
+    size_t cap;
+    uint32_t gen;
+};
+
+// Codes the message made up of segments against w's previous message, or on its own if
+// keyframe is set. The record goes in *out, which is grown as needed, and its length is
+// returned. w then holds the message for next time.
+size_t codec_encode(struct codec_worker *w, struct codec_scratch *scratch,
+                    const struct repclient_segment *segments, size_t num_segments, size_t length,
+                    bool keyframe, uint8_t **out, size_t *out_cap);
+// Decodes a record made by codec_encode, leaving the message in w->prev. Returns false,
+// and leaves w unsynced, if it is a delta w has nothing for or the record is damaged.
+bool codec_decode(struct codec_worker *w, struct codec_scratch *scratch,
+                  const uint8_t *in, size_t len, bool keyframe);
+void codec_worker_free(struct codec_worker *w);
+void codec_scratch_free(struct codec_scratch *scratch);
@@ -0,0 +1,260 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <atomic>
+
+#include "repclient.hh"
+#include "recorder.hh"
+
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+#define RECORDER_CHUNK (1024 * 1024) // bytes gathered before the writer gets them
+
+// A run of bytes for the writer to append to fd
+struct recorder_chunk {
+    struct recorder_chunk *next;
+    int fd;
+    size_t len;
+    size_t cap;
+    uint8_t *data;
+};
+
+struct repclient_recorder {
+    int fd;
+    int index_fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;  // a chunk was queued, or stop was set
+    pthread_cond_t written; // a chunk was written
+    struct recorder_chunk *head, *tail; // waiting for the writer
+    struct recorder_chunk *spare;       // written chunks of the usual size, for reuse
+    size_t num_spare;                   // up to RECORDING_SPARE_CHUNKS
+    bool stop;
+    std::atomic<uint64_t> bytes_written;
+
+    // Only touched by the thread appending
+    struct recorder_chunk *current;
+    uint64_t bytes_accepted;
+};
+
+static void write_fully(int fd, const void *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = write(fd, (const uint8_t *) data + done, size - done);
+        if (n == -1) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+}
+
+static void *recorder_main(void *arg) {
+    struct repclient_recorder *r = (struct repclient_recorder *) arg;
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->head && !r->stop) {
+            pthread_cond_wait(&r->queued, &r->lock);
+        }
+        struct recorder_chunk *chunk = r->head;
+        if (!chunk) {
+            break;
+        }
+        r->head = chunk->next;
+        if (!r->head) {
+            r->tail = NULL;
+        }
+        pthread_mutex_unlock(&r->lock);
+        write_fully(chunk->fd, chunk->data, chunk->len);
+        pthread_mutex_lock(&r->lock);
+
+        r->bytes_written.fetch_add(chunk->len, std::memory_order_release);
+        if (chunk->cap == RECORDER_CHUNK && r->num_spare < RECORDING_SPARE_CHUNKS) {
+            chunk->next = r->spare;
+            r->spare = chunk;
+            r->num_spare++;
+        } else {
+            free(chunk->data);
+            free(chunk);
+        }
+        pthread_cond_broadcast(&r->written);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+struct repclient_recorder *recorder_create(int fd, int index_fd) {
+    struct repclient_recorder *r = new repclient_recorder();
+    r->fd = fd;
+    r->index_fd = index_fd;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->queued, NULL);
+    pthread_cond_init(&r->written, NULL);
+    const int res = pthread_create(&r->thread, NULL, recorder_main, r);
+    if (res != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(res));
+        exit(EXIT_FAILURE);
+    }
+    return r;
+}
+
+static void queue_chunk(struct repclient_recorder *r, struct recorder_chunk *chunk) {
+    pthread_mutex_lock(&r->lock);
+    if (r->tail) {
+        r->tail->next = chunk;
+    } else {
+        r->head = chunk;
+    }
+    r->tail = chunk;
+    pthread_cond_signal(&r->queued);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void hand_over(struct repclient_recorder *r) {
+    struct recorder_chunk *chunk = r->current;
+    if (!chunk || chunk->len == 0) {
+        return;
+    }
+    r->current = NULL;
+    queue_chunk(r, chunk);
+}
+
+// A chunk for fd with room for at least size bytes, reusing a written one where possible
+static struct recorder_chunk *take_chunk(struct repclient_recorder *r, int fd, size_t size) {
+    struct recorder_chunk *chunk = NULL;
+    if (size <= RECORDER_CHUNK) {
+        pthread_mutex_lock(&r->lock);
+        chunk = r->spare;
+        if (chunk) {
+            r->spare = chunk->next;
+            r->num_spare--;
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+    if (!chunk) {
+        chunk = (struct recorder_chunk *) malloc(sizeof(*chunk));
+        assert(chunk);
+        chunk->cap = MAX(size, RECORDER_CHUNK);
+        chunk->data = (uint8_t *) malloc(chunk->cap);
+        assert(chunk->data);
+    }
+    chunk->next = NULL;
+    chunk->fd = fd;
+    chunk->len = 0;
+    return chunk;
+}
+
+void recorder_append(struct repclient_recorder *r, const void *header, size_t header_len,
+                     const struct repclient_segment *segments, size_t num_segments, size_t length) {
+    const size_t size = header_len + length;
+    if (r->current && r->current->cap - r->current->len < size) {
+        hand_over(r);
+    }
+    if (!r->current) {
+        r->current = take_chunk(r, r->fd, size);
+    }
+    uint8_t *const data = r->current->data;
+    size_t pos = r->current->len;
+    memcpy(data + pos, header, header_len);
+    pos += header_len;
+    for (size_t i = 0; i < num_segments; i++) {
+        memcpy(data + pos, segments[i].data, segments[i].len);
+        pos += segments[i].len;
+    }
+    assert(pos == r->current->len + size);
+    r->current->len = pos;
+    r->bytes_accepted += size;
+    if (r->current->len == r->current->cap) {
+        hand_over(r);
+    }
+}
+
+uint8_t *recorder_swap(struct repclient_recorder *r, uint8_t *chunk, size_t len, size_t *cap) {
+    hand_over(r);
+    // Its buffer goes back to the caller, and chunk is written in its place
+    struct recorder_chunk *const queued = take_chunk(r, r->fd, *cap);
+    uint8_t *const spare = queued->data;
+    const size_t spare_cap = queued->cap;
+    queued->data = chunk;
+    queued->cap = *cap;
+    queued->len = len;
+    r->bytes_accepted += len;
+    queue_chunk(r, queued);
+    *cap = spare_cap;
+    return spare;
+}
+
+void recorder_append_index(struct repclient_recorder *r, const void *data, size_t len) {
+    hand_over(r);
+    struct recorder_chunk *const chunk = take_chunk(r, r->index_fd, len);
+    memcpy(chunk->data, data, len);
+    chunk->len = len;
+    r->bytes_accepted += len;
+    queue_chunk(r, chunk);
+}
+
+void recorder_flush(struct repclient_recorder *r) {
+    // Everything else accepted has been written exactly when the writer is idle
+    if (r->current && recorder_backlog(r) == r->current->len) {
+        hand_over(r);
+    }
+}
+
+size_t recorder_backlog(const struct repclient_recorder *r) {
+    return r->bytes_accepted - r->bytes_written.load(std::memory_order_acquire);
+}
+
+void recorder_wait(struct repclient_recorder *r) {
+    hand_over(r);
+    pthread_mutex_lock(&r->lock);
+    const uint64_t seen = r->bytes_written.load(std::memory_order_relaxed);
+    while (seen != r->bytes_accepted && r->bytes_written.load(std::memory_order_relaxed) == seen) {
+        pthread_cond_wait(&r->written, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+void recorder_destroy(struct repclient_recorder *r) {
+    hand_over(r);
+    if (r->current) { // if it was empty
+        free(r->current->data);
+        free(r->current);
+    }
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_signal(&r->queued);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    while (r->spare) {
+        struct recorder_chunk *next = r->spare->next;
+        free(r->spare->data);
+        free(r->spare);
+        r->spare = next;
+    }
+    pthread_cond_destroy(&r->queued);
+    pthread_cond_destroy(&r->written);
+    pthread_mutex_destroy(&r->lock);
+    delete r;
+}
@@ -0,0 +1,50 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Recording writer for librepclient when io_uring isn't in use. Records are copied into
+// large chunks, or handed over in buffers of their own, and a writer thread appends the
+// chunks to the file and the index, so the thread reading the socket never waits on the
+// disk. Limiting how far behind the file may fall is up to the caller, by way of
+// recorder_backlog and recorder_wait.
+
+struct repclient_recorder;
+struct repclient_segment;
+
+// index_fd is -1 if the recording has no index
+struct repclient_recorder *recorder_create(int fd, int index_fd);
+// Writes out everything accepted so far, then stops the writer thread
+void recorder_destroy(struct repclient_recorder *r);
+
+// Copies header followed by the segments into the current chunk
+void recorder_append(struct repclient_recorder *r, const void *header, size_t header_len,
+                     const struct repclient_segment *segments, size_t num_segments, size_t length);
+// Queues len bytes of the recording in chunk, which the writer takes as it is. Returns a
+// buffer of *cap bytes, which is set to its size, to gather the next lot in.
+uint8_t *recorder_swap(struct repclient_recorder *r, uint8_t *chunk, size_t len, size_t *cap);
+// Queues len bytes for the end of the index, behind everything accepted before them
+void recorder_append_index(struct repclient_recorder *r, const void *data, size_t len);
+// Hands a partly filled chunk to the writer if it has nothing else to do
+void recorder_flush(struct repclient_recorder *r);
+// Bytes accepted by recorder_append that haven't reached the file yet
+size_t recorder_backlog(const struct repclient_recorder *r);
+// Hands over the current chunk and waits for the writer to finish one
+void recorder_wait(struct repclient_recorder *r);
@@ -0,0 +1,616 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include <worker_table.hh>
+#include "recording.hh"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "recordings are read and written as they are laid out in memory, which has to be little-endian"
+#endif
+
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+#define NS_PER_SECOND 1000000000ULL
+
+static void write_fully(int fd, const void *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = write(fd, (const uint8_t *) data + done, size - done);
+        if (n == -1) {
+            perror("write");
+            exit(1);
+        }
+        done += n;
+    }
+}
+
+static char *index_path(const char *path) {
+    char *const result = (char *) malloc(strlen(path) + sizeof(RECORDING_INDEX_SUFFIX));
+    assert(result);
+    strcpy(result, path);
+    strcat(result, RECORDING_INDEX_SUFFIX);
+    return result;
+}
+
+#ifdef __SSE4_2__
+uint32_t recording_checksum(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t crc = 0xffffffff;
+    for (; len >= sizeof(uint64_t); p += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+    uint32_t crc32 = crc;
+    for (; len > 0; p++, len--) {
+        crc32 = _mm_crc32_u8(crc32, *p);
+    }
+    return ~crc32;
+}
+#else
+struct checksum_table {
+    uint32_t entries[256];
+};
+
+static struct checksum_table checksum_table_make() {
+    struct checksum_table table;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+        }
+        table.entries[i] = crc;
+    }
+    return table;
+}
+
+uint32_t recording_checksum(const void *data, size_t len) {
+    static const struct checksum_table table = checksum_table_make();
+    const uint8_t *p = (const uint8_t *) data;
+    uint32_t crc = 0xffffffff;
+    for (; len > 0; p++, len--) {
+        crc = (crc >> 8) ^ table.entries[(crc ^ *p) & 0xff];
+    }
+    return ~crc;
+}
+#endif
+
+// Copies len bytes at offset into dst. Returns false if the recording doesn't have them yet.
+static bool read_at(int fd, const uint8_t *map, size_t map_len, uint64_t offset, void *dst, size_t len) {
+    if (map) {
+        if (map_len < len || offset > map_len - len) {
+            return false;
+        }
+        memcpy(dst, map + offset, len);
+        return true;
+    }
+    size_t got = 0;
+    while (got < len) {
+        const ssize_t n = pread(fd, (uint8_t *) dst + got, len - got, offset + got);
+        if (n == -1) {
+            perror("pread");
+            exit(EXIT_FAILURE);
+        } else if (n == 0) {
+            return false;
+        }
+        got += n;
+    }
+    return true;
+}
+
+static uint64_t recording_size(int fd, const uint8_t *map, size_t map_len) {
+    if (map) {
+        return map_len;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    return st.st_size;
+}
+
+// Reads the chunk table of a recording that was closed cleanly, if it has one
+static void read_chunk_table(struct recording_info *info, int fd, const uint8_t *map, size_t map_len) {
+    const uint64_t size = recording_size(fd, map, map_len);
+    struct recording_trailer trailer;
+    struct recording_table_header table;
+    if (size < info->data_offset + sizeof(table) + sizeof(trailer)
+        || !read_at(fd, map, map_len, size - sizeof(trailer), &trailer, sizeof(trailer))
+        || memcmp(trailer.magic, RECORDING_TRAILER_MAGIC, sizeof(trailer.magic)) != 0
+        || trailer.table_offset < info->data_offset
+        || trailer.table_offset > size - sizeof(trailer) - sizeof(table)
+        || !read_at(fd, map, map_len, trailer.table_offset, &table, sizeof(table))
+        || memcmp(table.magic, RECORDING_TABLE_MAGIC, sizeof(table.magic)) != 0
+        || (size - sizeof(trailer) - trailer.table_offset - sizeof(table)) / sizeof(struct recording_table_entry) != table.num_chunks) {
+        return;
+    }
+    const size_t table_size = table.num_chunks * sizeof(struct recording_table_entry);
+    struct recording_table_entry *chunks = (struct recording_table_entry *) malloc(MAX(table_size, 1));
+    assert(chunks);
+    if (!read_at(fd, map, map_len, trailer.table_offset + sizeof(table), chunks, table_size)
+        || recording_checksum(chunks, table_size) != table.checksum) {
+        fprintf(stderr, "repclient: recording's chunk table is damaged, ignoring it\n");
+        free(chunks);
+        return;
+    }
+    info->chunks = chunks;
+    info->num_chunks = table.num_chunks;
+}
+
+enum recording_status recording_info_read(struct recording_info *info, int fd, const uint8_t *map, size_t map_len) {
+    recording_info_free(info);
+    char magic[sizeof(info->header.magic)];
+    if (!read_at(fd, map, map_len, 0, magic, sizeof(magic))) {
+        return recording_short;
+    }
+    if (memcmp(magic, RECORDING_MAGIC, sizeof(magic)) != 0) {
+        info->version = 1;
+        info->data_offset = 0;
+        return recording_ok;
+    }
+    if (!read_at(fd, map, map_len, 0, &info->header, sizeof(info->header))) {
+        return recording_short;
+    }
+    if (recording_checksum(&info->header, offsetof(struct recording_file_header, checksum)) != info->header.checksum) {
+        fprintf(stderr, "repclient: recording's header is damaged\n");
+        return recording_damaged;
+    }
+    if (info->header.version > RECORDING_VERSION || info->header.header_size < sizeof(info->header)) {
+        fprintf(stderr, "repclient: recording is version %u, which this can't read\n", info->header.version);
+        return recording_damaged;
+    }
+    info->version = info->header.version;
+    info->data_offset = info->header.header_size;
+    read_chunk_table(info, fd, map, map_len);
+    return recording_ok;
+}
+
+void recording_info_free(struct recording_info *info) {
+    free(info->chunks);
+    *info = recording_info();
+}
+
+struct recording_cursor recording_cursor_start(const struct recording_info *info) {
+    struct recording_cursor cursor;
+    cursor.offset = cursor.chunk_end = info->data_offset;
+    return cursor;
+}
+
+bool recording_chunk_valid(const struct recording_chunk_header *chunk) {
+    return memcmp(chunk->magic, RECORDING_CHUNK_MAGIC, sizeof(chunk->magic)) == 0
+        && recording_checksum(chunk, offsetof(struct recording_chunk_header, checksum)) == chunk->checksum;
+}
+
+// The first chunk in the table after offset, or 0 if there isn't one to be found
+static uint64_t next_chunk(const struct recording_info *info, uint64_t offset) {
+    size_t lo = 0, hi = info->num_chunks;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (info->chunks[mid].offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < info->num_chunks ? info->chunks[lo].offset : 0;
+}
+
+static bool payload_matches(int fd, const uint8_t *map, uint64_t offset, const struct recording_chunk_header *chunk) {
+    if (map) {
+        return recording_checksum(map + offset, chunk->length) == chunk->data_checksum;
+    }
+    uint8_t *const payload = (uint8_t *) malloc(MAX(chunk->length, 1));
+    assert(payload);
+    const bool matches = read_at(fd, NULL, 0, offset, payload, chunk->length)
+        && recording_checksum(payload, chunk->length) == chunk->data_checksum;
+    free(payload);
+    return matches;
+}
+
+bool recording_skip_chunk(const struct recording_info *info, struct recording_cursor *cursor, uint64_t offset, uint64_t end) {
+    const uint64_t next = end ? end : next_chunk(info, offset);
+    fprintf(stderr, "repclient: recording is damaged at offset %lu, %s\n", (unsigned long) offset, next ? "skipping a chunk" : "reading no further");
+    cursor->offset = cursor->chunk_end = next ? next : UINT64_MAX;
+    return next;
+}
+
+enum recording_status recording_read_record(const struct recording_info *info, int fd, const uint8_t *map, size_t map_len,
+                                            struct recording_cursor *cursor, struct recording_record *record, bool verify) {
+    if (cursor->offset == UINT64_MAX) {
+        return recording_damaged;
+    }
+    if (info->version == 1) {
+        if (!recording_read_record_at(info, fd, map, map_len, cursor->offset, record)
+            || (map && record->next > map_len)) {
+            return recording_short;
+        }
+        cursor->chunk_end = record->next;
+        return recording_ok;
+    }
+    while (true) {
+        if (cursor->offset == cursor->chunk_end) {
+            const uint64_t offset = cursor->offset;
+            struct recording_chunk_header chunk;
+            if (!read_at(fd, map, map_len, offset, &chunk, sizeof(chunk))) {
+                return recording_short;
+            }
+            if (memcmp(chunk.magic, RECORDING_TABLE_MAGIC, sizeof(chunk.magic)) == 0) {
+                return recording_end;
+            }
+            if (!recording_chunk_valid(&chunk)) {
+                if (!recording_skip_chunk(info, cursor, offset, 0)) {
+                    return recording_damaged;
+                }
+                continue;
+            }
+            const uint64_t payload = offset + sizeof(chunk);
+            if (map && payload + chunk.length > map_len) {
+                return recording_short;
+            }
+            if (verify && !payload_matches(fd, map, payload, &chunk)) {
+                recording_skip_chunk(info, cursor, offset, payload + chunk.length);
+                continue;
+            }
+            cursor->offset = payload;
+            cursor->chunk_end = payload + chunk.length;
+            continue;
+        }
+        if (!recording_read_record_at(info, fd, map, map_len, cursor->offset, record)) {
+            return recording_short;
+        }
+        // Only possible in a chunk that wasn't verified
+        if (record->next > cursor->chunk_end) {
+            recording_skip_chunk(info, cursor, cursor->offset, cursor->chunk_end);
+            continue;
+        }
+        return recording_ok;
+    }
+}
+
+bool recording_read_record_at(const struct recording_info *info, int fd, const uint8_t *map, size_t map_len,
+                              uint64_t offset, struct recording_record *record) {
+    record->offset = offset;
+    if (info->version == 1) {
+        struct recording_header_v1 header;
+        if (!read_at(fd, map, map_len, offset, &header, sizeof(header))) {
+            return false;
+        }
+        record->worker_id = header.worker_id;
+        record->time = MAX(header.time, 0.0f) * (double) NS_PER_SECOND;
+        record->length = header.length;
+        record->data = offset + sizeof(header);
+    } else {
+        struct recording_record_header header;
+        if (!read_at(fd, map, map_len, offset, &header, sizeof(header))) {
+            return false;
+        }
+        record->worker_id = header.worker_id;
+        record->time = header.time;
+        record->length = header.length;
+        record->data = offset + sizeof(header);
+    }
+    record->next = record->data + record->length;
+    return true;
+}
+
+void recording_file_header_init(struct recording_file_header *header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, RECORDING_MAGIC, sizeof(header->magic));
+    header->version = RECORDING_VERSION;
+    header->header_size = sizeof(*header);
+    header->chunk_size = RECORDING_CHUNK_SIZE;
+}
+
+void recording_file_header_seal(struct recording_file_header *header) {
+    header->checksum = recording_checksum(header, offsetof(struct recording_file_header, checksum));
+}
+
+void recording_chunk_header_seal(struct recording_chunk_header *chunk, const uint8_t *payload) {
+    memcpy(chunk->magic, RECORDING_CHUNK_MAGIC, sizeof(chunk->magic));
+    chunk->data_checksum = recording_checksum(payload, chunk->length);
+    chunk->checksum = recording_checksum(chunk, offsetof(struct recording_chunk_header, checksum));
+}
+
+static void writer_output(struct recording_writer *w, const void *data, size_t len) {
+    if (w->sink) {
+        w->sink(w->sink_ctx, data, len);
+    } else {
+        write_fully(w->fd, data, len);
+    }
+}
+
+void recording_writer_start(struct recording_writer *w, const struct recording_file_header *header) {
+    writer_output(w, header, sizeof(*header));
+    w->offset = sizeof(*header);
+}
+
+uint8_t *recording_writer_reserve(struct recording_writer *w, size_t size, uint64_t time) {
+    struct recording_chunk_header *const header = &w->chunk_header;
+    if (w->chunk_len && w->chunk_len - sizeof(*header) + size > RECORDING_CHUNK_SIZE) {
+        recording_writer_close_chunk(w);
+    }
+    if (w->chunk_len == 0) {
+        memset(header, 0, sizeof(*header));
+        header->first_time = time;
+        w->chunk_offset = w->offset;
+        w->chunk_len = sizeof(*header);
+        w->offset += sizeof(*header);
+    }
+    if (w->chunk_len + size > w->chunk_cap) {
+        w->chunk_cap = MAX(w->chunk_len + size, MAX(w->chunk_cap * 2, sizeof(*header) + RECORDING_CHUNK_SIZE));
+        w->chunk = (uint8_t *) realloc(w->chunk, w->chunk_cap);
+        assert(w->chunk);
+    }
+    return w->chunk + w->chunk_len;
+}
+
+void recording_writer_commit(struct recording_writer *w, size_t size, uint64_t time) {
+    w->chunk_len += size;
+    w->offset += size;
+    w->chunk_header.num_records++;
+    w->chunk_header.last_time = time;
+}
+
+void recording_writer_append(struct recording_writer *w, uint64_t worker_id, uint64_t time, const void *data, size_t length) {
+    struct recording_record_header header;
+    assert(length <= UINT32_MAX);
+    header.worker_id = worker_id;
+    header.time = time;
+    header.length = length;
+    uint8_t *const dst = recording_writer_reserve(w, sizeof(header) + length, time);
+    memcpy(dst, &header, sizeof(header));
+    memcpy(dst + sizeof(header), data, length);
+    recording_writer_commit(w, sizeof(header) + length, time);
+}
+
+void recording_writer_close_chunk(struct recording_writer *w) {
+    if (w->chunk_len == 0) {
+        return;
+    }
+    struct recording_chunk_header *const header = &w->chunk_header;
+    header->length = w->chunk_len - sizeof(*header);
+    recording_chunk_header_seal(header, w->chunk + sizeof(*header));
+    memcpy(w->chunk, header, sizeof(*header));
+    if (w->swap) {
+        w->chunk = w->swap(w->sink_ctx, w->chunk, w->chunk_len, &w->chunk_cap);
+    } else {
+        writer_output(w, w->chunk, w->chunk_len);
+    }
+
+    if (w->num_chunks == w->chunks_cap) {
+        w->chunks_cap = MAX(w->chunks_cap * 2, 64);
+        w->chunks = (struct recording_table_entry *) realloc(w->chunks, w->chunks_cap * sizeof(*w->chunks));
+        assert(w->chunks);
+    }
+    struct recording_table_entry *const entry = &w->chunks[w->num_chunks++];
+    entry->offset = w->chunk_offset;
+    entry->first_time = header->first_time;
+    entry->last_time = header->last_time;
+    entry->num_records = header->num_records;
+    entry->length = header->length;
+    w->chunk_len = 0;
+}
+
+void recording_writer_finish(struct recording_writer *w) {
+    // Nothing was ever written
+    if (!w->offset) {
+        return;
+    }
+    recording_writer_close_chunk(w);
+    const size_t table_size = w->num_chunks * sizeof(*w->chunks);
+    struct recording_table_header table;
+    memcpy(table.magic, RECORDING_TABLE_MAGIC, sizeof(table.magic));
+    table.num_chunks = w->num_chunks;
+    table.checksum = recording_checksum(w->chunks, table_size);
+    struct recording_trailer trailer;
+    trailer.table_offset = w->offset;
+    memcpy(trailer.magic, RECORDING_TRAILER_MAGIC, sizeof(trailer.magic));
+    writer_output(w, &table, sizeof(table));
+    if (table_size) {
+        writer_output(w, w->chunks, table_size);
+    }
+    writer_output(w, &trailer, sizeof(trailer));
+}
+
+void recording_writer_free(struct recording_writer *w) {
+    free(w->chunk);
+    free(w->chunks);
+}
+
+int recording_index_create(const char *path) {
+    char *const idx_path = index_path(path);
+    const int fd = open(idx_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        fprintf(stderr, "repclient: can't write %s, recording won't be seekable: %s\n", idx_path, strerror(errno));
+    } else {
+        write_fully(fd, RECORDING_INDEX_MAGIC, strlen(RECORDING_INDEX_MAGIC));
+    }
+    free(idx_path);
+    return fd;
+}
+
+void recording_index_write_point(int fd, uint64_t offset, uint64_t time, const struct recording_index_entry *entries, size_t num_entries) {
+    struct recording_index_point_header header;
+    header.offset = offset;
+    header.time = time;
+    header.num_entries = num_entries;
+    write_fully(fd, &header, sizeof(header));
+    write_fully(fd, entries, num_entries * sizeof(*entries));
+}
+
+static void add_point(struct recording_index *idx, uint64_t offset, uint64_t time, const struct recording_index_entry *entries, size_t num_entries) {
+    if (idx->num_points == idx->points_cap) {
+        idx->points_cap = MAX(idx->points_cap * 2, 64);
+        idx->points = (struct recording_index_point *) realloc(idx->points, idx->points_cap * sizeof(*idx->points));
+        assert(idx->points);
+    }
+    if (idx->num_entries + num_entries > idx->entries_cap) {
+        idx->entries_cap = MAX(idx->entries_cap * 2, idx->num_entries + num_entries);
+        idx->entries = (struct recording_index_entry *) realloc(idx->entries, idx->entries_cap * sizeof(*idx->entries));
+        assert(idx->entries);
+    }
+    struct recording_index_point *point = &idx->points[idx->num_points++];
+    point->offset = offset;
+    point->time = time;
+    point->first_entry = idx->num_entries;
+    point->num_entries = num_entries;
+    if (num_entries) {
+        memcpy(idx->entries + idx->num_entries, entries, num_entries * sizeof(*entries));
+    }
+    idx->num_entries += num_entries;
+}
+
+bool recording_index_load(struct recording_index *idx, const char *path) {
+    char *const idx_path = index_path(path);
+    const int fd = open(idx_path, O_RDONLY);
+    free(idx_path);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    const size_t size = st.st_size;
+    uint8_t *const data = (uint8_t *) malloc(size + 1);
+    assert(data);
+    size_t got = 0;
+    while (got < size) {
+        const ssize_t n = read(fd, data + got, size - got);
+        if (n == -1) {
+            perror("read");
+            exit(EXIT_FAILURE);
+        } else if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+
+    const size_t magic_len = strlen(RECORDING_INDEX_MAGIC);
+    if (got < magic_len || memcmp(data, RECORDING_INDEX_MAGIC, magic_len) != 0) {
+        free(data);
+        return false;
+    }
+    // The last point may have been cut short if the recording didn't end cleanly
+    size_t pos = magic_len;
+    while (got - pos >= sizeof(struct recording_index_point_header)) {
+        struct recording_index_point_header header;
+        memcpy(&header, data + pos, sizeof(header));
+        const size_t entries_size = header.num_entries * sizeof(struct recording_index_entry);
+        if (got - pos - sizeof(header) < entries_size) {
+            break;
+        }
+        // Copied out because entries aren't necessarily aligned in the file
+        struct recording_index_entry *entries = (struct recording_index_entry *) malloc(MAX(entries_size, 1));
+        assert(entries);
+        memcpy(entries, data + pos + sizeof(header), entries_size);
+        add_point(idx, header.offset, header.time, entries, header.num_entries);
+        free(entries);
+        pos += sizeof(header) + entries_size;
+    }
+    free(data);
+    idx->loaded = true;
+    return true;
+}
+
+void recording_index_build(struct recording_index *idx, const struct recording_info *info, int fd, const uint8_t *map, size_t map_len) {
+    struct worker_table workers = worker_table();
+    struct recording_index_entry *latest = NULL;
+    size_t latest_cap = 0;
+    uint64_t next_point = 0;
+    uint64_t last_time = 0;
+    struct recording_cursor cursor = recording_cursor_start(info);
+    struct recording_record record;
+    while (true) {
+        // Points have to fall on chunk boundaries
+        const bool boundary = cursor.offset == cursor.chunk_end;
+        const uint64_t offset = cursor.offset;
+        if (recording_read_record(info, fd, map, map_len, &cursor, &record, false) != recording_ok) {
+            break;
+        }
+        if (boundary && record.time >= next_point) {
+            add_point(idx, offset, last_time, latest, workers.count);
+            next_point = record.time + RECORDING_INDEX_INTERVAL;
+        }
+        const uint64_t worker_id = record.worker_id & RECORDING_WORKER_MASK;
+        const size_t known = workers.count;
+        const uint32_t slot = worker_table_insert(&workers, worker_id);
+        if (slot == latest_cap) {
+            latest_cap = MAX(latest_cap * 2, 64);
+            latest = (struct recording_index_entry *) realloc(latest, latest_cap * sizeof(*latest));
+            assert(latest);
+        }
+        latest[slot].worker_id = worker_id;
+        latest[slot].offset = record.offset;
+        if (!(record.worker_id & RECORDING_DELTA) || workers.count != known) {
+            latest[slot].keyframe = record.offset;
+        }
+        last_time = record.time;
+        cursor.offset = record.next;
+    }
+    free(latest);
+    worker_table_free(&workers);
+    idx->loaded = true;
+}
+
+const struct recording_index_point *recording_index_find(const struct recording_index *idx, uint64_t time) {
+    size_t lo = 0, hi = idx->num_points;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (idx->points[mid].time <= time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? &idx->points[lo - 1] : NULL;
+}
+
+const struct recording_index_point *recording_index_find_offset(const struct recording_index *idx, uint64_t offset) {
+    size_t lo = 0, hi = idx->num_points;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (idx->points[mid].offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? &idx->points[lo - 1] : NULL;
+}
+
+void recording_index_free(struct recording_index *idx) {
+    free(idx->points);
+    free(idx->entries);
+    *idx = recording_index();
+}
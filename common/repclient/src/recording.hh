@@ -0,0 +1,282 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// On-disk layout of recordings, shared by librepclient and the tools.
+//
+// A recording starts with a recording_file_header, then its records are gathered into
+// chunks of around chunk_size bytes. Each chunk is a recording_chunk_header followed by
+// whole records, each a recording_record_header and the payload, and the header says how
+// many records there are and carries a checksum of them. Chunks are closed at every
+// index point as well, so index points always fall on chunk boundaries. A recording that
+// was closed cleanly ends with a table of every chunk and a recording_trailer saying
+// where the table is, so readers can split the work by chunk or step over a damaged one
+// without walking the file. Everything is little-endian.
+//
+// Recordings from before this layout, version 1, are a bare sequence of records with a
+// recording_header_v1 each. They are told apart by not starting with RECORDING_MAGIC.
+//
+// Next to a recording, path + RECORDING_INDEX_SUFFIX holds an index written as the
+// recording goes: RECORDING_INDEX_MAGIC, then points, each a recording_index_point_header
+// followed by its entries. A point says where every worker's latest record before
+// offset is, so seeking never has to read from the start.
+//
+// The top bits of a record's worker id are flags. RECORDING_COMPRESSED records hold a
+// message coded by codec.hh, and RECORDING_DELTA ones can only be decoded on top of the
+// worker's previous message. Every worker gets a keyframe, a compressed record without
+// RECORDING_DELTA, at least every RECORDING_KEYFRAME_INTERVAL, and the index notes where
+// each worker's latest keyframe is so that seeking can decode forward from there.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RECORDING_INDEX_SUFFIX ".idx"
+#define RECORDING_INDEX_MAGIC "AETHIDX3"
+#define RECORDING_INDEX_INTERVAL 1000000000ULL // nanoseconds of recording between index points
+#define RECORDING_KEYFRAME_INTERVAL 1000000000ULL // most nanoseconds between a worker's keyframes
+#define RECORDING_FLUSH_INTERVAL 100000000ULL // most nanoseconds a record waits in a chunk once the stream goes quiet
+
+#define RECORDING_COMPRESSED (1ULL << 63)
+#define RECORDING_DELTA (1ULL << 62)
+#define RECORDING_WORKER_MASK (RECORDING_DELTA - 1)
+
+#define RECORDING_MAGIC "AETHDUMP"
+#define RECORDING_VERSION 2
+#define RECORDING_CHUNK_MAGIC "CHNK"
+#define RECORDING_TABLE_MAGIC "TABL"
+#define RECORDING_TRAILER_MAGIC "AETHTABL"
+#define RECORDING_CHUNK_SIZE (256 * 1024) // payload bytes at which a chunk is closed
+#define RECORDING_SPARE_CHUNKS 4 // written chunks a backend keeps to gather the next ones in
+
+struct __attribute__((packed)) recording_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;  // bytes before the first chunk
+    uint32_t chunk_size;   // a chunk only goes past this to fit a single bigger record
+    uint8_t dims;          // of the positions in client_messages, 0 if the recorder didn't say
+    uint8_t position_bits; // per axis
+    uint16_t point_size;   // sizeof(net_point)
+    uint16_t message_size; // sizeof(client_message)
+    uint16_t reserved;
+    int64_t clock_base;    // CLOCK_REALTIME at time 0, in nanoseconds since the epoch
+    uint32_t checksum;     // of everything above
+};
+
+struct __attribute__((packed)) recording_chunk_header {
+    char magic[4];
+    uint32_t num_records;
+    uint32_t length;         // payload bytes after this header
+    uint64_t first_time;
+    uint64_t last_time;
+    uint32_t data_checksum;  // of the payload
+    uint32_t checksum;       // of everything above
+};
+
+struct __attribute__((packed)) recording_record_header {
+    uint64_t worker_id;
+    uint64_t time; // monotonic nanoseconds since the recording started; clock_base gives the wall-clock time of 0
+    uint32_t length;
+};
+
+// The chunk table, followed by num_chunks recording_table_entry
+struct __attribute__((packed)) recording_table_header {
+    char magic[4];
+    uint32_t num_chunks;
+    uint32_t checksum; // of the entries
+};
+
+struct __attribute__((packed)) recording_table_entry {
+    uint64_t offset; // of the chunk header
+    uint64_t first_time;
+    uint64_t last_time;
+    uint32_t num_records;
+    uint32_t length;
+};
+
+// The last bytes of a recording that was closed cleanly
+struct __attribute__((packed)) recording_trailer {
+    uint64_t table_offset;
+    char magic[8];
+};
+
+struct __attribute__((packed)) recording_header_v1 {
+    uint64_t worker_id;
+    float time; // seconds since the first record, from CLOCK_REALTIME
+    uint64_t length;
+};
+
+// What a recording's file header says, and its chunk table if it has one. Version 1
+// recordings get the defaults, with their records starting at offset 0.
+// This needs to make sense when zeroed
+struct recording_info {
+    uint32_t version; // 0 until there is enough of the file to tell
+    uint64_t data_offset;
+    struct recording_file_header header;
+    struct recording_table_entry *chunks; // NULL unless the recording was closed cleanly
+    size_t num_chunks;
+};
+
+// A record as read from either version
+struct recording_record {
+    uint64_t worker_id; // flags included
+    uint64_t time;      // nanoseconds since the start, converted for version 1
+    uint64_t length;
+    uint64_t offset;    // of the record
+    uint64_t data;      // offset of the payload
+    uint64_t next;      // offset just past the payload
+};
+
+// A position between records. offset == chunk_end means the next read starts a new chunk;
+// version 1 recordings count every record as a chunk of its own.
+struct recording_cursor {
+    uint64_t offset;
+    uint64_t chunk_end;
+};
+
+enum recording_status {
+    recording_ok,
+    recording_short,   // the rest hasn't been written yet, or ever will be
+    recording_end,     // the chunk table has been reached
+    recording_damaged, // nothing after this can be found
+};
+
+struct __attribute__((packed)) recording_index_point_header {
+    uint64_t offset; // of the first record not covered, always at the start of a chunk
+    uint64_t time;   // of the last record covered
+    uint32_t num_entries;
+};
+
+struct recording_index_entry {
+    uint64_t worker_id;
+    uint64_t offset;   // of the worker's latest record
+    uint64_t keyframe; // of the record it decodes from, the same as offset unless it is a delta
+};
+
+struct recording_index_point {
+    uint64_t offset;
+    uint64_t time;
+    size_t first_entry;
+    size_t num_entries;
+};
+
+// An index loaded into memory, or built by scanning a recording without one.
+// This needs to make sense when zeroed
+struct recording_index {
+    bool loaded;
+    struct recording_index_point *points;
+    size_t num_points;
+    size_t points_cap;
+    struct recording_index_entry *entries;
+    size_t num_entries;
+    size_t entries_cap;
+};
+
+// The functions reading a recording take it from map if it is mapped, and with pread
+// from fd otherwise.
+
+// CRC-32C, as used for every checksum in a recording
+uint32_t recording_checksum(const void *data, size_t len);
+
+// Works out the recording's version and reads its file header and chunk table. Returns
+// recording_short if there isn't enough of the file yet to say, and recording_damaged,
+// with a warning, if it can't be read.
+enum recording_status recording_info_read(struct recording_info *info, int fd, const uint8_t *map, size_t map_len);
+void recording_info_free(struct recording_info *info);
+// Where reading from the start begins
+struct recording_cursor recording_cursor_start(const struct recording_info *info);
+// Reads the record at the cursor, first moving the cursor into the next chunk if it is at
+// the end of one. Chunks whose payload doesn't match its checksum are stepped over when
+// verify is set. The cursor isn't moved past the record; that's up to the caller, by
+// setting cursor->offset to record->next. When reading from a mapping, a chunk only
+// counts as there once all of it is.
+enum recording_status recording_read_record(const struct recording_info *info, int fd, const uint8_t *map, size_t map_len,
+                                            struct recording_cursor *cursor, struct recording_record *record, bool verify);
+// Reads the header of the record at offset, as found in the index. Returns false if the
+// recording doesn't have all of it yet.
+bool recording_read_record_at(const struct recording_info *info, int fd, const uint8_t *map, size_t map_len,
+                              uint64_t offset, struct recording_record *record);
+// Checks a chunk header read from a recording
+bool recording_chunk_valid(const struct recording_chunk_header *chunk);
+// Moves the cursor past the damaged chunk at offset, to end if that is known and otherwise
+// to the next chunk in the table. Returns false, leaving the cursor where nothing more
+// can be read, if there's no telling where that is.
+bool recording_skip_chunk(const struct recording_info *info, struct recording_cursor *cursor, uint64_t offset, uint64_t end);
+
+// Fills in everything about a file header but its times and protocol
+void recording_file_header_init(struct recording_file_header *header);
+// Sets a header's checksum once the rest of it has been filled in
+void recording_file_header_seal(struct recording_file_header *header);
+void recording_chunk_header_seal(struct recording_chunk_header *chunk, const uint8_t *payload);
+
+// Gathers records into chunks and writes them out, then the chunk table once the
+// recording is finished. Everything goes to sink if it is set, and straight to fd if not.
+// If swap is set as well, chunks go to it instead of sink: it takes the buffer a chunk
+// was gathered in as it is, and returns another for the next one, setting *cap to its size.
+// This needs to make sense when zeroed
+struct recording_writer {
+    int fd;
+    void (*sink)(void *ctx, const void *data, size_t len);
+    uint8_t *(*swap)(void *ctx, uint8_t *chunk, size_t len, size_t *cap);
+    void *sink_ctx;
+    uint64_t offset; // bytes so far, counting the chunk being gathered; 0 until started
+    uint8_t *chunk;  // the chunk header, then the records so far
+    size_t chunk_len;
+    size_t chunk_cap;
+    struct recording_chunk_header chunk_header;
+    uint64_t chunk_offset;
+    struct recording_table_entry *chunks;
+    size_t num_chunks;
+    size_t chunks_cap;
+};
+
+// Writes the file header, which has to have been sealed
+void recording_writer_start(struct recording_writer *w, const struct recording_file_header *header);
+// Makes room for a record of size bytes, its header included, starting a new chunk if
+// the current one is full. The record will be at w->offset. Returns where to put it.
+uint8_t *recording_writer_reserve(struct recording_writer *w, size_t size, uint64_t time);
+// Adds the record that has been put where recording_writer_reserve said
+void recording_writer_commit(struct recording_writer *w, size_t size, uint64_t time);
+void recording_writer_append(struct recording_writer *w, uint64_t worker_id, uint64_t time, const void *data, size_t length);
+// Writes out the chunk gathered so far, if there is one
+void recording_writer_close_chunk(struct recording_writer *w);
+// Writes the last chunk and then the chunk table, which tells readers the recording is whole
+void recording_writer_finish(struct recording_writer *w);
+void recording_writer_free(struct recording_writer *w);
+
+// Opens the index next to path for writing. Returns -1, with a warning, if it can't.
+int recording_index_create(const char *path);
+// Appends a point to an index being written
+void recording_index_write_point(int fd, uint64_t offset, uint64_t time, const struct recording_index_entry *entries, size_t num_entries);
+
+// Reads the index next to path. Returns false if there isn't a usable one.
+bool recording_index_load(struct recording_index *idx, const char *path);
+// Indexes a recording that has no index by walking its record headers
+void recording_index_build(struct recording_index *idx, const struct recording_info *info, int fd, const uint8_t *map, size_t map_len);
+// The last point at or before time, or NULL if time is before the first
+const struct recording_index_point *recording_index_find(const struct recording_index *idx, uint64_t time);
+// The last point at or before offset, or NULL if offset is before the first
+const struct recording_index_point *recording_index_find_offset(const struct recording_index *idx, uint64_t offset);
+void recording_index_free(struct recording_index *idx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -19,6 +19,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
@@ -28,67 +29,613 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <atomic>
 
 #include <tcp.hh>
+#include <net.hh>
 #include "repclient.hh"
+#include "uring.hh"
+#include "recorder.hh"
 #include <timer.hh>
 
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 
-#define MIN_SLACK_BYTES 128
 #define MIN_BUF_SIZE 1024
+#define INGEST_BUF_SIZE (256 * 1024)
+#define MIN_RING_SIZE (64 * 1024)
+#define MAX_RING_SIZE (256 * 1024 * 1024)
+#define IO_QUEUE_SIZE 1024
+#define MAX_WRITE_IOVS 1024
+#define CACHE_LINE 64
+#define DECODED_OFFSET (1ULL << 63) // marks batch offsets into repclient_state.decoded
+#define SOURCE_SHIFT 48 // batch offsets from a merge say which recording above this
+#define NS_PER_SECOND 1000000000ULL
+
+static void stagebuf_reserve(struct repclient_stagebuf *const stagebuf, const size_t bytes) {
+    if (stagebuf->cap < bytes) {
+        stagebuf->cap = MAX(stagebuf->cap * 2, MAX(bytes, MIN_BUF_SIZE));
+        stagebuf->buf = (uint8_t *) realloc(stagebuf->buf, stagebuf->cap);
+        assert(stagebuf->buf);
+    }
+}
+
+static uint8_t *ring_at(const struct repclient_msgbuf *ring, const uint64_t offset) {
+    return ring->buf + (offset & (ring->cap - 1));
+}
+
+// Maps cap bytes of a memfd twice, one copy straight after the other
+static uint8_t *ring_map(const size_t cap) {
+    const int fd = memfd_create("repclient_ring", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create");
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(fd, cap) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *const base = (uint8_t *) mmap(NULL, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 2; i++) {
+        void *const half = mmap(base + i * cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+        if (half == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+    return base;
+}
+
+static void ring_free(struct repclient_msgbuf *ring) {
+    if (ring->buf) {
+        munmap(ring->buf, 2 * ring->cap);
+    }
+    *ring = repclient_msgbuf();
+}
+
+// Makes room for another `bytes` bytes after the data still in use. The ring only has to
+// grow when more than cap bytes would be outstanding at once; live data keeps its offsets.
+// Returns false if that would take the ring past MAX_RING_SIZE.
+static bool ring_reserve(struct repclient_msgbuf *ring, const size_t bytes) {
+    const size_t wanted = ring->len - ring->keep + bytes;
+    if (wanted <= ring->cap) {
+        return true;
+    }
+    if (wanted > MAX_RING_SIZE) {
+        return false;
+    }
+    size_t cap = MAX(ring->cap, MIN_RING_SIZE);
+    while (cap < wanted)
+        cap *= 2;
+    struct repclient_msgbuf grown = *ring;
+    grown.cap = cap;
+    grown.buf = ring_map(cap);
+    if (ring->buf) {
+        memcpy(ring_at(&grown, ring->keep), ring_at(ring, ring->keep), ring->len - ring->keep);
+        munmap(ring->buf, 2 * ring->cap);
+    }
+    *ring = grown;
+    return true;
+}
+
+static void segments_reserve(struct repclient_state *s, const size_t count) {
+    if (s->segments_cap < count) {
+        s->segments_cap = MAX(s->segments_cap * 2, MAX(count, 8));
+        s->segments = (repclient_segment *) realloc(s->segments, s->segments_cap * sizeof(*s->segments));
+        assert(s->segments);
+    }
+}
+
+// Whether a client_message, in however many segments it arrived, says its cell has gone
+static bool message_cell_dying(const struct repclient_segment *segments, const size_t num_segments) {
+    uint64_t status = CELL_ALIVE;
+    size_t skip = offsetof(struct client_message, cell_status);
+    size_t got = 0;
+    for (size_t i = 0; i < num_segments && got < sizeof(status); i++) {
+        if (segments[i].len <= skip) {
+            skip -= segments[i].len;
+            continue;
+        }
+        const size_t n = MIN(sizeof(status) - got, segments[i].len - skip);
+        memcpy((uint8_t *) &status + got, (const uint8_t *) segments[i].data + skip, n);
+        got += n;
+        skip = 0;
+    }
+    return got == sizeof(status) && status == CELL_DYING;
+}
 
-static void msgbuf_reserve(struct repclient_msgbuf *const msgbuf, const size_t bytes) {
-    if (msgbuf->cap < bytes) {
-        msgbuf->cap = MAX(msgbuf->cap * 2, MAX(bytes, MIN_BUF_SIZE));
-        msgbuf->buf = (uint8_t *) realloc(msgbuf->buf, msgbuf->cap);
-        assert(msgbuf->buf);
+// Notes that worker_id has gone, once its last message has been handed out
+static void worker_dying(struct repclient_state *s, const uint64_t worker_id) {
+    if (s->num_dying == s->dying_cap) {
+        s->dying_cap = MAX(s->dying_cap * 2, 8);
+        s->dying = (uint64_t *) realloc(s->dying, s->dying_cap * sizeof(*s->dying));
+        assert(s->dying);
     }
+    s->dying[s->num_dying++] = worker_id;
 }
 
-static void *consume_message(struct repclient_msgbuf *msgbuf, size_t *length) {
+// Starts a new pass able to hold up to count ids
+static void idset_clear(struct repclient_idset *set, const size_t count) {
+    if (set->cap < count * 2) {
+        set->cap = MAX(set->cap, 64);
+        while (set->cap < count * 2)
+            set->cap *= 2;
+        free(set->ids);
+        free(set->gens);
+        set->ids = (uint64_t *) malloc(set->cap * sizeof(*set->ids));
+        set->gens = (uint32_t *) calloc(set->cap, sizeof(*set->gens));
+        assert(set->ids && set->gens);
+        set->gen = 0;
+    }
+    set->gen++;
+    if (set->gen == 0) {
+        memset(set->gens, 0, set->cap * sizeof(*set->gens));
+        set->gen = 1;
+    }
+}
+
+// Returns false if id was already in the set
+static bool idset_insert(struct repclient_idset *set, const uint64_t id) {
+    const size_t mask = set->cap - 1;
+    for (size_t i = worker_table_hash(id) & mask;; i = (i + 1) & mask) {
+        if (set->gens[i] != set->gen) {
+            set->gens[i] = set->gen;
+            set->ids[i] = id;
+            return true;
+        } else if (set->ids[i] == id) {
+            return false;
+        }
+    }
+}
+
+// Drops every message in out that has a newer one from the same worker after it,
+// keeping the order of the rest. Returns how many are left.
+static size_t keep_latest(struct repclient_state *s, struct repclient_message *out, const size_t n) {
+    idset_clear(&s->latest_seen, n);
+    size_t first = n;
+    for (size_t i = n; i-- > 0; ) {
+        if (idset_insert(&s->latest_seen, out[i].worker_id)) {
+            out[--first] = out[i];
+        }
+    }
+    s->counters.dropped += first;
+    memmove(out, out + first, (n - first) * sizeof(*out));
+    return n - first;
+}
+
+// If a whole message starts at base, returns how many bytes it takes up, terminator
+// included, and how many segments it has. Returns 0 if it hasn't all arrived.
+static size_t message_extent(const uint8_t *const base, const size_t unread, size_t *num_segments) {
     typedef uint32_t prefix_t;
-    size_t offset = msgbuf->pos;
+    size_t offset = 0;
+    *num_segments = 0;
     while(true) {
-        const size_t remaining = msgbuf->len - offset;
+        const size_t remaining = unread - offset;
         if (remaining < sizeof(prefix_t)) {
-            return NULL;
+            return 0;
         }
 
-        const prefix_t segment_size = *((prefix_t*)(msgbuf->buf + offset));
+        const prefix_t segment_size = *((prefix_t*)(base + offset));
         if (segment_size == 0) {
-            break;
+            return offset + sizeof(prefix_t);
         } else {
             offset += segment_size + sizeof(prefix_t);
-            if (offset > msgbuf->len)
-                return NULL;
+            (*num_segments)++;
+            if (offset > unread)
+                return 0;
         }
     }
+}
 
-    size_t header_pos = msgbuf->pos;
-    size_t dst_pos = msgbuf->pos;
-    while(true) {
-        const prefix_t segment_size = *((prefix_t*)(msgbuf->buf + header_pos));
-        if (segment_size == 0) {
-            void *const msg = msgbuf->buf + msgbuf->pos;
-            *length = dst_pos - msgbuf->pos;
-            msgbuf->pos = header_pos + sizeof(prefix_t);
-            return msg;
+// Drops the part of a message that didn't fit in the ring, leaving the whole messages
+// before it, and works out where in its segments the stream has got so that the rest of
+// it can be thrown away as it arrives
+static void ring_discard_partial(struct repclient_msgbuf *ring) {
+    typedef uint32_t prefix_t;
+    uint64_t start = ring->pos;
+    size_t extent, num_segments;
+    while ((extent = message_extent(ring_at(ring, start), ring->len - start, &num_segments))) {
+        start += extent;
+    }
+    uint64_t offset = start;
+    while (offset + sizeof(prefix_t) <= ring->len) {
+        prefix_t segment_size;
+        memcpy(&segment_size, ring_at(ring, offset), sizeof(segment_size));
+        offset += sizeof(prefix_t) + segment_size;
+    }
+    ring->skip = 0;
+    ring->prefix = 0;
+    ring->prefix_got = 0;
+    if (offset > ring->len) {
+        ring->skip = offset - ring->len;
+    } else if (offset < ring->len) {
+        ring->prefix_got = ring->len - offset;
+        memcpy(&ring->prefix, ring_at(ring, offset), ring->prefix_got);
+    }
+    ring->len = start;
+    ring->discarding = true;
+}
+
+// Throws away up to n bytes of the message being discarded, returning how many were
+// part of it. Whatever follows is the start of the worker's next message.
+static size_t ring_discard(struct repclient_msgbuf *ring, const uint8_t *data, const size_t n) {
+    size_t used = 0;
+    while (used < n && ring->discarding) {
+        if (ring->skip) {
+            const size_t skipped = MIN(ring->skip, n - used);
+            ring->skip -= skipped;
+            used += skipped;
+            continue;
+        }
+        ((uint8_t *) &ring->prefix)[ring->prefix_got++] = data[used++];
+        if (ring->prefix_got == sizeof(ring->prefix)) {
+            ring->discarding = ring->prefix != 0;
+            ring->skip = ring->prefix;
+            ring->prefix = 0;
+            ring->prefix_got = 0;
+        }
+    }
+    return used;
+}
+
+// Hands back the next complete message in msgbuf as the list of segments it arrived in,
+// stored in s->segments. A single-segment message is returned where it lies; only when
+// the caller needs a contiguous view of a multi-segment message are the segments moved
+// down over their length prefixes.
+static void *consume_message(struct repclient_state *s, struct repclient_msgbuf *msgbuf, size_t *length, bool contiguous) {
+    typedef uint32_t prefix_t;
+    // Everything unread is contiguous from here, even across the end of the ring
+    uint8_t *base = ring_at(msgbuf, msgbuf->pos);
+    size_t unread = msgbuf->len - msgbuf->pos;
+    size_t num_segments;
+    size_t extent = message_extent(base, unread, &num_segments);
+    if (!extent) {
+        return NULL;
+    }
+    // Skip to the newest whole message, unless every message has to be recorded
+    if (s->opts.latest_only && s->mode == live) {
+        size_t next_segments;
+        size_t next;
+        while ((next = message_extent(base + extent, unread - extent, &next_segments))) {
+            base += extent;
+            unread -= extent;
+            msgbuf->pos += extent;
+            extent = next;
+            num_segments = next_segments;
+            s->counters.dropped++;
         }
-        memmove(msgbuf->buf + dst_pos, msgbuf->buf + header_pos + sizeof(prefix_t), segment_size);
-        dst_pos += segment_size;
+    }
+
+    segments_reserve(s, num_segments);
+    size_t header_pos = 0;
+    *length = 0;
+    for (size_t i = 0; i < num_segments; i++) {
+        const prefix_t segment_size = *((prefix_t*)(base + header_pos));
+        s->segments[i].data = base + header_pos + sizeof(prefix_t);
+        s->segments[i].len = segment_size;
+        *length += segment_size;
         header_pos += segment_size + sizeof(prefix_t);
     }
+    s->num_segments = num_segments;
+    void *const msg = num_segments ? (void *) s->segments[0].data : base;
+    s->msg_offset = msgbuf->pos + ((uint8_t *) msg - base);
+    msgbuf->pos += header_pos + sizeof(prefix_t);
+
+    if (contiguous && num_segments > 1) {
+        uint8_t *const dst = base + header_pos - *length;
+        size_t dst_pos = *length;
+        for (size_t i = num_segments; i-- > 0; ) {
+            dst_pos -= s->segments[i].len;
+            memmove(dst + dst_pos, s->segments[i].data, s->segments[i].len);
+        }
+        s->segments[0].data = dst;
+        s->segments[0].len = *length;
+        s->num_segments = 1;
+        s->msg_offset += dst - (uint8_t *) msg;
+        return dst;
+    }
+    return msg;
+}
+
+// A finished message handed from the I/O thread to the caller. The slot keeps its buffer
+// when it is recycled, so a steady stream of messages stops allocating.
+struct repclient_io_slot {
+    uint64_t worker_id;
+    size_t len;
+    size_t cap;
+    uint8_t *buf;
+    bool superseded; // only touched by the caller, for latest_only
+};
+
+// One of the recordings played back by repclient_init_playback_merge. It plays back
+// unthrottled but is kept paused except while the merge takes a record from it, so
+// ticking it otherwise only finds out how far into the recording its next record is.
+struct repclient_merge_source {
+    struct repclient_state state;
+    uint64_t worker_base; // added to its worker ids
+    uint64_t delay;       // how long after the earliest of the recordings it started
+    uint64_t next_time;   // of its next record, as merged, while it is queued
+    bool queued;          // in merge_heap
+};
+
+// In threaded mode a background thread owns the socket (and the recording, if any) via its
+// own unthreaded state, and publishes every message it demultiplexes into a single-producer/
+// single-consumer queue. Only the I/O thread advances tail and only the caller advances
+// head, so the handoff needs no locks; outgoing messages are rare and just take a mutex.
+struct repclient_io_thread {
+    struct repclient_state inner;
+    pthread_t thread;
+    int wakefd;
+    std::atomic<bool> stop;
+    std::atomic<uint64_t> read_calls, write_calls, messages, bytes_in, uring_enters, dropped, record_dropped, oversized;
+    uint64_t taken_dropped; // skipped by the caller on top of what the I/O thread dropped
+
+    uint8_t pad0[CACHE_LINE];
+    std::atomic<uint64_t> head;
+    size_t held; // slots from head onwards still in the caller's hands
+    uint8_t pad1[CACHE_LINE];
+    std::atomic<uint64_t> tail;
+    uint8_t pad2[CACHE_LINE];
+
+    struct repclient_io_slot slots[IO_QUEUE_SIZE];
+    struct repclient_message batch[IO_QUEUE_SIZE];
+
+    pthread_mutex_t outgoing_lock;
+    struct repclient_stagebuf outgoing;  // u32-prefixed messages from repclient_send_message
+    struct repclient_stagebuf forwarding; // swapped with outgoing by the I/O thread
+};
+
+void *__repclient_tick(struct repclient_state *s, uint64_t *worker_id, size_t *length, bool contiguous);
+static void try_drain_interaction(struct repclient_state *s);
+static void submit_io(struct repclient_state *s, bool idle);
+static bool playback_start(struct repclient_state *s);
+static int record_flush_wait(const struct repclient_state *s);
+
+// Once the last lot has been written, queue whatever the caller has sent since straight
+// out of the forwarding buffer
+static void io_thread_forward_outgoing(struct repclient_io_thread *io) {
+    if (io->inner.outq_len) {
+        return;
+    }
+    struct repclient_stagebuf *fwd = &io->forwarding;
+    fwd->pos = fwd->len = 0;
+    pthread_mutex_lock(&io->outgoing_lock);
+    struct repclient_stagebuf tmp = io->outgoing;
+    io->outgoing = *fwd;
+    *fwd = tmp;
+    pthread_mutex_unlock(&io->outgoing_lock);
+
+    while (fwd->pos < fwd->len) {
+        uint32_t length;
+        memcpy(&length, fwd->buf + fwd->pos, sizeof(length));
+        repclient_queue_message(&io->inner, fwd->buf + fwd->pos + sizeof(length), length);
+        fwd->pos += sizeof(length) + length;
+    }
+}
+
+static void *io_thread_main(void *arg) {
+    struct repclient_io_thread *io = (struct repclient_io_thread *) arg;
+    struct repclient_state *inner = &io->inner;
+    // With io_uring the socket is only polled for writing, and input shows up on its eventfd
+    const short input = inner->uring ? 0 : POLLIN | POLLRDHUP;
+    struct pollfd fds[3] = {
+        { inner->sockfd, input, 0 },
+        { io->wakefd, POLLIN, 0 },
+        { inner->uring ? uring_eventfd(inner->uring) : -1, POLLIN, 0 },
+    };
+    uint64_t tail = io->tail.load(std::memory_order_relaxed);
+    while (!io->stop.load(std::memory_order_acquire)) {
+        io_thread_forward_outgoing(io);
+        try_drain_interaction(inner);
+        submit_io(inner, true);
+
+        // With the queue full, leave the data in the kernel and check back shortly. Data
+        // already pulled in but not yet handed over won't wake us, so don't wait on it.
+        const bool full = tail - io->head.load(std::memory_order_acquire) == IO_QUEUE_SIZE;
+        const bool idle = inner->inbuf.pos == inner->inbuf.len && !(inner->uring && uring_ready(inner->uring));
+        // The socket stays readable once its end of file has been read, so it is only
+        // polled for writing from then on, and not at all when there is nothing to do.
+        // Hangups show up whatever is asked for, so leave it out rather than spin on one.
+        fds[0].events = (full || inner->sock_eof ? 0 : input) | (inner->outq_len ? POLLOUT : 0);
+        fds[0].fd = fds[0].events ? inner->sockfd : -1;
+        fds[2].events = full ? 0 : POLLIN;
+        // Idle, only a recording chunk still open needs waking for
+        if (poll(fds, 3, full ? 1 : idle ? record_flush_wait(inner) : 0) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 1; i < 3; i++) {
+            if (fds[i].revents & POLLIN) {
+                uint64_t wakes;
+                const ssize_t n = read(fds[i].fd, &wakes, sizeof(wakes));
+                (void) n;
+            }
+        }
+
+        const size_t space = IO_QUEUE_SIZE - (tail - io->head.load(std::memory_order_acquire));
+        const size_t n = repclient_tick_batch(inner, io->batch, space);
+        for (size_t i = 0; i < n; i++) {
+            const struct repclient_message *msg = &io->batch[i];
+            struct repclient_io_slot *slot = &io->slots[(tail + i) & (IO_QUEUE_SIZE - 1)];
+            if (slot->cap < msg->len) {
+                slot->cap = MAX(msg->len, MIN_BUF_SIZE);
+                free(slot->buf);
+                slot->buf = (uint8_t *) malloc(slot->cap);
+                assert(slot->buf);
+            }
+            memcpy(slot->buf, msg->data, msg->len);
+            slot->worker_id = msg->worker_id;
+            slot->len = msg->len;
+        }
+        tail += n;
+        io->tail.store(tail, std::memory_order_release);
+        // A short batch only means this read has been used up, not that the socket is
+        // empty, so the connection is only given up on once a read has said so
+        if (inner->uring && uring_closed(inner->uring)) {
+            fds[2].fd = -1;
+        }
+
+        io->read_calls.store(inner->counters.read_calls, std::memory_order_relaxed);
+        io->write_calls.store(inner->counters.write_calls, std::memory_order_relaxed);
+        io->messages.store(inner->counters.messages, std::memory_order_relaxed);
+        io->bytes_in.store(inner->counters.bytes_in, std::memory_order_relaxed);
+        io->uring_enters.store(inner->counters.uring_enters, std::memory_order_relaxed);
+        io->dropped.store(inner->counters.dropped, std::memory_order_relaxed);
+        io->record_dropped.store(inner->counters.record_dropped, std::memory_order_relaxed);
+        io->oversized.store(inner->counters.oversized, std::memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void io_thread_wake(struct repclient_io_thread *io) {
+    const uint64_t one = 1;
+    const ssize_t n = write(io->wakefd, &one, sizeof(one));
+    (void) n;
+}
+
+// Moves the connection in s over to a new I/O thread, leaving s as the caller's handle
+static void io_thread_start(struct repclient_state *s) {
+    struct repclient_io_thread *io = new repclient_io_thread();
+    io->inner = *s;
+    io->inner.opts.threaded = false;
+    io->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (io->wakefd == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&io->outgoing_lock, NULL);
+
+    struct repclient_state outer = {0};
+    outer.opts = s->opts;
+    outer.mode = s->mode;
+    outer.sockfd = s->sockfd;
+    outer.recfd = s->recfd;
+    outer.io_thread = io;
+    // The ring, if any, now belongs to io->inner
+    *s = outer;
+
+    const int res = pthread_create(&io->thread, NULL, io_thread_main, io);
+    if (res != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(res));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void io_thread_stop(struct repclient_io_thread *io) {
+    io->stop.store(true, std::memory_order_release);
+    io_thread_wake(io);
+    pthread_join(io->thread, NULL);
+    repclient_destroy(&io->inner);
+    for (size_t i = 0; i < IO_QUEUE_SIZE; i++) {
+        free(io->slots[i].buf);
+    }
+    free(io->outgoing.buf);
+    free(io->forwarding.buf);
+    pthread_mutex_destroy(&io->outgoing_lock);
+    close(io->wakefd);
+    delete io;
+}
+
+static void io_thread_release(struct repclient_io_thread *io) {
+    if (io->held) {
+        io->head.store(io->head.load(std::memory_order_relaxed) + io->held, std::memory_order_release);
+        io->held = 0;
+    }
+}
+
+static size_t io_thread_take(struct repclient_state *s, struct repclient_message *out, const size_t max) {
+    struct repclient_io_thread *io = s->io_thread;
+    s->counters.read_calls = io->read_calls.load(std::memory_order_relaxed);
+    s->counters.write_calls = io->write_calls.load(std::memory_order_relaxed);
+    s->counters.messages = io->messages.load(std::memory_order_relaxed);
+    s->counters.bytes_in = io->bytes_in.load(std::memory_order_relaxed);
+    s->counters.uring_enters = io->uring_enters.load(std::memory_order_relaxed);
+    s->counters.dropped = io->dropped.load(std::memory_order_relaxed) + io->taken_dropped;
+    s->counters.record_dropped = io->record_dropped.load(std::memory_order_relaxed);
+    s->counters.oversized = io->oversized.load(std::memory_order_relaxed);
+
+    assert(io->held == 0);
+    const uint64_t head = io->head.load(std::memory_order_relaxed);
+    const size_t ready = io->tail.load(std::memory_order_acquire) - head;
+    if (!s->opts.latest_only) {
+        const size_t n = MIN(ready, max);
+        for (size_t i = 0; i < n; i++) {
+            const struct repclient_io_slot *slot = &io->slots[(head + i) & (IO_QUEUE_SIZE - 1)];
+            out[i].worker_id = slot->worker_id;
+            out[i].data = slot->buf;
+            out[i].len = slot->len;
+        }
+        io->held = n;
+        return n;
+    }
+
+    // Look over everything queued, then hand out the survivors. Skipped slots are
+    // released along with the ones handed out.
+    const uint64_t taken_before = io->taken_dropped;
+    idset_clear(&s->latest_seen, ready);
+    for (size_t i = ready; i-- > 0; ) {
+        struct repclient_io_slot *slot = &io->slots[(head + i) & (IO_QUEUE_SIZE - 1)];
+        slot->superseded = !idset_insert(&s->latest_seen, slot->worker_id);
+    }
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < ready && n < max; i++) {
+        const struct repclient_io_slot *slot = &io->slots[(head + i) & (IO_QUEUE_SIZE - 1)];
+        if (slot->superseded) {
+            io->taken_dropped++;
+            continue;
+        }
+        out[n].worker_id = slot->worker_id;
+        out[n].data = slot->buf;
+        out[n].len = slot->len;
+        n++;
+    }
+    io->held = i;
+    s->counters.dropped += io->taken_dropped - taken_before;
+    return n;
+}
+
+// Sets up whatever the options ask for once the connection (and recording) are open
+static void start_backends(struct repclient_state *s) {
+    // io_uring writes at explicit offsets, which only a regular file can take
+    struct stat st;
+    const bool uring_records = s->mode == record && fstat(s->recfd, &st) == 0 && S_ISREG(st.st_mode);
+    if (s->opts.backend == backend_io_uring) {
+        s->uring = uring_create(s->sockfd, uring_records ? s->recfd : -1, uring_records ? s->idxfd : -1);
+        if (!s->uring) {
+            fprintf(stderr, "repclient: io_uring unavailable, using read/write\n");
+        }
+    }
+    if (s->mode == record && !(s->uring && uring_records)) {
+        s->recorder = recorder_create(s->recfd, s->idxfd);
+    }
+    if (s->opts.threaded) {
+        io_thread_start(s);
+    }
 }
 
 struct repclient_state repclient_init(const char *host, const char *port) {
+    return repclient_init_opts(host, port, NULL);
+}
+struct repclient_state repclient_init_opts(const char *host, const char *port, const struct repclient_options *opts) {
     struct repclient_state ret = {0};
+    if (opts) {
+        ret.opts = *opts;
+    }
     ret.mode = live;
-    ret.num_conns = 16;
-    ret.msgbufs = (repclient_msgbuf *) calloc(ret.num_conns, sizeof(struct repclient_msgbuf));
-    assert(ret.msgbufs);
+    ret.idxfd = -1;
     ret.sockfd = connect_to_host_port_with_timeout(host, port);
     assert(ret.sockfd >= 0);
 
@@ -96,10 +643,17 @@ struct repclient_state repclient_init(const char *host, const char *port) {
     assert(flags != -1);
     const int res = fcntl(ret.sockfd, F_SETFL, flags | O_NONBLOCK);
     assert(res == 0);
+    start_backends(&ret);
     return ret;
 }
 struct repclient_state repclient_init_record(const char *host, const char *port, const char *path) {
+    return repclient_init_record_opts(host, port, path, NULL);
+}
+struct repclient_state repclient_init_record_opts(const char *host, const char *port, const char *path, const struct repclient_options *opts) {
     struct repclient_state ret = repclient_init(host, port);
+    if (opts) {
+        ret.opts = *opts;
+    }
     ret.mode = record;
     ret.start_time = {0, 0};
     ret.recfd = open(path ? path : "aether_recording.dump", O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -107,17 +661,29 @@ struct repclient_state repclient_init_record(const char *host, const char *port,
         perror("open");
         exit(1);
     }
+    ret.idxfd = recording_index_create(path ? path : "aether_recording.dump");
+    start_backends(&ret);
     return ret;
 }
 struct repclient_state repclient_init_playback(const char *path) {
+    return repclient_init_playback_opts(path, NULL);
+}
+struct repclient_state repclient_init_playback_opts(const char *path, const struct repclient_options *opts) {
     struct repclient_state ret = {0};
+    if (opts) {
+        ret.opts = *opts;
+    }
     ret.mode = playback;
-    ret.start_time = timer_get();
+    ret.idxfd = -1;
+    ret.start_time = timer_get_monotonic();
+    ret.paused = ret.opts.playback_paused;
     ret.recfd = open(path ? path : "aether_recording.dump", O_RDONLY);
     if (ret.recfd == -1) {
         perror("open");
         exit(1);
     }
+    ret.playback_path = strdup(path ? path : "aether_recording.dump");
+    assert(ret.playback_path);
     const int flags = fcntl(ret.recfd, F_GETFL, 0);
     assert(flags != -1);
     const int res = fcntl(ret.recfd, F_SETFL, flags | O_NONBLOCK);
@@ -128,51 +694,193 @@ struct repclient_state repclient_init_playback(const char *path) {
     return ret;
 }
 
+struct repclient_state repclient_init_playback_merge(const char *const *paths, size_t num_paths, const struct repclient_options *opts) {
+    struct repclient_state ret = {0};
+    if (opts) {
+        ret.opts = *opts;
+    }
+    ret.mode = playback;
+    ret.recfd = -1;
+    ret.idxfd = -1;
+    ret.start_time = timer_get_monotonic();
+    ret.paused = ret.opts.playback_paused;
+    assert(num_paths > 0 && num_paths <= (1U << (64 - REPCLIENT_MERGE_WORKER_SHIFT)));
+    ret.num_sources = num_paths;
+    ret.sources = (struct repclient_merge_source *) calloc(num_paths, sizeof(*ret.sources));
+    ret.merge_heap = (uint32_t *) malloc(num_paths * sizeof(*ret.merge_heap));
+    assert(ret.sources && ret.merge_heap);
+    struct repclient_options source_opts = ret.opts;
+    source_opts.playback_unthrottled = true;
+    source_opts.playback_paused = true;
+    int64_t first_start = INT64_MAX;
+    for (size_t i = 0; i < num_paths; i++) {
+        struct repclient_merge_source *const source = &ret.sources[i];
+        source->state = repclient_init_playback_opts(paths[i], &source_opts);
+        source->worker_base = (uint64_t) i << REPCLIENT_MERGE_WORKER_SHIFT;
+        if (playback_start(&source->state) && source->state.info.header.clock_base) {
+            first_start = MIN(first_start, source->state.info.header.clock_base);
+        }
+    }
+    // Recordings that don't say when they started are taken to start with the first
+    for (size_t i = 0; i < num_paths; i++) {
+        const int64_t start = ret.sources[i].state.info.header.clock_base;
+        ret.sources[i].delay = start ? start - first_start : 0;
+    }
+    ret.merge_stale = true;
+    return ret;
+}
+
 void repclient_destroy(struct repclient_state *s) {
+    if (s->io_thread) {
+        io_thread_stop(s->io_thread);
+        free(s->segments);
+        free(s->latest_seen.ids);
+        free(s->latest_seen.gens);
+        return;
+    }
+    if (s->mode == record) {
+        recording_writer_finish(&s->writer);
+    }
+    if (s->uring) {
+        uring_destroy(s->uring);
+    }
+    if (s->recorder) {
+        recorder_destroy(s->recorder);
+    }
+    for (size_t i = 0; s->codecs && i < s->workers.count; i++) {
+        codec_worker_free(&s->codecs[i]);
+    }
+    free(s->codecs);
+    codec_scratch_free(&s->codec_scratch);
     switch (s->mode) {
     case live: {
+        for (size_t i = 0; i < s->workers.count; i++) {
+            ring_free(&s->msgbufs[i]);
+        }
         free(s->msgbufs);
-        free(s->outbuf.buf);
-        // TODO: free the actual bufs
+        worker_table_free(&s->workers);
+        free(s->inbuf.buf);
+        free(s->outq);
+        free(s->outcopies.buf);
         close(s->sockfd);
     } break;
     case record: {
+        for (size_t i = 0; i < s->workers.count; i++) {
+            ring_free(&s->msgbufs[i]);
+        }
         free(s->msgbufs);
-        free(s->outbuf.buf);
-        // TODO: free the actual bufs
+        worker_table_free(&s->workers);
+        free(s->inbuf.buf);
+        free(s->outq);
+        free(s->outcopies.buf);
         close(s->sockfd);
         close(s->recfd);
+        if (s->idxfd != -1) {
+            close(s->idxfd);
+        }
+        free(s->rec_workers);
+        free(s->index_point.buf);
+        free(s->coded.buf);
+        recording_writer_free(&s->writer);
     } break;
     case playback: {
+        for (size_t i = 0; i < s->num_sources; i++) {
+            repclient_destroy(&s->sources[i].state);
+        }
+        free(s->sources);
+        free(s->merge_heap);
         if (s->recfd != -1) {
             close(s->recfd);
         }
         free(s->playback_buf.buf);
+        if (s->playback_map) {
+            munmap(s->playback_map, s->playback_map_len);
+        }
+        free(s->playback_path);
+        recording_info_free(&s->info);
+        recording_index_free(&s->index);
+        free(s->restore);
+        free(s->decoded.buf);
+        worker_table_free(&s->workers);
     } break;
     default:
         abort();
     }
+    free(s->segments);
+    free(s->latest_seen.ids);
+    free(s->latest_seen.gens);
+    free(s->dying);
 }
 
-void repclient_send_message(struct repclient_state *s, const void *data, size_t length) {
-  const size_t total_length = sizeof(uint32_t) + length;
-  const size_t buf_length_new = s->outbuf.len + total_length;
-  msgbuf_reserve(&s->outbuf, buf_length_new);
-  assert(length <= UINT32_MAX);
+static void io_thread_send(struct repclient_io_thread *io, const void *data, size_t length) {
   const uint32_t length_u32 = length;
-  memcpy(s->outbuf.buf + s->outbuf.len, &length_u32, sizeof(uint32_t));
-  s->outbuf.len += sizeof(uint32_t);
-  memcpy(s->outbuf.buf + s->outbuf.len, data, length);
-  s->outbuf.len += length;
-  assert(s->outbuf.len == buf_length_new);
+  pthread_mutex_lock(&io->outgoing_lock);
+  stagebuf_reserve(&io->outgoing, io->outgoing.len + sizeof(uint32_t) + length);
+  memcpy(io->outgoing.buf + io->outgoing.len, &length_u32, sizeof(uint32_t));
+  memcpy(io->outgoing.buf + io->outgoing.len + sizeof(uint32_t), data, length);
+  io->outgoing.len += sizeof(uint32_t) + length;
+  pthread_mutex_unlock(&io->outgoing_lock);
+  io_thread_wake(io);
 }
 
-// Supports both file fds and socket fds, both blocking and nonblocking
-static size_t try_fill_buf(int fd, void *buf, int wanted) {
+static struct repclient_outmsg *outq_push(struct repclient_state *s, size_t length) {
+  assert(length <= UINT32_MAX);
+  if (s->outq_len == s->outq_cap) {
+    s->outq_cap = MAX(s->outq_cap * 2, 64);
+    s->outq = (repclient_outmsg *) realloc(s->outq, s->outq_cap * sizeof(*s->outq));
+    assert(s->outq);
+  }
+  struct repclient_outmsg *msg = &s->outq[s->outq_len++];
+  msg->prefix = length;
+  return msg;
+}
+
+void repclient_send_message(struct repclient_state *s, const void *data, size_t length) {
+  if (s->io_thread) {
+    io_thread_send(s->io_thread, data, length);
+    return;
+  }
+  // Nothing is ever sent during playback
+  if (s->mode == playback) {
+    return;
+  }
+  if (s->outcopies.len + length > MAX_RING_SIZE) {
+    fprintf(stderr, "repclient: outgoing buffer full, dropping %zu byte message\n", length);
+    return;
+  }
+  stagebuf_reserve(&s->outcopies, s->outcopies.len + length);
+  struct repclient_outmsg *msg = outq_push(s, length);
+  msg->copied = true;
+  msg->copy_offset = s->outcopies.len;
+  memcpy(s->outcopies.buf + s->outcopies.len, data, length);
+  s->outcopies.len += length;
+}
+
+void repclient_queue_message(struct repclient_state *s, const void *data, size_t length) {
+  if (s->io_thread) {
+    io_thread_send(s->io_thread, data, length);
+    return;
+  }
+  if (s->mode == playback) {
+    return;
+  }
+  struct repclient_outmsg *msg = outq_push(s, length);
+  msg->copied = false;
+  msg->data = data;
+}
+
+// Supports both file fds and socket fds, both blocking and nonblocking. eof, if given, is
+// set when the read says there is nothing more to come rather than nothing yet.
+static size_t try_fill_buf(int fd, void *buf, int wanted, bool *eof) {
     const ssize_t n = read(fd, buf, wanted);
     if (n > 0) {
         return n;
-    } else if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+    } else if (n == 0) {
+        if (eof) {
+            *eof = true;
+        }
+        return 0;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
         return 0;
     } else {
         perror("invalid read return");
@@ -180,146 +888,1139 @@ static size_t try_fill_buf(int fd, void *buf, int wanted) {
     }
 }
 
+// Gathers every queued prefix and payload into one writev
 static void try_drain_interaction(struct repclient_state *s) {
-    if (s->outbuf.len == 0) {
+    if (s->outq_len == 0) {
       return;
     }
-    const ssize_t written = write(s->sockfd, s->outbuf.buf, s->outbuf.len);
+    struct iovec iov[MAX_WRITE_IOVS];
+    int num_iov = 0;
+    size_t skip = s->outq_partial;
+    for (size_t i = s->outq_done; i < s->outq_len && num_iov + 2 <= MAX_WRITE_IOVS; i++) {
+      struct repclient_outmsg *msg = &s->outq[i];
+      const uint8_t *payload = msg->copied ? s->outcopies.buf + msg->copy_offset : (const uint8_t *) msg->data;
+      if (skip < sizeof(msg->prefix)) {
+        iov[num_iov].iov_base = (uint8_t *) &msg->prefix + skip;
+        iov[num_iov].iov_len = sizeof(msg->prefix) - skip;
+        num_iov++;
+        skip = 0;
+      } else {
+        skip -= sizeof(msg->prefix);
+      }
+      if (msg->prefix > skip) {
+        iov[num_iov].iov_base = (void *) (payload + skip);
+        iov[num_iov].iov_len = msg->prefix - skip;
+        num_iov++;
+      }
+      skip = 0;
+    }
+    const ssize_t written = writev(s->sockfd, iov, num_iov);
+    s->counters.write_calls++;
     if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
       perror("invalid write return");
       exit(EXIT_FAILURE);
-    } else if (written == 0) {
-      assert(errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    size_t left = s->outq_partial + written;
+    while (s->outq_done < s->outq_len && left >= sizeof(uint32_t) + s->outq[s->outq_done].prefix) {
+      left -= sizeof(uint32_t) + s->outq[s->outq_done].prefix;
+      s->outq_done++;
+    }
+    s->outq_partial = left;
+    if (s->outq_done == s->outq_len) {
+      s->outq_len = s->outq_done = s->outq_partial = 0;
+      s->outcopies.len = 0;
+    }
+}
+
+void repclient_flush(struct repclient_state *s) {
+    if (s->io_thread) {
+        io_thread_wake(s->io_thread);
+        return;
+    }
+    while (s->outq_len) {
+        try_drain_interaction(s);
+        if (s->outq_len) {
+            struct pollfd pfd = { s->sockfd, POLLOUT, 0 };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                perror("poll");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+// Notes where every worker's latest record is, for seeking to anywhere after here. The
+// point goes out behind the chunks before it, by whichever backend writes those.
+static void write_index_point(struct repclient_state *s) {
+    struct repclient_stagebuf *const point = &s->index_point;
+    struct recording_index_point_header header;
+    stagebuf_reserve(point, sizeof(header) + s->workers.count * sizeof(struct recording_index_entry));
+    point->len = sizeof(header);
+    for (size_t i = 0; i < s->workers.count; i++) {
+        if (s->rec_workers[i].offset != UINT64_MAX) {
+            memcpy(point->buf + point->len, &s->rec_workers[i], sizeof(s->rec_workers[i]));
+            point->len += sizeof(s->rec_workers[i]);
+        }
+    }
+    header.offset = s->writer.offset;
+    header.time = s->current_packet_time;
+    header.num_entries = (point->len - sizeof(header)) / sizeof(struct recording_index_entry);
+    memcpy(point->buf, &header, sizeof(header));
+    if (s->recorder) {
+        recorder_append_index(s->recorder, point->buf, point->len);
     } else {
-      s->outbuf.len -= written;
-      memmove(s->outbuf.buf, s->outbuf.buf + written, s->outbuf.len);
+        uring_write_index(s->uring, point->buf, point->len);
     }
 }
 
-void write_all(int fd, void* data, size_t size) {
-    size_t writebytes;
-    ssize_t n;
-    for (writebytes = 0; writebytes < size; writebytes += n) {
-        n = write(fd, (char*)data + writebytes, size - writebytes);
-        if (n == -1) {
-            perror("write");
-            exit(1);
+static size_t record_backlog(struct repclient_state *s) {
+    return s->recorder ? recorder_backlog(s->recorder) : uring_write_backlog(s->uring);
+}
+
+// Applies record_policy if the recording is too far behind to take size more bytes.
+// Returns false if the record should be dropped.
+static bool record_has_room(struct repclient_state *s, size_t size) {
+    const size_t limit = s->opts.record_buffer ? s->opts.record_buffer : REPCLIENT_RECORD_BUFFER;
+    size_t backlog;
+    // A record bigger than the whole buffer still goes in once everything before it is out
+    while ((backlog = record_backlog(s)) && backlog + size > limit) {
+        if (s->opts.record_policy == record_drop) {
+            if (!s->record_behind) {
+                fprintf(stderr, "repclient: recording is %zu KiB behind, dropping messages until it catches up\n", backlog >> 10);
+                s->record_behind = true;
+            }
+            s->counters.record_dropped++;
+            return false;
+        }
+        if (s->recorder) {
+            recorder_wait(s->recorder);
+        } else {
+            uring_wait_write(s->uring);
         }
     }
-    assert(writebytes == size);
+    if (s->record_behind) {
+        fprintf(stderr, "repclient: recording caught up, %lu messages dropped so far\n", (unsigned long) s->counters.record_dropped);
+        s->record_behind = false;
+    }
+    return true;
 }
 
-void *__repclient_tick(struct repclient_state *s, uint64_t *worker_id, size_t *length);
-// Although this code exits as soon as a read is too short, it should be asking the OS
-// how many bytes are available and use this
-void *repclient_tick(struct repclient_state *s, uint64_t *worker_id, size_t *length) {
-    switch (s->mode) {
-        case live: {
-            return __repclient_tick(s, worker_id, length);
-        } break;
-        case record: {
-            char* buf = (char *) __repclient_tick(s, worker_id, length);
-            if (buf) {
-                if (!s->start_time.tv_sec && !s->start_time.tv_nsec)
-                    s->start_time = timer_get();
-                s->current_packet_time = timer_diff(timer_get(), s->start_time);
-                write_all(s->recfd, worker_id, sizeof(*worker_id));
-                write_all(s->recfd, &s->current_packet_time, sizeof(s->current_packet_time));
-                write_all(s->recfd, length, sizeof(*length));
-                write_all(s->recfd, buf, *length);
+// Hands bytes that are ready for the file to whichever backend writes the recording
+static void record_write(void *ctx, const void *data, size_t len) {
+    struct repclient_state *const s = (struct repclient_state *) ctx;
+    if (s->recorder) {
+        recorder_append(s->recorder, data, len, NULL, 0, 0);
+    } else {
+        uring_write_record(s->uring, data, len, NULL, 0, 0);
+    }
+}
+
+// Chunks are written out of the buffer records were gathered in, not copied again
+static uint8_t *record_swap(void *ctx, uint8_t *chunk, size_t len, size_t *cap) {
+    struct repclient_state *const s = (struct repclient_state *) ctx;
+    if (s->recorder) {
+        return recorder_swap(s->recorder, chunk, len, cap);
+    }
+    return uring_swap(s->uring, chunk, len, cap);
+}
+
+// Writes the file header once the first record fixes where time 0 is
+static void start_recording(struct repclient_state *s) {
+    s->start_time = timer_get_monotonic();
+    const struct timespec clock_base = timer_get();
+    struct recording_file_header header;
+    recording_file_header_init(&header);
+    header.dims = s->opts.record_dims;
+    header.position_bits = NET_POSITION_BITS;
+    header.point_size = sizeof(struct net_point);
+    header.message_size = sizeof(struct client_message);
+    header.clock_base = (int64_t) clock_base.tv_sec * NS_PER_SECOND + clock_base.tv_nsec;
+    recording_file_header_seal(&header);
+    s->writer.sink = record_write;
+    s->writer.swap = record_swap;
+    s->writer.sink_ctx = s;
+    recording_writer_start(&s->writer, &header);
+}
+
+// Appends the message currently held in s->segments to the recording
+static void record_message(struct repclient_state *s, uint64_t worker_id, size_t length) {
+    if (!s->writer.offset) {
+        start_recording(s);
+    }
+    struct recording_record_header header;
+    if (!record_has_room(s, sizeof(header) + length)) {
+        return;
+    }
+    const uint64_t time = MAX(timer_diff_ns(timer_get_monotonic(), s->start_time), 0);
+    // Index points fall between chunks, which also bounds how stale the file can get
+    if (time >= s->next_index_time) {
+        recording_writer_close_chunk(&s->writer);
+        if (s->idxfd != -1) {
+            write_index_point(s);
+        }
+        s->next_index_time = time + RECORDING_INDEX_INTERVAL;
+    }
+    s->current_packet_time = time;
+
+    assert(!(worker_id & ~RECORDING_WORKER_MASK));
+    struct recording_index_entry *const recorded = &s->rec_workers[s->cur_slot];
+    const struct repclient_segment *segments = s->segments;
+    size_t num_segments = s->num_segments;
+    struct repclient_segment coded;
+    bool keyframe = true;
+    header.worker_id = worker_id;
+    if (s->opts.compress_recording) {
+        struct codec_worker *const codec = &s->codecs[s->cur_slot];
+        keyframe = !codec->synced || time - codec->keyframe_time >= RECORDING_KEYFRAME_INTERVAL;
+        if (keyframe) {
+            codec->keyframe_time = time;
+        }
+        length = codec_encode(codec, &s->codec_scratch, s->segments, s->num_segments, length, keyframe, &s->coded.buf, &s->coded.cap);
+        header.worker_id |= RECORDING_COMPRESSED | (keyframe ? 0 : RECORDING_DELTA);
+        coded.data = s->coded.buf;
+        coded.len = length;
+        segments = &coded;
+        num_segments = 1;
+    }
+    assert(length <= UINT32_MAX);
+    header.time = time;
+    header.length = length;
+
+    uint8_t *dst = recording_writer_reserve(&s->writer, sizeof(header) + length, time);
+    if (keyframe) {
+        recorded->keyframe = s->writer.offset;
+    }
+    recorded->offset = s->writer.offset;
+    memcpy(dst, &header, sizeof(header));
+    dst += sizeof(header);
+    for (size_t i = 0; i < num_segments; i++) {
+        memcpy(dst, segments[i].data, segments[i].len);
+        dst += segments[i].len;
+    }
+    recording_writer_commit(&s->writer, sizeof(header) + length, time);
+}
+
+// How far into the recording playback has got, in nanoseconds
+static uint64_t playback_clock(const struct repclient_state *s) {
+    if (s->paused) {
+        return s->playback_base;
+    }
+    const int64_t elapsed = MAX(timer_diff_ns(timer_get_monotonic(), s->start_time), 0);
+    // Real time stays in whole nanoseconds however long the recording is
+    if (s->opts.playback_speed > 0.0f && s->opts.playback_speed != 1.0f) {
+        return s->playback_base + (uint64_t) (elapsed * (double) s->opts.playback_speed);
+    }
+    return s->playback_base + elapsed;
+}
+
+static void playback_set_clock(struct repclient_state *s, uint64_t time) {
+    s->playback_base = time;
+    s->start_time = timer_get_monotonic();
+}
+
+// Whether a record from the given time into the recording should be handed out yet
+static bool playback_due(const struct repclient_state *s, uint64_t time) {
+    if (s->paused) {
+        return false;
+    }
+    return s->opts.playback_unthrottled || playback_clock(s) >= time;
+}
+
+// Maps whatever the recording has grown to since it was last mapped
+static void playback_remap(struct repclient_state *s) {
+    struct stat st;
+    if (fstat(s->recfd, &st) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    const size_t size = st.st_size;
+    if (size <= s->playback_map_len) {
+        return;
+    }
+    void *map = s->playback_map
+        ? mremap(s->playback_map, s->playback_map_len, size, MREMAP_MAYMOVE)
+        : mmap(NULL, size, PROT_READ, MAP_PRIVATE, s->recfd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    s->playback_map = (uint8_t *) map;
+    s->playback_map_len = size;
+}
+
+// Like playback_read, but the record is read in place from the mapping
+static void *playback_read_mapped(struct repclient_state *s, uint64_t *worker_id, size_t *length) {
+    if (!s->playback_map) {
+        playback_remap(s);
+        if (!s->playback_map) {
+            return NULL;
+        }
+    }
+    struct recording_record record;
+    while (true) {
+        enum recording_status status = recording_read_record(&s->info, s->recfd, s->playback_map, s->playback_map_len, &s->cursor, &record, true);
+        if (status == recording_short) {
+            playback_remap(s);
+            status = recording_read_record(&s->info, s->recfd, s->playback_map, s->playback_map_len, &s->cursor, &record, true);
+        }
+        if (status != recording_ok) {
+            return NULL;
+        }
+        if (record.offset >= s->playback_skip) {
+            break;
+        }
+        s->cursor.offset = record.next;
+    }
+    *worker_id = record.worker_id;
+    *length = record.length;
+    s->current_packet_time = record.time;
+    if (!playback_due(s, s->current_packet_time)) {
+        return NULL;
+    }
+    s->msg_offset = record.data;
+    s->cursor.offset = record.next;
+    return s->playback_map + s->msg_offset;
+}
+
+// Reads until playback_buf holds wanted bytes from pos. Returns false if the recording
+// doesn't have them yet.
+static bool playback_fill(struct repclient_state *s, size_t wanted) {
+    struct repclient_stagebuf *playbuf = &s->playback_buf;
+    stagebuf_reserve(playbuf, playbuf->pos + wanted);
+    while (playbuf->len - playbuf->pos < wanted) {
+        const size_t n = try_fill_buf(s->recfd, playbuf->buf + playbuf->len, playbuf->pos + wanted - playbuf->len, NULL);
+        if (n == 0) {
+            return false;
+        }
+        playbuf->len += n;
+    }
+    return true;
+}
+
+// Like playback_read for recordings made of chunks. Each chunk is read whole and checked
+// before any of its records are handed out, and stays in playback_buf while they are.
+static void *playback_read_chunked(struct repclient_state *s, uint64_t *worker_id, size_t *length) {
+    struct repclient_stagebuf *playbuf = &s->playback_buf;
+    struct recording_cursor *cursor = &s->cursor;
+    while (true) {
+        if (cursor->offset == UINT64_MAX) {
+            return NULL;
+        }
+        if (cursor->offset == cursor->chunk_end) {
+            struct recording_chunk_header chunk;
+            if (!playback_fill(s, sizeof(chunk))) {
+                return NULL;
             }
-            return buf;
-        } break;
-        case playback: {
-            // Note that the playback file could be truncated at any point, and we'd really like
-            // to just return NULLs once we reach the 'end', even if it's not been correctly closed
-            if (s->recfd == -1) {
+            memcpy(&chunk, playbuf->buf + playbuf->pos, sizeof(chunk));
+            if (memcmp(chunk.magic, RECORDING_TABLE_MAGIC, sizeof(chunk.magic)) == 0) {
                 return NULL;
             }
-            const size_t headersize = sizeof(*worker_id) + sizeof(s->current_packet_time) + sizeof(*length);
-            struct repclient_msgbuf *playbuf = &s->playback_buf;
-            msgbuf_reserve(playbuf, headersize);
-
-            while (playbuf->len < headersize) {
-                const size_t n = try_fill_buf(s->recfd, playbuf->buf + playbuf->len, headersize - playbuf->len);
-                playbuf->len += n;
-                if (n == 0) {
-                    return NULL;
+            if (!recording_chunk_valid(&chunk)) {
+                // No telling how long it is, so carry on from wherever the table says
+                playbuf->pos = playbuf->len;
+                if (recording_skip_chunk(&s->info, cursor, cursor->offset, 0) && lseek(s->recfd, cursor->offset, SEEK_SET) == -1) {
+                    perror("lseek");
+                    exit(EXIT_FAILURE);
                 }
+                continue;
             }
-            memcpy(worker_id,               playbuf->buf, sizeof(*worker_id));
-            memcpy(&s->current_packet_time, playbuf->buf + sizeof(*worker_id), sizeof(s->current_packet_time));
-            memcpy(length,                  playbuf->buf + sizeof(*worker_id) + sizeof(s->current_packet_time), sizeof(*length));
-
-            msgbuf_reserve(playbuf, headersize + *length);
-            while (playbuf->len != *length + headersize) {
-                const size_t n = try_fill_buf(s->recfd, playbuf->buf + playbuf->len, headersize + *length - playbuf->len);
-                playbuf->len += n;
-                if (n == 0) {
-                    return NULL;
+            const size_t chunk_size = sizeof(chunk) + chunk.length;
+            if (!playback_fill(s, chunk_size)) {
+                return NULL;
+            }
+            if (recording_checksum(playbuf->buf + playbuf->pos + sizeof(chunk), chunk.length) != chunk.data_checksum) {
+                recording_skip_chunk(&s->info, cursor, cursor->offset, cursor->offset + chunk_size);
+                playbuf->pos += chunk_size;
+                continue;
+            }
+            playbuf->pos += sizeof(chunk);
+            cursor->offset += sizeof(chunk);
+            cursor->chunk_end = cursor->offset + chunk.length;
+        }
+
+        // All of the chunk is in playback_buf from here on
+        struct recording_record_header header;
+        const uint64_t left = cursor->chunk_end - cursor->offset;
+        if (left >= sizeof(header)) {
+            memcpy(&header, playbuf->buf + playbuf->pos, sizeof(header));
+        }
+        if (left < sizeof(header) || header.length > left - sizeof(header)) {
+            recording_skip_chunk(&s->info, cursor, cursor->offset, cursor->chunk_end);
+            playbuf->pos += left;
+            continue;
+        }
+        const size_t recordsize = sizeof(header) + header.length;
+        if (cursor->offset < s->playback_skip) {
+            playbuf->pos += recordsize;
+            cursor->offset += recordsize;
+            continue;
+        }
+        *worker_id = header.worker_id;
+        *length = header.length;
+        s->current_packet_time = header.time;
+        if (!playback_due(s, s->current_packet_time)) {
+            return NULL;
+        }
+        s->msg_offset = playbuf->pos + sizeof(header);
+        playbuf->pos += recordsize;
+        cursor->offset += recordsize;
+        return playbuf->buf + s->msg_offset;
+    }
+}
+
+// Reads the record at playback_buf.pos, leaving it there until it is due
+static void *playback_read(struct repclient_state *s, uint64_t *worker_id, size_t *length) {
+    if (s->opts.mmap_playback) {
+        return playback_read_mapped(s, worker_id, length);
+    }
+    if (s->info.version != 1) {
+        return playback_read_chunked(s, worker_id, length);
+    }
+    struct recording_header_v1 header;
+    const size_t headersize = sizeof(header);
+    struct repclient_stagebuf *playbuf = &s->playback_buf;
+    stagebuf_reserve(playbuf, playbuf->pos + headersize);
+
+    while (playbuf->len - playbuf->pos < headersize) {
+        const size_t n = try_fill_buf(s->recfd, playbuf->buf + playbuf->len, headersize - (playbuf->len - playbuf->pos), NULL);
+        playbuf->len += n;
+        if (n == 0) {
+            return NULL;
+        }
+    }
+    memcpy(&header, playbuf->buf + playbuf->pos, sizeof(header));
+    *worker_id = header.worker_id;
+    *length = header.length;
+
+    const size_t recordsize = headersize + *length;
+    stagebuf_reserve(playbuf, playbuf->pos + recordsize);
+    while (playbuf->len - playbuf->pos != recordsize) {
+        const size_t n = try_fill_buf(s->recfd, playbuf->buf + playbuf->len, recordsize - (playbuf->len - playbuf->pos), NULL);
+        playbuf->len += n;
+        if (n == 0) {
+            return NULL;
+        }
+    }
+    s->current_packet_time = MAX(header.time, 0.0f) * (double) NS_PER_SECOND;
+    if (!playback_due(s, s->current_packet_time)) {
+        return NULL;
+    } else {
+        s->msg_offset = playbuf->pos + headersize;
+        playbuf->pos = playbuf->len;
+        return playbuf->buf + s->msg_offset;
+    }
+}
+
+static void pread_all(int fd, void *buf, size_t size, uint64_t offset) {
+    const ssize_t n = pread(fd, buf, size, offset);
+    if (n == -1) {
+        perror("pread");
+        exit(EXIT_FAILURE);
+    }
+    assert((size_t) n == size);
+}
+
+// The worker's slot in playback, where its codec lives
+static uint32_t playback_slot(struct repclient_state *s, uint64_t worker_id) {
+    const size_t known = s->workers.count;
+    const uint32_t slot = worker_table_insert(&s->workers, worker_id);
+    if (s->workers.count == known) {
+        return slot;
+    }
+    if (slot == s->codecs_cap) {
+        s->codecs_cap = MAX(s->codecs_cap * 2, 16);
+        s->codecs = (codec_worker *) realloc(s->codecs, s->codecs_cap * sizeof(*s->codecs));
+        assert(s->codecs);
+    }
+    s->codecs[slot] = codec_worker();
+    return slot;
+}
+
+// Hands out the message a codec last decoded. It is copied, as the worker's next record
+// could be decoded before the caller is done with this one.
+static void *playback_decoded(struct repclient_state *s, const struct codec_worker *codec, size_t *length) {
+    struct repclient_stagebuf *decoded = &s->decoded;
+    stagebuf_reserve(decoded, decoded->len + codec->prev_len);
+    memcpy(decoded->buf + decoded->len, codec->prev, codec->prev_len);
+    s->msg_offset = decoded->len;
+    s->msg_decoded = true;
+    decoded->len += codec->prev_len;
+    *length = codec->prev_len;
+    return decoded->buf + s->msg_offset;
+}
+
+// Hands out the next of the records noted by repclient_seek, or NULL if it has to be skipped
+static void *playback_restore(struct repclient_state *s, uint64_t *worker_id, size_t *length) {
+    const uint64_t offset = s->restore[s->restore_pos++];
+    struct recording_record record;
+    recording_read_record_at(&s->info, s->recfd, s->opts.mmap_playback ? s->playback_map : NULL, s->playback_map_len, offset, &record);
+    *worker_id = record.worker_id & RECORDING_WORKER_MASK;
+    if (record.worker_id & RECORDING_COMPRESSED) {
+        // The seek has already decoded up to here
+        const struct codec_worker *codec = &s->codecs[worker_table_find(&s->workers, *worker_id)];
+        if (!codec->synced) {
+            return NULL;
+        }
+        const struct repclient_segment decoded = { codec->prev, codec->prev_len };
+        if (message_cell_dying(&decoded, 1)) {
+            worker_dying(s, *worker_id);
+        }
+        return playback_decoded(s, codec, length);
+    }
+    *length = record.length;
+    if (s->opts.mmap_playback) {
+        s->msg_offset = record.data;
+        return s->playback_map + s->msg_offset;
+    }
+    // Nothing can be part read straight after a seek
+    struct repclient_stagebuf *playbuf = &s->playback_buf;
+    stagebuf_reserve(playbuf, playbuf->pos + record.length);
+    pread_all(s->recfd, playbuf->buf + playbuf->pos, record.length, record.data);
+    s->msg_offset = playbuf->pos;
+    playbuf->pos = playbuf->len = playbuf->pos + record.length;
+    return playbuf->buf + s->msg_offset;
+}
+
+// Reads the recording's file header, once there is one. Returns false until then.
+static bool playback_start(struct repclient_state *s) {
+    if (s->opts.mmap_playback) {
+        playback_remap(s);
+    }
+    const enum recording_status status = recording_info_read(&s->info, s->recfd, s->opts.mmap_playback ? s->playback_map : NULL, s->playback_map_len);
+    if (status == recording_damaged) {
+        close(s->recfd);
+        s->recfd = -1;
+    }
+    if (status != recording_ok) {
+        return false;
+    }
+    s->cursor = recording_cursor_start(&s->info);
+    if (!s->opts.mmap_playback && lseek(s->recfd, s->info.data_offset, SEEK_SET) == -1) {
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+// Hands out the next message that is due, decoding it if the recording is compressed
+static void *playback_next(struct repclient_state *s, uint64_t *worker_id, size_t *length) {
+    // Note that the playback file could be truncated at any point, and we'd really like
+    // to just return NULLs once we reach the 'end', even if it's not been correctly closed
+    if (s->recfd == -1 || (!s->info.version && !playback_start(s))) {
+        return NULL;
+    }
+    s->msg_decoded = false;
+    while (s->restore_pos < s->num_restore) {
+        void *const msg = playback_restore(s, worker_id, length);
+        if (msg) {
+            return msg;
+        }
+    }
+    while (true) {
+        void *const data = playback_read(s, worker_id, length);
+        if (!data || !(*worker_id & RECORDING_COMPRESSED)) {
+            return data;
+        }
+        const bool keyframe = !(*worker_id & RECORDING_DELTA);
+        *worker_id &= RECORDING_WORKER_MASK;
+        const uint32_t slot = playback_slot(s, *worker_id);
+        struct codec_worker *const codec = &s->codecs[slot];
+        if (codec_decode(codec, &s->codec_scratch, (const uint8_t *) data, *length, keyframe)) {
+            const struct repclient_segment decoded = { codec->prev, codec->prev_len };
+            if (message_cell_dying(&decoded, 1)) {
+                worker_dying(s, *worker_id);
+            }
+            return playback_decoded(s, codec, length);
+        }
+        // Deltas that don't follow on from what we have, after a record was dropped from
+        // the recording or damaged, are skipped until the worker's next keyframe
+    }
+}
+
+// Decodes a compressed record, for repclient_seek
+static void playback_seek_decode(struct repclient_state *s, uint32_t slot, const uint8_t *map, const struct recording_record *record) {
+    const uint8_t *data = map + record->data;
+    if (!map) {
+        stagebuf_reserve(&s->playback_buf, record->length);
+        pread_all(s->recfd, s->playback_buf.buf, record->length, record->data);
+        data = s->playback_buf.buf;
+    }
+    codec_decode(&s->codecs[slot], &s->codec_scratch, data, record->length, !(record->worker_id & RECORDING_DELTA));
+}
+
+// Where a message handed out in playback is, from its msg_offset and msg_decoded
+static void *playback_at(const struct repclient_state *s, uint64_t offset) {
+    if (s->sources) {
+        s = &s->sources[(offset & ~DECODED_OFFSET) >> SOURCE_SHIFT].state;
+        offset &= DECODED_OFFSET | ((1ULL << SOURCE_SHIFT) - 1);
+    }
+    if (offset & DECODED_OFFSET) {
+        return s->decoded.buf + (offset & ~DECODED_OFFSET);
+    }
+    return (s->opts.mmap_playback ? s->playback_map : s->playback_buf.buf) + offset;
+}
+
+static bool merge_before(const struct repclient_state *s, uint32_t a, uint32_t b) {
+    const uint64_t x = s->sources[a].next_time, y = s->sources[b].next_time;
+    return x < y || (x == y && a < b);
+}
+
+static void merge_push(struct repclient_state *s, uint32_t source) {
+    size_t i = s->merge_heap_len++;
+    while (i > 0 && merge_before(s, source, s->merge_heap[(i - 1) / 2])) {
+        s->merge_heap[i] = s->merge_heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->merge_heap[i] = source;
+}
+
+static void merge_pop(struct repclient_state *s) {
+    const uint32_t last = s->merge_heap[--s->merge_heap_len];
+    size_t i = 0;
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= s->merge_heap_len) {
+            break;
+        }
+        if (child + 1 < s->merge_heap_len && merge_before(s, s->merge_heap[child + 1], s->merge_heap[child])) {
+            child++;
+        }
+        if (!merge_before(s, s->merge_heap[child], last)) {
+            break;
+        }
+        s->merge_heap[i] = s->merge_heap[child];
+        i = child;
+    }
+    s->merge_heap[i] = last;
+}
+
+// Queues a source by when its next record is from, if it has one yet
+static void merge_peek(struct repclient_state *s, uint32_t i) {
+    struct repclient_merge_source *const source = &s->sources[i];
+    struct repclient_state *const from = &source->state;
+    assert(!source->queued);
+    if (from->restore_pos < from->num_restore) {
+        // Handed out as of the time sought to, which current_packet_time still is
+    } else {
+        uint64_t worker_id;
+        size_t length;
+        // Being paused, this only reads as far as the next record
+        from->current_packet_time = UINT64_MAX;
+        playback_next(from, &worker_id, &length);
+        if (from->current_packet_time == UINT64_MAX) {
+            return;
+        }
+    }
+    source->next_time = from->current_packet_time + source->delay;
+    source->queued = true;
+    merge_push(s, i);
+}
+
+// Hands out the earliest record of any of the recordings once it is due
+static void *merge_next(struct repclient_state *s, uint64_t *worker_id, size_t *length) {
+    if (s->merge_stale) {
+        for (size_t i = 0; i < s->num_sources; i++) {
+            if (!s->sources[i].queued) {
+                merge_peek(s, i);
+            }
+        }
+        s->merge_stale = false;
+    }
+    while (s->merge_heap_len) {
+        const uint32_t i = s->merge_heap[0];
+        struct repclient_merge_source *const source = &s->sources[i];
+        struct repclient_state *const from = &source->state;
+        s->current_packet_time = source->next_time;
+        if (!playback_due(s, source->next_time)) {
+            return NULL;
+        }
+        merge_pop(s);
+        source->queued = false;
+        from->paused = false;
+        const bool got = playback_next(from, worker_id, length) != NULL;
+        from->paused = true;
+        // Otherwise it is looked at again next tick
+        if (got) {
+            assert(from->msg_offset < (1ULL << SOURCE_SHIFT));
+            *worker_id += source->worker_base;
+            s->msg_offset = from->msg_offset | ((uint64_t) i << SOURCE_SHIFT);
+            s->msg_decoded = from->msg_decoded;
+            // Reading on can move the buffer the message is in
+            merge_peek(s, i);
+            return playback_at(s, s->msg_offset | (s->msg_decoded ? DECODED_OFFSET : 0));
+        }
+    }
+    return NULL;
+}
+
+static void merge_seek(struct repclient_state *s, uint64_t until) {
+    for (size_t i = 0; i < s->num_sources; i++) {
+        struct repclient_merge_source *const source = &s->sources[i];
+        repclient_seek(&source->state, until > source->delay ? until - source->delay : 0);
+        source->queued = false;
+    }
+    s->merge_heap_len = 0;
+    s->merge_stale = true;
+    s->current_packet_time = until;
+    playback_set_clock(s, until);
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+void repclient_seek(struct repclient_state *s, int64_t time) {
+    assert(s->mode == playback);
+    const uint64_t until = MAX(time, 0);
+    if (s->sources) {
+        merge_seek(s, until);
+        return;
+    }
+    if (s->recfd == -1 || (!s->info.version && !playback_start(s))) {
+        return;
+    }
+    if (s->opts.mmap_playback) {
+        playback_remap(s);
+    }
+    const uint8_t *const map = s->opts.mmap_playback ? s->playback_map : NULL;
+    if (!s->index.loaded && !recording_index_load(&s->index, s->playback_path)) {
+        recording_index_build(&s->index, &s->info, s->recfd, map, s->playback_map_len);
+    }
+    // The seek may restore them, so they are only forgotten again once it has
+    s->num_dying = 0;
+    for (size_t i = 0; i < s->workers.count; i++) {
+        s->codecs[i].synced = false;
+    }
+
+    // Start from the nearest point before, then walk forward to the exact time. Workers
+    // whose latest record is a delta need decoding from their keyframe, so go back to the
+    // point before that.
+    uint64_t *latest = (uint64_t *) malloc(MAX(s->codecs_cap, 1) * sizeof(*latest));
+    assert(latest);
+    for (size_t i = 0; i < s->workers.count; i++) {
+        latest[i] = UINT64_MAX;
+    }
+    const struct recording_index_point *point = recording_index_find(&s->index, until);
+    const struct recording_index_entry *const entries = point ? &s->index.entries[point->first_entry] : NULL;
+    const size_t num_entries = point ? point->num_entries : 0;
+    uint64_t offset = point ? point->offset : s->info.data_offset;
+    for (size_t i = 0; i < num_entries; i++) {
+        if (entries[i].keyframe != entries[i].offset && entries[i].keyframe < offset) {
+            const struct recording_index_point *before = recording_index_find_offset(&s->index, entries[i].keyframe);
+            offset = before ? before->offset : s->info.data_offset;
+        }
+    }
+    struct recording_record record;
+    for (size_t i = 0; i < num_entries; i++) {
+        const size_t cap = s->codecs_cap;
+        const uint32_t slot = playback_slot(s, entries[i].worker_id);
+        if (s->codecs_cap != cap) {
+            latest = (uint64_t *) realloc(latest, s->codecs_cap * sizeof(*latest));
+            assert(latest);
+        }
+        latest[slot] = entries[i].offset;
+        // Anything later gets decoded on the way through
+        if (entries[i].offset < offset) {
+            recording_read_record_at(&s->info, s->recfd, map, s->playback_map_len, entries[i].offset, &record);
+            if (record.worker_id & RECORDING_COMPRESSED) {
+                playback_seek_decode(s, slot, map, &record);
+            }
+        }
+    }
+    // Playback carries on from the start of the chunk it stopped in, skipping what is covered
+    struct recording_cursor cursor = { offset, offset };
+    uint64_t resume = offset;
+    while (true) {
+        if (cursor.offset == cursor.chunk_end) {
+            resume = cursor.offset;
+        }
+        if (recording_read_record(&s->info, s->recfd, map, s->playback_map_len, &cursor, &record, false) != recording_ok) {
+            break;
+        }
+        if (record.time > until) {
+            cursor.offset = record.offset;
+            break;
+        }
+        const size_t cap = s->codecs_cap;
+        const uint32_t slot = playback_slot(s, record.worker_id & RECORDING_WORKER_MASK);
+        if (s->codecs_cap != cap) {
+            latest = (uint64_t *) realloc(latest, s->codecs_cap * sizeof(*latest));
+            assert(latest);
+        }
+        latest[slot] = record.offset;
+        if (record.worker_id & RECORDING_COMPRESSED) {
+            playback_seek_decode(s, slot, map, &record);
+        }
+        cursor.offset = record.next;
+    }
+
+    // Restored in the order they were recorded
+    free(s->restore);
+    s->restore = latest;
+    s->num_restore = 0;
+    for (size_t i = 0; i < s->workers.count; i++) {
+        if (latest[i] != UINT64_MAX) {
+            s->restore[s->num_restore++] = latest[i];
+        }
+    }
+    s->restore_pos = 0;
+    qsort(s->restore, s->num_restore, sizeof(*s->restore), compare_offsets);
+
+    s->cursor.offset = s->cursor.chunk_end = resume;
+    s->playback_skip = cursor.offset;
+    s->playback_buf.pos = s->playback_buf.len = 0;
+    if (!s->opts.mmap_playback && lseek(s->recfd, resume, SEEK_SET) == -1) {
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+    s->current_packet_time = until;
+    playback_set_clock(s, until);
+}
+
+void repclient_pause(struct repclient_state *s) {
+    assert(s->mode == playback);
+    if (!s->paused) {
+        playback_set_clock(s, playback_clock(s));
+        s->paused = true;
+    }
+}
+
+void repclient_resume(struct repclient_state *s) {
+    assert(s->mode == playback);
+    if (s->paused) {
+        s->start_time = timer_get_monotonic();
+        s->paused = false;
+    }
+}
+
+void repclient_set_speed(struct repclient_state *s, float speed) {
+    assert(s->mode == playback);
+    playback_set_clock(s, playback_clock(s));
+    s->opts.playback_speed = speed;
+}
+
+// Gives up a dead worker's slot, with its ring, codec and place in the index. Slots are
+// kept dense, so the last worker moves into the one freed.
+static void forget_worker(struct repclient_state *s, const uint64_t worker_id) {
+    const uint32_t slot = worker_table_find(&s->workers, worker_id);
+    if (slot == WORKER_TABLE_NONE) {
+        return;
+    }
+    if (s->msgbufs) {
+        struct repclient_msgbuf *const msgbuf = &s->msgbufs[slot];
+        const bool current = s->cur_header_got == sizeof(s->cur_header) && s->cur_slot == slot;
+        // Anything after its last message means it isn't gone after all
+        if (msgbuf->pos != msgbuf->len || (current && s->cur_header.len)) {
+            return;
+        }
+        if (current) {
+            s->cur_header_got = 0;
+        }
+    }
+    worker_table_remove(&s->workers, worker_id);
+    const uint32_t last = s->workers.count;
+    if (s->msgbufs) {
+        ring_free(&s->msgbufs[slot]);
+        s->msgbufs[slot] = s->msgbufs[last];
+    }
+    if (s->rec_workers) {
+        s->rec_workers[slot] = s->rec_workers[last];
+    }
+    if (s->codecs) {
+        codec_worker_free(&s->codecs[slot]);
+        s->codecs[slot] = s->codecs[last];
+    }
+    if (s->cur_slot == last) {
+        s->cur_slot = slot;
+    }
+}
+
+// Everything handed out by the previous tick or batch may be reused from here on
+static void release_messages(struct repclient_state *s) {
+    for (size_t i = 0; i < s->num_dying; i++) {
+        forget_worker(s, s->dying[i]);
+    }
+    s->num_dying = 0;
+    if (s->io_thread) {
+        io_thread_release(s->io_thread);
+        return;
+    }
+    switch (s->mode) {
+        case live:
+        case record: {
+            for (size_t i = 0; i < s->workers.count; i++) {
+                s->msgbufs[i].keep = s->msgbufs[i].pos;
+            }
+        } break;
+        case playback: {
+            if (s->sources) {
+                for (size_t i = 0; i < s->num_sources; i++) {
+                    release_messages(&s->sources[i].state);
                 }
+                s->merge_stale = true;
+                break;
             }
-            if (timer_diff(timer_get(), s->start_time) < s->current_packet_time) {
-                return NULL;
-            } else {
-                playbuf->len = 0;
-                return playbuf->buf + headersize;
+            // Only a partly read record, or the rest of a chunk, can be left behind. It is
+            // moved down once it is no bigger than what's been used, so that a chunk isn't
+            // moved again for every record handed out of it.
+            struct repclient_stagebuf *playbuf = &s->playback_buf;
+            if (playbuf->pos > 0 && playbuf->len - playbuf->pos <= playbuf->pos) {
+                memmove(playbuf->buf, playbuf->buf + playbuf->pos, playbuf->len - playbuf->pos);
+                playbuf->len -= playbuf->pos;
+                playbuf->pos = 0;
             }
+            s->decoded.pos = s->decoded.len = 0;
         } break;
         default:
             abort();
     }
 }
-void *__repclient_tick(struct repclient_state *s, uint64_t *worker_id, size_t *length) {
-    try_drain_interaction(s);
-    while (true) {
-        // try to recv the multiplexer header
-        if (s->cur_header_got < sizeof(s->cur_header)) {
-            const ssize_t wanted = sizeof(s->cur_header) - s->cur_header_got;
-            const size_t n = try_fill_buf(s->sockfd, (uint8_t *)&s->cur_header + s->cur_header_got, wanted);
-            s->cur_header_got += n;
-            if (s->cur_header_got != sizeof(s->cur_header)) {
-                return NULL;
+
+// The next message from whichever source this state reads, without releasing earlier ones
+static void *next_message(struct repclient_state *s, uint64_t *worker_id, size_t *length, bool contiguous) {
+    switch (s->mode) {
+        case live: {
+            return __repclient_tick(s, worker_id, length, contiguous);
+        } break;
+        case record: {
+            char* buf = (char *) __repclient_tick(s, worker_id, length, contiguous);
+            if (buf) {
+                record_message(s, *worker_id, *length);
             }
+            return buf;
+        } break;
+        case playback: {
+            return s->sources ? merge_next(s, worker_id, length) : playback_next(s, worker_id, length);
+        } break;
+        default:
+            abort();
+    }
+}
+
+// Although this code exits as soon as a read is too short, it should be asking the OS
+// how many bytes are available and use this
+void *repclient_tick(struct repclient_state *s, uint64_t *worker_id, size_t *length) {
+    release_messages(s);
+    if (s->io_thread) {
+        struct repclient_message msg;
+        if (!io_thread_take(s, &msg, 1)) {
+            return NULL;
+        }
+        *worker_id = msg.worker_id;
+        *length = msg.len;
+        return msg.data;
+    }
+    if (s->mode != playback) {
+        try_drain_interaction(s);
+    }
+    void *const msg = next_message(s, worker_id, length, true);
+    submit_io(s, msg == NULL);
+    return msg;
+}
+
+size_t repclient_tick_batch(struct repclient_state *s, struct repclient_message *out, size_t max) {
+    release_messages(s);
+    if (s->io_thread) {
+        return io_thread_take(s, out, max);
+    }
+    if (s->mode != playback) {
+        try_drain_interaction(s);
+    }
+    // Buffers can still grow (and move) while the batch is gathered, so each message is
+    // held as an offset into its buffer until the end
+    size_t n;
+    for (n = 0; n < max; n++) {
+        if (!next_message(s, &out[n].worker_id, &out[n].len, true)) {
+            break;
+        }
+        out[n].data = (void *) (uintptr_t) (s->msg_offset | (s->msg_decoded ? DECODED_OFFSET : 0));
+    }
+    submit_io(s, n < max);
+    if (s->opts.latest_only) {
+        n = keep_latest(s, out, n);
+    }
+    for (size_t i = 0; i < n; i++) {
+        const uint64_t offset = (uintptr_t) out[i].data;
+        if (s->mode == playback) {
+            out[i].data = playback_at(s, offset);
+        } else {
+            out[i].data = ring_at(&s->msgbufs[worker_table_find(&s->workers, out[i].worker_id)], offset);
+        }
+    }
+    return n;
+}
+
+// Pull everything the socket has ready into the staging buffer with a single read.
+// Only called once the staging buffer has been fully demultiplexed.
+static size_t fill_inbuf(struct repclient_state *s) {
+    struct repclient_stagebuf *inbuf = &s->inbuf;
+    assert(inbuf->pos == inbuf->len);
+    inbuf->pos = inbuf->len = 0;
+    stagebuf_reserve(inbuf, INGEST_BUF_SIZE);
+    size_t n;
+    if (s->uring) {
+        n = uring_reap(s->uring, inbuf->buf, inbuf->cap);
+    } else {
+        n = try_fill_buf(s->sockfd, inbuf->buf, inbuf->cap, &s->sock_eof);
+        s->counters.read_calls++;
+    }
+    s->counters.bytes_in += n;
+    inbuf->len = n;
+    return n;
+}
+
+// Milliseconds until the chunk the recording is gathering has waited long enough to be
+// closed while the stream is quiet, or -1 if there is no chunk open
+static int record_flush_wait(const struct repclient_state *s) {
+    if (!s->writer.chunk_len) {
+        return -1;
+    }
+    const uint64_t time = MAX(timer_diff_ns(timer_get_monotonic(), s->start_time), 0);
+    const uint64_t due = s->writer.chunk_header.first_time + RECORDING_FLUSH_INTERVAL;
+    return time >= due ? 0 : (int) ((due - time + 999999) / 1000000);
+}
+
+// Hands the kernel any receive rearmed or recording written since the last submit. Until
+// the caller has caught up, recording is left to gather into bigger writes, and a chunk
+// is only closed early once its records have waited RECORDING_FLUSH_INTERVAL.
+static void submit_io(struct repclient_state *s, bool idle) {
+    if (idle && record_flush_wait(s) == 0) {
+        recording_writer_close_chunk(&s->writer);
+    }
+    if (s->uring && uring_submit(s->uring, idle)) {
+        s->counters.uring_enters++;
+    }
+    if (s->recorder && idle) {
+        recorder_flush(s->recorder);
+    }
+}
+
+const struct repclient_segment *repclient_tick_segments(struct repclient_state *s, uint64_t *worker_id, size_t *num_segments, size_t *length) {
+    if (s->io_thread || s->mode == playback) {
+        // These already hand back one contiguous buffer
+        void *const buf = repclient_tick(s, worker_id, length);
+        if (!buf) {
+            return NULL;
+        }
+        segments_reserve(s, 1);
+        s->segments[0].data = buf;
+        s->segments[0].len = *length;
+        s->num_segments = 1;
+    } else {
+        release_messages(s);
+        try_drain_interaction(s);
+        const bool got = __repclient_tick(s, worker_id, length, false);
+        if (got && s->mode == record) {
+            record_message(s, *worker_id, *length);
+        }
+        submit_io(s, !got);
+        if (!got) {
+            return NULL;
+        }
+    }
+    *num_segments = s->num_segments;
+    return s->segments;
+}
+
+// Finds the buffer slot for a worker, adding one if this is the first we've heard of it
+static uint32_t worker_slot(struct repclient_state *s, const uint64_t worker_id) {
+    const size_t known = s->workers.count;
+    const uint32_t slot = worker_table_insert(&s->workers, worker_id);
+    if (s->workers.count == known) {
+        return slot;
+    }
+    if (slot == s->msgbufs_cap) {
+        s->msgbufs_cap = MAX(s->msgbufs_cap * 2, 16);
+        s->msgbufs = (repclient_msgbuf *) realloc(s->msgbufs, s->msgbufs_cap * sizeof(struct repclient_msgbuf));
+        assert(s->msgbufs);
+        if (s->mode == record) {
+            s->rec_workers = (recording_index_entry *) realloc(s->rec_workers, s->msgbufs_cap * sizeof(*s->rec_workers));
+            assert(s->rec_workers);
         }
+        if (s->mode == record && s->opts.compress_recording) {
+            s->codecs_cap = s->msgbufs_cap;
+            s->codecs = (codec_worker *) realloc(s->codecs, s->codecs_cap * sizeof(*s->codecs));
+            assert(s->codecs);
+        }
+    }
+    s->msgbufs[slot] = repclient_msgbuf();
+    if (s->mode == record) {
+        s->rec_workers[slot].worker_id = worker_id;
+        s->rec_workers[slot].offset = UINT64_MAX;
+        s->rec_workers[slot].keyframe = UINT64_MAX;
+    }
+    if (s->codecs) {
+        s->codecs[slot] = codec_worker();
+    }
+    return slot;
+}
 
-        // Add new connection if necessary
-        uint64_t wid = s->cur_header.id;
-        if (wid + 1 > s->num_conns) {
-            uint64_t old_size = s->num_conns;
-            while (wid + 1 > s->num_conns)
-                s->num_conns *= 2;
-            s->msgbufs = (repclient_msgbuf *) realloc(s->msgbufs, s->num_conns * sizeof(struct repclient_msgbuf));
-            assert(s->msgbufs);
-            for (uint64_t i = old_size; i < s->num_conns; i++) {
-                s->msgbufs[i] = repclient_msgbuf();
+void *__repclient_tick(struct repclient_state *s, uint64_t *worker_id, size_t *length, bool contiguous) {
+    struct repclient_stagebuf *inbuf = &s->inbuf;
+    // A short read means the socket is empty, so don't ask again during this call
+    bool may_read = true;
+    while (true) {
+        // try to take the multiplexer header out of the staging buffer
+        while (s->cur_header_got < sizeof(s->cur_header)) {
+            if (inbuf->pos == inbuf->len) {
+                if (!may_read) {
+                    return NULL;
+                }
+                may_read = fill_inbuf(s) == inbuf->cap;
+                if (inbuf->len == 0) {
+                    return NULL;
+                }
+            }
+            const size_t n = MIN(sizeof(s->cur_header) - s->cur_header_got, inbuf->len - inbuf->pos);
+            memcpy((uint8_t *)&s->cur_header + s->cur_header_got, inbuf->buf + inbuf->pos, n);
+            s->cur_header_got += n;
+            inbuf->pos += n;
+            if (s->cur_header_got == sizeof(s->cur_header)) {
+                s->cur_slot = worker_slot(s, s->cur_header.id);
             }
         }
-        assert(wid < s->num_conns);
 
-        // Fill the client buffer
-        struct repclient_msgbuf *msgbuf = &s->msgbufs[wid];
+        // Fill the client buffer from whatever is staged for this worker
+        const uint64_t wid = s->cur_header.id;
+        struct repclient_msgbuf *msgbuf = &s->msgbufs[s->cur_slot];
         if (s->cur_header.len) {
-            // shift the buf back to the beginning since we're going to be receiving network data
-            if (msgbuf->pos > 0) {
-                memmove(msgbuf->buf, msgbuf->buf + msgbuf->pos, msgbuf->len - msgbuf->pos);
-                msgbuf->len -= msgbuf->pos;
-                msgbuf->pos = 0;
+            if (inbuf->pos == inbuf->len && may_read) {
+                may_read = fill_inbuf(s) == inbuf->cap;
             }
-            // Initialise buf for first time, or give enough slack to avoid reads of tiny numbers of bytes
-            if (msgbuf->cap - msgbuf->len < MIN_SLACK_BYTES) {
-                msgbuf_reserve(msgbuf, MAX(MIN_BUF_SIZE, msgbuf->cap * 2));
+            size_t n = MIN(s->cur_header.len, inbuf->len - inbuf->pos);
+            if (msgbuf->discarding) {
+                const size_t skipped = ring_discard(msgbuf, inbuf->buf + inbuf->pos, n);
+                inbuf->pos += skipped;
+                s->cur_header.len -= skipped;
+                n -= skipped;
+            }
+            if (n > 0) {
+                if (!ring_reserve(msgbuf, n)) {
+                    fprintf(stderr, "repclient: message from worker %lu exceeds %d bytes, skipping it\n", wid, MAX_RING_SIZE);
+                    s->counters.oversized++;
+                    ring_discard_partial(msgbuf);
+                    continue;
+                }
+                memcpy(ring_at(msgbuf, msgbuf->len), inbuf->buf + inbuf->pos, n);
+                inbuf->pos += n;
+                s->cur_header.len -= n;
+                msgbuf->len += n;
             }
-            const int wanted = MIN(s->cur_header.len, msgbuf->cap - msgbuf->len);
-            const size_t n = try_fill_buf(s->sockfd, msgbuf->buf + msgbuf->len, wanted);
-            s->cur_header.len -= n;
-            msgbuf->len += n;
         }
 
         // Return a message if present
-        void *msg = consume_message(msgbuf, length);
+        void *msg = consume_message(s, msgbuf, length, contiguous);
         if (msg != NULL) {
             *worker_id = wid;
+            s->counters.messages++;
+            if (message_cell_dying(s->segments, s->num_segments)) {
+                worker_dying(s, wid);
+            }
             return msg;
         } else if (s->cur_header.len > 0) {
             return NULL;
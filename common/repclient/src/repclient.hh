@@ -16,46 +16,252 @@
 
 #pragma once
 
+#include <worker_table.hh>
+#include "recording.hh"
+#include "codec.hh"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// A flat buffer that is refilled from the start once everything in it has been used.
 // This needs to make sense when zeroed
-struct repclient_msgbuf {
+struct repclient_stagebuf {
     size_t pos;
     size_t len; // actually 'endpos'
     size_t cap;
     uint8_t *buf;
 };
 
+// A ring whose storage is mapped twice back to back, so any span of up to cap bytes
+// starting inside it is contiguous in memory and data never has to be shifted down.
+// pos and len only ever increase; they are reduced modulo cap to index buf.
+// Bytes from keep onwards may still be in the caller's hands and are never overwritten.
+// This needs to make sense when zeroed
+struct repclient_msgbuf {
+    uint64_t keep;
+    uint64_t pos;
+    uint64_t len; // actually 'endpos'
+    size_t cap;
+    uint8_t *buf;
+    // Throwing away the rest of a message too big for the buffer, as it arrives
+    bool discarding;
+    uint64_t skip;      // bytes left of the segment being thrown away
+    uint32_t prefix;    // the next segment's length, once prefix_got reaches its size
+    uint8_t prefix_got;
+};
+
+// One piece of a message as it arrived from the multiplexer
+struct repclient_segment {
+    const void *data;
+    size_t len;
+};
+
+// A message waiting to go out. Payloads copied by repclient_send_message live in
+// repclient_state.outcopies and are found by offset, since that buffer may move.
+struct repclient_outmsg {
+    const void *data;
+    uint64_t copy_offset;
+    uint32_t prefix;
+    bool copied;
+};
+
+// A message handed out by repclient_tick_batch
+struct repclient_message {
+    uint64_t worker_id;
+    void *data;
+    size_t len;
+};
+
 enum REPCLIENT_MODE {
     live, record, playback,
 };
 
+// Running totals for the live socket, so callers can see how many
+// syscalls each message costs
+struct repclient_counters {
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t messages;
+    uint64_t bytes_in;
+    uint64_t uring_enters; // io_uring submissions, which replace reads and recording writes
+    uint64_t dropped; // messages skipped for a newer one from the same worker, see latest_only
+    uint64_t record_dropped; // messages left out of the recording, see record_policy
+    uint64_t oversized; // messages thrown away for being bigger than a worker's buffer can grow
+};
+
+// The worker ids seen in one pass over a batch. Bumping gen empties it.
+// This needs to make sense when zeroed
+struct repclient_idset {
+    uint64_t *ids;
+    uint32_t *gens;
+    size_t cap;
+    uint32_t gen;
+};
+
+enum REPCLIENT_BACKEND {
+    backend_syscalls, backend_io_uring,
+};
+
+#define REPCLIENT_RECORD_BUFFER (64 * 1024 * 1024)
+#define REPCLIENT_MERGE_WORKER_SHIFT 48
+
+// What recording does once record_buffer bytes are waiting for the disk
+enum REPCLIENT_RECORD_POLICY {
+    record_drop,  // leave messages out of the recording until it catches up
+    record_block, // stop reading the socket until it catches up
+};
+
+// Init-time settings for repclient_init_opts and friends.
+// This needs to make sense when zeroed
+struct repclient_options {
+    bool threaded; // own the socket from a background thread, see repclient_io_thread
+    // backend_io_uring falls back to backend_syscalls if the kernel can't provide it
+    enum REPCLIENT_BACKEND backend;
+    // Every message is a full snapshot of its worker, so when several from one worker are
+    // ready at once only the newest is handed out and the rest are counted as dropped.
+    // Recordings still get everything.
+    bool latest_only;
+    // Playback maps the recording and hands out pointers into the mapping rather than
+    // reading it. The mapping is extended if the file is still growing.
+    bool mmap_playback;
+    // Recording is written from memory in the background. record_buffer bounds how much
+    // may be waiting (0 for REPCLIENT_RECORD_BUFFER) and record_policy says what happens
+    // beyond that. Either way the message is still handed out.
+    size_t record_buffer;
+    enum REPCLIENT_RECORD_POLICY record_policy;
+    // Recordings store messages as deltas against each worker's previous one, see codec.hh.
+    // Playback reads either kind of recording whatever this is set to.
+    bool compress_recording;
+    // Written into the recording's header for tools to go by: 2 or 3 for how the positions
+    // in client_messages are encoded, or 0 if the caller doesn't say
+    uint8_t record_dims;
+    // How fast playback goes through the recording: 0 for real time, or a factor such as
+    // 0.25 or 8. Unthrottled playback hands every record out as soon as it has been read,
+    // which is how recordings are used as benchmarks. See also repclient_pause.
+    float playback_speed;
+    bool playback_unthrottled;
+    bool playback_paused; // start paused, until repclient_resume
+};
+
+struct repclient_io_thread;
+struct repclient_merge_source;
+struct repclient_uring;
+struct repclient_recorder;
+
 struct repclient_state {
-    uint64_t num_conns;
-    struct repclient_msgbuf *msgbufs;
+    struct repclient_options opts;
+    struct repclient_io_thread *io_thread;
+    struct repclient_uring *uring; // NULL unless the io_uring backend is in use
+    struct repclient_recorder *recorder; // writes the recording when uring doesn't
+    struct worker_table workers;
+    struct repclient_msgbuf *msgbufs; // by worker slot
+    size_t msgbufs_cap;
     int sockfd;
     int recfd;
     enum REPCLIENT_MODE mode;
-    struct timespec start_time;
-    float current_packet_time;
-    struct repclient_msgbuf playback_buf;
+    struct timespec start_time; // from the monotonic clock, see also playback_base
+    uint64_t current_packet_time; // nanoseconds into the recording of the latest message
+    uint64_t playback_base; // how far into the recording playback was at start_time
+    bool paused;
+    struct repclient_stagebuf playback_buf;
+    uint8_t *playback_map; // the whole recording when it is mapped, else playback_buf is used
+    size_t playback_map_len;
+    struct recording_info info; // read once the recording has enough in it to tell
+    struct recording_cursor cursor; // at the next record, or in read mode at playback_buf.pos
+    uint64_t playback_skip; // records before this were covered by a seek
+    char *playback_path;
+    struct recording_index index; // loaded on the first seek
+    uint64_t *restore; // offsets of the records to hand out straight after a seek
+    size_t num_restore;
+    size_t restore_pos;
+    struct repclient_stagebuf decoded; // compressed records decoded since the last tick
+    bool msg_decoded; // the message at msg_offset is in decoded
+
+    // Merging several recordings, see repclient_init_playback_merge
+    struct repclient_merge_source *sources; // NULL unless merging
+    size_t num_sources;
+    uint32_t *merge_heap; // sources with a record waiting, earliest first
+    size_t merge_heap_len;
+    bool merge_stale; // sources with nothing waiting haven't been looked at since the last tick
+
+    // Compressed recordings, coded when recording and decoded in playback
+    struct codec_worker *codecs; // by worker slot
+    size_t codecs_cap;
+    struct codec_scratch codec_scratch;
+    struct repclient_stagebuf coded;
+
+    struct recording_writer writer; // hands chunks to the recorder or uring
+
+    // Writing the index alongside a recording
+    int idxfd; // -1 if there is no index
+    struct recording_index_entry *rec_workers; // by slot, offset UINT64_MAX until recorded
+    struct repclient_stagebuf index_point; // the point being written, header and entries
+    uint64_t next_index_time;
+    bool record_behind; // dropping records until the disk catches up
 
     struct __attribute__((packed)) multiplexer_header {
         uint64_t id;
         uint64_t len;
     } cur_header;
     size_t cur_header_got;
-    struct repclient_msgbuf outbuf;
+    uint32_t cur_slot; // worker slot of cur_header, once it has all arrived
+    uint64_t *dying; // workers whose cell has gone, to be forgotten at the next release
+    size_t num_dying;
+    size_t dying_cap;
+    struct repclient_stagebuf inbuf; // staging for bulk socket reads, demultiplexed in place
+    bool sock_eof; // a read of the socket has come back with end of file
+    struct repclient_outmsg *outq;
+    size_t outq_len;
+    size_t outq_cap;
+    size_t outq_done;    // messages at the front of outq that have been written
+    size_t outq_partial; // bytes of outq[outq_done] (prefix included) already written
+    struct repclient_stagebuf outcopies;
+    struct repclient_counters counters;
+    struct repclient_segment *segments;
+    size_t num_segments;
+    size_t segments_cap;
+    uint64_t msg_offset; // where the last message starts in its buffer
+    struct repclient_idset latest_seen;
 };
 
 struct repclient_state repclient_init(const char *host, const char *port);
+struct repclient_state repclient_init_opts(const char *host, const char *port, const struct repclient_options *opts);
 struct repclient_state repclient_init_record(const char *host, const char *port, const char *path);
+struct repclient_state repclient_init_record_opts(const char *host, const char *port, const char *path, const struct repclient_options *opts);
 struct repclient_state repclient_init_playback(const char *path);
+struct repclient_state repclient_init_playback_opts(const char *path, const struct repclient_options *opts);
+// Plays several recordings back as one, such as those taken by a recorder per region.
+// Records are merged in time order, with the recordings lined up by when each started if
+// they say. Recording i's worker ids have i << REPCLIENT_MERGE_WORKER_SHIFT added to keep
+// them apart. Only the next record of each recording is held, so memory stays the same
+// however many are merged beyond a chunk each, or a mapping with mmap_playback.
+struct repclient_state repclient_init_playback_merge(const char *const *paths, size_t num_paths, const struct repclient_options *opts);
 void repclient_destroy(struct repclient_state *s);
+// Moves playback to the given number of nanoseconds into the recording. The next ticks
+// hand out the latest message each worker had sent by then, after which playback carries
+// on from there at the playback speed. Anything handed out before is no longer valid.
+void repclient_seek(struct repclient_state *s, int64_t time);
+// Stops playback handing out messages, and its clock, until repclient_resume
+void repclient_pause(struct repclient_state *s);
+void repclient_resume(struct repclient_state *s);
+// Changes opts.playback_speed, carrying on from where playback has got to
+void repclient_set_speed(struct repclient_state *s, float speed);
 void *repclient_tick(struct repclient_state *s, uint64_t *worker_id, size_t *msg_size);
+// Fills out with up to max messages that are ready now. Everything handed out stays valid
+// until the next call to any of the tick functions. Returns the number of messages.
+size_t repclient_tick_batch(struct repclient_state *s, struct repclient_message *out, size_t max);
+// Like repclient_tick, but hands the message back as the segments it arrived in rather
+// than coalescing them. The segments are valid until the next call.
+const struct repclient_segment *repclient_tick_segments(struct repclient_state *s, uint64_t *worker_id, size_t *num_segments, size_t *msg_size);
+// Queues a copy of data to be sent with the rest of this frame's messages
 void repclient_send_message(struct repclient_state *s, const void *data, size_t length);
+// Queues data without copying it; it must stay valid until repclient_flush has returned.
+// Threaded mode always copies.
+void repclient_queue_message(struct repclient_state *s, const void *data, size_t length);
+// Writes everything queued, waiting for the socket if need be. In threaded mode this
+// only hands the queue to the I/O thread.
+void repclient_flush(struct repclient_state *s);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,531 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "repclient.hh"
+#include "uring.hh"
+
+#ifdef IORING_RECV_MULTISHOT
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 64
+#define URING_BUF_SIZE (64 * 1024)
+#define URING_BGID 0
+// user_data of the receive and of buffer hand-backs; writes carry their uring_write
+#define URING_RECV_TAG 0
+#define URING_PROVIDE_TAG 1
+
+#define URING_WRITE_CHUNK (256 * 1024) // recording bytes gathered before a write is queued
+
+// A write to the recording or its index, freed when it completes. The data follows it,
+// unless it is a chunk handed over by uring_swap, which may be kept in spare instead.
+struct uring_write {
+    struct uring_write *next; // in spare
+    size_t len;
+    size_t cap;
+    uint8_t *data;
+};
+
+// A received buffer waiting to be copied out
+struct uring_ready {
+    uint16_t bid;
+    uint32_t pos;
+    uint32_t len;
+};
+
+struct repclient_uring {
+    int fd;
+    int eventfd;
+    int sockfd;
+    int recfd;
+    int idxfd;
+
+    uint8_t *rings;
+    size_t rings_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_flags, *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_local_tail; // published to *sq_tail on submit
+    unsigned to_submit;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Every buffer is either with the kernel, in ready, or in returned
+    uint8_t *bufs;
+    size_t kernel_bufs;
+    struct uring_ready ready[URING_BUF_COUNT];
+    size_t ready_head, ready_count;
+    uint16_t returned[URING_BUF_COUNT];
+    size_t num_returned;
+    bool recv_armed;
+    bool eof; // the receive saw the end of the stream; ready may still hold data
+
+    uint64_t rec_offset;
+    uint64_t idx_offset;
+    size_t writes_in_flight;
+    size_t bytes_in_flight;
+    struct uring_write *pending; // recording bytes not yet queued
+    struct uring_write *spare;   // written chunks from uring_swap, to hand back in the next
+    size_t num_spare;            // up to RECORDING_SPARE_CHUNKS
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static struct io_uring_sqe *get_sqe(struct repclient_uring *u) {
+    while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == *u->sq_entries) {
+        uring_submit(u, false);
+    }
+    const unsigned idx = u->sq_local_tail & *u->sq_mask;
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    u->to_submit++;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void provide_bufs(struct repclient_uring *u, const uint16_t bid, const uint16_t count) {
+    struct io_uring_sqe *sqe = get_sqe(u);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uintptr_t) (u->bufs + (size_t) bid * URING_BUF_SIZE);
+    sqe->len = URING_BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_BGID;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_PROVIDE_TAG;
+    u->kernel_bufs += count;
+}
+
+static void arm_recv(struct repclient_uring *u) {
+    struct io_uring_sqe *sqe = get_sqe(u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = u->sockfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_RECV_TAG;
+    u->recv_armed = true;
+}
+
+// Hands back everything copied out, one request per run of consecutive buffer ids. These
+// go ahead of a rearmed receive in the submission queue and are done inline, so the
+// receive always finds them. Until then the kernel is out of buffers and the socket
+// backs up, which is what keeps a slow caller from buffering without limit.
+static void return_bufs(struct repclient_uring *u) {
+    size_t i = 0;
+    while (i < u->num_returned) {
+        const uint16_t start = u->returned[i];
+        uint16_t count = 1;
+        while (i + count < u->num_returned && u->returned[i + count] == start + count) {
+            count++;
+        }
+        provide_bufs(u, start, count);
+        i += count;
+    }
+    u->num_returned = 0;
+    if (!u->recv_armed && !u->eof && u->kernel_bufs) {
+        arm_recv(u);
+    }
+}
+
+// Empties the completion queue, so it can never fill up behind data the caller has no
+// room for yet: receives are parked in ready and finished writes are freed
+static void collect(struct repclient_uring *u) {
+    if (__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) {
+        // Shouldn't happen, but the kernel only moves overflowed completions back when asked
+        sys_io_uring_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS);
+    }
+    unsigned head = *u->cq_head;
+    const unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        if (cqe->user_data == URING_RECV_TAG) {
+            if (cqe->res > 0) {
+                struct uring_ready *ready = &u->ready[(u->ready_head + u->ready_count) % URING_BUF_COUNT];
+                ready->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                ready->pos = 0;
+                ready->len = cqe->res;
+                u->ready_count++;
+                u->kernel_bufs--;
+            } else if (cqe->res == 0) {
+                u->eof = true;
+            } else if (cqe->res != -ENOBUFS) {
+                // ENOBUFS just means the caller fell behind; we rearm once buffers are back
+                fprintf(stderr, "io_uring recv: %s\n", strerror(-cqe->res));
+                exit(EXIT_FAILURE);
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                u->recv_armed = false;
+            }
+        } else if (cqe->user_data == URING_PROVIDE_TAG) {
+            fprintf(stderr, "io_uring provide buffers: %s\n", strerror(-cqe->res));
+            exit(EXIT_FAILURE);
+        } else {
+            struct uring_write *write = (struct uring_write *) (uintptr_t) cqe->user_data;
+            if (cqe->res < 0 || (size_t) cqe->res != write->len) {
+                fprintf(stderr, "io_uring recording write: %s\n", cqe->res < 0 ? strerror(-cqe->res) : "short write");
+                exit(EXIT_FAILURE);
+            }
+            u->writes_in_flight--;
+            u->bytes_in_flight -= write->len;
+            const bool inline_data = write->data == (uint8_t *) (write + 1);
+            if (!inline_data && u->num_spare < RECORDING_SPARE_CHUNKS) {
+                write->next = u->spare;
+                u->spare = write;
+                u->num_spare++;
+                continue;
+            }
+            if (!inline_data) {
+                free(write->data);
+            }
+            free(write);
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void unmap_all(struct repclient_uring *u) {
+    if (u->rings)
+        munmap(u->rings, u->rings_size);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->eventfd != -1)
+        close(u->eventfd);
+    close(u->fd);
+    free(u->bufs);
+    free(u->pending);
+    while (u->spare) {
+        struct uring_write *const next = u->spare->next;
+        free(u->spare->data);
+        free(u->spare);
+        u->spare = next;
+    }
+    free(u);
+}
+
+struct repclient_uring *uring_create(int sockfd, int recfd, int idxfd) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const int fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct repclient_uring *u = (struct repclient_uring *) calloc(1, sizeof(*u));
+    assert(u);
+    u->fd = fd;
+    u->eventfd = -1;
+    u->sockfd = sockfd;
+    u->recfd = recfd;
+    u->idxfd = idxfd;
+    // The index already starts with its magic
+    if (idxfd != -1) {
+        const off_t idx_offset = lseek(idxfd, 0, SEEK_CUR);
+        assert(idx_offset != -1);
+        u->idx_offset = idx_offset;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        unmap_all(u);
+        return NULL;
+    }
+
+    u->rings_size = MAX(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    void *rings = mmap(NULL, u->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        unmap_all(u);
+        return NULL;
+    }
+    u->rings = (uint8_t *) rings;
+    u->sq_head = (unsigned *) (u->rings + params.sq_off.head);
+    u->sq_tail = (unsigned *) (u->rings + params.sq_off.tail);
+    u->sq_mask = (unsigned *) (u->rings + params.sq_off.ring_mask);
+    u->sq_entries = (unsigned *) (u->rings + params.sq_off.ring_entries);
+    u->sq_flags = (unsigned *) (u->rings + params.sq_off.flags);
+    u->sq_array = (unsigned *) (u->rings + params.sq_off.array);
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned *) (u->rings + params.cq_off.head);
+    u->cq_tail = (unsigned *) (u->rings + params.cq_off.tail);
+    u->cq_mask = (unsigned *) (u->rings + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (u->rings + params.cq_off.cqes);
+
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        unmap_all(u);
+        return NULL;
+    }
+    u->sqes = (struct io_uring_sqe *) sqes;
+
+    // Multishot receive came in 6.0, along with IORING_OP_SEND_ZC, which we can probe for
+    if (!(params.features & IORING_FEAT_CQE_SKIP)) {
+        unmap_all(u);
+        return NULL;
+    }
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    assert(probe);
+    const bool probed = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const bool has_recv = probed && probe->last_op >= IORING_OP_SEND_ZC;
+    free(probe);
+    if (!has_recv) {
+        unmap_all(u);
+        return NULL;
+    }
+
+    u->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (u->eventfd == -1 || sys_io_uring_register(fd, IORING_REGISTER_EVENTFD, &u->eventfd, 1) < 0) {
+        unmap_all(u);
+        return NULL;
+    }
+
+    // Left for the first uring_submit, so the receive belongs to whichever thread drives the ring
+    u->bufs = (uint8_t *) malloc((size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+    assert(u->bufs);
+    provide_bufs(u, 0, URING_BUF_COUNT);
+    arm_recv(u);
+    return u;
+}
+
+size_t uring_reap(struct repclient_uring *u, uint8_t *dst, size_t cap) {
+    collect(u);
+    size_t n = 0;
+    while (u->ready_count && n < cap) {
+        struct uring_ready *ready = &u->ready[u->ready_head];
+        const size_t len = MIN(ready->len - ready->pos, cap - n);
+        memcpy(dst + n, u->bufs + (size_t) ready->bid * URING_BUF_SIZE + ready->pos, len);
+        n += len;
+        ready->pos += len;
+        if (ready->pos == ready->len) {
+            u->returned[u->num_returned++] = ready->bid;
+            u->ready_head = (u->ready_head + 1) % URING_BUF_COUNT;
+            u->ready_count--;
+        }
+    }
+    return_bufs(u);
+    return n;
+}
+
+bool uring_ready(const struct repclient_uring *u) {
+    return u->ready_count != 0;
+}
+
+bool uring_closed(const struct repclient_uring *u) {
+    return u->eof && !u->ready_count;
+}
+
+int uring_eventfd(const struct repclient_uring *u) {
+    return u->eventfd;
+}
+
+// Every write says where it goes, so none is linked to the one before. A link would also
+// take in whatever buffer hand-backs and receives were queued in between, and fail or
+// hold them up along with the write.
+static void queue_write(struct repclient_uring *u, struct uring_write *write, int fd, uint64_t *offset) {
+    struct io_uring_sqe *sqe = get_sqe(u);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) write->data;
+    sqe->len = write->len;
+    sqe->off = *offset;
+    sqe->user_data = (uintptr_t) write;
+    *offset += write->len;
+    u->writes_in_flight++;
+    u->bytes_in_flight += write->len;
+}
+
+static void queue_pending_write(struct repclient_uring *u) {
+    struct uring_write *write = u->pending;
+    u->pending = NULL;
+    queue_write(u, write, u->recfd, &u->rec_offset);
+}
+
+void uring_write_record(struct repclient_uring *u, const void *header, size_t header_len,
+                        const struct repclient_segment *segments, size_t num_segments, size_t length) {
+    const size_t used = u->pending ? u->pending->len : 0;
+    const size_t wanted = used + header_len + length;
+    if (!u->pending || u->pending->cap < wanted) {
+        const size_t cap = MAX(wanted, URING_WRITE_CHUNK);
+        u->pending = (struct uring_write *) realloc(u->pending, sizeof(*u->pending) + cap);
+        assert(u->pending);
+        u->pending->len = used;
+        u->pending->cap = cap;
+        u->pending->data = (uint8_t *) (u->pending + 1);
+    }
+    uint8_t *const data = u->pending->data;
+    memcpy(data + used, header, header_len);
+    size_t pos = used + header_len;
+    for (size_t i = 0; i < num_segments; i++) {
+        memcpy(data + pos, segments[i].data, segments[i].len);
+        pos += segments[i].len;
+    }
+    assert(pos == wanted);
+    u->pending->len = wanted;
+    if (wanted >= URING_WRITE_CHUNK) {
+        queue_pending_write(u);
+    }
+}
+
+uint8_t *uring_swap(struct repclient_uring *u, uint8_t *chunk, size_t len, size_t *cap) {
+    // Whatever was appended before has to go first
+    if (u->pending) {
+        queue_pending_write(u);
+    }
+    // A written chunk goes back to the caller, and its write carries this one
+    struct uring_write *write = u->spare;
+    uint8_t *next;
+    size_t next_cap;
+    if (write) {
+        u->spare = write->next;
+        u->num_spare--;
+        next = write->data;
+        next_cap = write->cap;
+    } else {
+        write = (struct uring_write *) malloc(sizeof(*write));
+        next_cap = *cap;
+        next = (uint8_t *) malloc(next_cap);
+        assert(write && next);
+    }
+    write->len = len;
+    write->cap = *cap;
+    write->data = chunk;
+    queue_write(u, write, u->recfd, &u->rec_offset);
+    *cap = next_cap;
+    return next;
+}
+
+void uring_write_index(struct repclient_uring *u, const void *data, size_t len) {
+    struct uring_write *write = (struct uring_write *) malloc(sizeof(*write) + len);
+    assert(write);
+    write->len = len;
+    write->cap = len;
+    write->data = (uint8_t *) (write + 1);
+    memcpy(write->data, data, len);
+    queue_write(u, write, u->idxfd, &u->idx_offset);
+}
+
+bool uring_submit(struct repclient_uring *u, bool flush) {
+    collect(u);
+    if (flush && u->pending) {
+        queue_pending_write(u);
+    }
+    if (u->to_submit == 0) {
+        return false;
+    }
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    while (u->to_submit) {
+        const int n = sys_io_uring_enter(u->fd, u->to_submit, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        u->to_submit -= n;
+    }
+    return true;
+}
+
+size_t uring_write_backlog(const struct repclient_uring *u) {
+    return u->bytes_in_flight + (u->pending ? u->pending->len : 0);
+}
+
+void uring_wait_write(struct repclient_uring *u) {
+    uring_submit(u, true);
+    if (!u->writes_in_flight) {
+        return;
+    }
+    if (sys_io_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+        perror("io_uring_enter");
+        exit(EXIT_FAILURE);
+    }
+    collect(u);
+}
+
+void uring_destroy(struct repclient_uring *u) {
+    while (u->writes_in_flight || u->pending) {
+        uring_wait_write(u);
+    }
+    unmap_all(u);
+}
+
+#else
+
+struct repclient_uring *uring_create(int sockfd, int recfd, int idxfd) {
+    return NULL;
+}
+void uring_destroy(struct repclient_uring *u) {
+    abort();
+}
+size_t uring_reap(struct repclient_uring *u, uint8_t *dst, size_t cap) {
+    abort();
+}
+bool uring_ready(const struct repclient_uring *u) {
+    abort();
+}
+bool uring_closed(const struct repclient_uring *u) {
+    abort();
+}
+int uring_eventfd(const struct repclient_uring *u) {
+    abort();
+}
+void uring_write_record(struct repclient_uring *u, const void *header, size_t header_len,
+                        const struct repclient_segment *segments, size_t num_segments, size_t length) {
+    abort();
+}
+uint8_t *uring_swap(struct repclient_uring *u, uint8_t *chunk, size_t len, size_t *cap) {
+    abort();
+}
+void uring_write_index(struct repclient_uring *u, const void *data, size_t len) {
+    abort();
+}
+bool uring_submit(struct repclient_uring *u, bool flush) {
+    abort();
+}
+size_t uring_write_backlog(const struct repclient_uring *u) {
+    abort();
+}
+void uring_wait_write(struct repclient_uring *u) {
+    abort();
+}
+
+#endif
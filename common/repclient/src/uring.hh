@@ -0,0 +1,64 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// io_uring backend for librepclient. The socket is read by a multishot receive into
+// buffers provided to the kernel up front, and recording writes are queued at their
+// offsets in the file, so a busy client only enters the kernel to submit.
+
+struct repclient_uring;
+struct repclient_segment;
+
+// Returns NULL if the kernel (or the headers we were built with) can't do it.
+// recfd is -1 when not recording, and idxfd when there is no index to write. Nothing
+// reaches the kernel until the first uring_submit, which should come from the thread
+// that will reap.
+struct repclient_uring *uring_create(int sockfd, int recfd, int idxfd);
+// Waits for outstanding recording writes before tearing the ring down
+void uring_destroy(struct repclient_uring *u);
+
+// Copies up to cap bytes of completed receives into dst and hands their buffers back
+// to the kernel. Also retires finished recording writes.
+size_t uring_reap(struct repclient_uring *u, uint8_t *dst, size_t cap);
+// True if received data is waiting for uring_reap. Its completions were already
+// signalled on the eventfd, so this has to be checked before waiting on it again.
+bool uring_ready(const struct repclient_uring *u);
+// True once the other end has closed the connection and everything has been reaped
+bool uring_closed(const struct repclient_uring *u);
+// Signalled by the kernel whenever a completion is posted
+int uring_eventfd(const struct repclient_uring *u);
+
+// Appends header followed by the segments to the recording. Records are gathered into
+// large writes, each at the offset it belongs at.
+void uring_write_record(struct repclient_uring *u, const void *header, size_t header_len,
+                        const struct repclient_segment *segments, size_t num_segments, size_t length);
+// Queues len bytes of the recording in chunk, which is written from where it is and
+// freed afterwards. Returns a buffer of *cap bytes to gather the next lot in.
+uint8_t *uring_swap(struct repclient_uring *u, uint8_t *chunk, size_t len, size_t *cap);
+// Queues len bytes for the end of the index
+void uring_write_index(struct repclient_uring *u, const void *data, size_t len);
+// Submits anything queued, including a partly gathered recording write if flush is set.
+// Returns true if that took a syscall.
+bool uring_submit(struct repclient_uring *u, bool flush);
+// Recording bytes accepted by uring_write_record that haven't reached the file yet
+size_t uring_write_backlog(const struct repclient_uring *u);
+// Submits any recording write gathered so far and waits for at least one to finish
+void uring_wait_write(struct repclient_uring *u);
@@ -0,0 +1,196 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+// A peer that sends a burst of messages and then shuts down its side of the connection
+// before the client has read them. Every message has to come out of every mode, however
+// much of the burst was still in the kernel when the shutdown arrived, and recordings
+// have to play back the same.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include <timer.hh>
+#include "repclient.hh"
+
+#define NUM_WORKERS 9
+#define NUM_MESSAGES 4000
+#define PAYLOAD_SIZE 2000
+#define QUIET_NS 2000000000LL // how long without a message before the client gives up
+
+struct peer {
+    int listenfd;
+};
+
+static void write_all(int fd, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+    while (len) {
+        const ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void *peer_main(void *arg) {
+    struct peer *peer = (struct peer *) arg;
+    const int fd = accept(peer->listenfd, NULL, NULL);
+    if (fd < 0) {
+        perror("accept");
+        exit(EXIT_FAILURE);
+    }
+    // A multiplexer header, then one segment and the terminator
+    uint8_t frame[16 + 4 + PAYLOAD_SIZE + 4];
+    const uint64_t len = sizeof(frame) - 16;
+    const uint32_t segment = PAYLOAD_SIZE;
+    const uint32_t end = 0;
+    memcpy(frame + 8, &len, sizeof(len));
+    memcpy(frame + 16, &segment, sizeof(segment));
+    memcpy(frame + 20 + PAYLOAD_SIZE, &end, sizeof(end));
+    for (uint64_t i = 0; i < NUM_MESSAGES; i++) {
+        const uint64_t worker_id = i % NUM_WORKERS;
+        memcpy(frame, &worker_id, sizeof(worker_id));
+        memset(frame + 20, (int) i, PAYLOAD_SIZE);
+        write_all(fd, frame, sizeof(frame));
+    }
+    shutdown(fd, SHUT_WR);
+    // Hold the connection open until the client goes away
+    uint8_t buf[256];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    close(fd);
+    return NULL;
+}
+
+static bool check_message(const struct repclient_message *msg, uint64_t i) {
+    const uint8_t *data = (const uint8_t *) msg->data;
+    return msg->len == PAYLOAD_SIZE && msg->worker_id == i % NUM_WORKERS &&
+           data[0] == (uint8_t) i && data[PAYLOAD_SIZE - 1] == (uint8_t) i;
+}
+
+// The recording has to hold the same messages, in order
+static uint64_t play_back(const char *path, bool *ok) {
+    struct repclient_options opts = {};
+    opts.playback_unthrottled = true;
+    struct repclient_state s = repclient_init_playback_opts(path, &opts);
+    uint64_t played = 0;
+    struct repclient_message batch[64];
+    size_t n;
+    while ((n = repclient_tick_batch(&s, batch, 64))) {
+        for (size_t i = 0; i < n; i++) {
+            *ok = *ok && check_message(&batch[i], played);
+            played++;
+        }
+    }
+    repclient_destroy(&s);
+    return played;
+}
+
+static bool run(const char *name, const struct repclient_options *opts, const char *record_path) {
+    struct peer peer;
+    peer.listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    if (peer.listenfd < 0 || bind(peer.listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(peer.listenfd, 1) < 0 || getsockname(peer.listenfd, (struct sockaddr *) &addr, &addrlen) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    char port[16];
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, peer_main, &peer) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct repclient_state s = record_path ? repclient_init_record_opts("127.0.0.1", port, record_path, opts)
+                                           : repclient_init_opts("127.0.0.1", port, opts);
+    // Let the peer get as far as the kernel allows, so the shutdown arrives with a backlog
+    usleep(200 * 1000);
+
+    uint64_t received = 0;
+    bool ok = true;
+    struct repclient_message batch[64];
+    struct timespec last = timer_get_monotonic();
+    while (received < NUM_MESSAGES && timer_diff_ns(timer_get_monotonic(), last) < QUIET_NS) {
+        const size_t n = repclient_tick_batch(&s, batch, 64);
+        for (size_t i = 0; i < n; i++) {
+            ok = ok && check_message(&batch[i], received);
+            received++;
+        }
+        if (n) {
+            last = timer_get_monotonic();
+        } else {
+            usleep(1000);
+        }
+    }
+    repclient_destroy(&s);
+    pthread_join(thread, NULL);
+    close(peer.listenfd);
+    ok = ok && received == NUM_MESSAGES;
+    if (record_path) {
+        ok = play_back(record_path, &ok) == NUM_MESSAGES && ok;
+        unlink(record_path);
+        char index_path[256];
+        snprintf(index_path, sizeof(index_path), "%s%s", record_path, RECORDING_INDEX_SUFFIX);
+        unlink(index_path);
+    }
+
+    printf("%-24s %s: %lu of %d messages\n", name, ok ? "ok" : "FAILED", (unsigned long) received, NUM_MESSAGES);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    char record_path[] = "/tmp/repclient_half_close_XXXXXX";
+    const int fd = mkstemp(record_path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    bool ok = true;
+    for (int backend = backend_syscalls; backend <= backend_io_uring; backend++) {
+        for (int threaded = 0; threaded <= 1; threaded++) {
+            for (int recording = 0; recording <= 1; recording++) {
+                struct repclient_options opts = {};
+                opts.backend = (enum REPCLIENT_BACKEND) backend;
+                opts.threaded = threaded;
+                char name[64];
+                snprintf(name, sizeof(name), "%s %s %s", backend == backend_io_uring ? "io_uring" : "syscalls",
+                         threaded ? "threaded" : "inline", recording ? "record" : "live");
+                ok = run(name, &opts, recording ? record_path : NULL) && ok;
+            }
+        }
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
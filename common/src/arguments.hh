@@ -28,6 +28,7 @@ struct arguments {
     uint64_t ticks;
     uint64_t tickrate;
     uint64_t cell_level;
+    uint64_t agents;
     bool realtime;
 };
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -45,6 +46,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 's':
             arguments->cell_level = atoi(arg);
             break;
+        case 'a':
+            arguments->agents = atoi(arg);
+            break;
         case 'b':
             arguments->realtime = false;
             break;
@@ -79,6 +83,7 @@ void argument_parse(int argc, char **argv, struct arguments *arguments) {
         {"ticks",       't', "TICKS",       0, "Number of ticks to execute"},
         {"tickrate",    'r', "TICKRATE",    0, "Number of ticks to execute per second"},
         {"cell-level",  's', "CELL_LEVEL",  0, "Initial cell level to spawn workers"},
+        {"agents",      'a', "AGENTS",      0, "Number of agents to spawn per worker"},
         {"batch",       'b', 0,             0, "Don't execute ticks in realtime"},
         {0}
     };
@@ -17,13 +17,55 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
 #include <immintrin.h>
+#endif
 
 #include <vector.hh>
 
 extern "C" {
 
+// Morton codes are computed either with BMI2's PDEP/PEXT or with portable magic-bits
+// shifts. PDEP/PEXT are a single instruction each on Intel, but microcoded and far slower
+// on AMD before Zen 3, and missing altogether on older and non-x86 hosts.
+// Single values are encoded and decoded where they are called, so which one they use is
+// decided at compile time: BMI2 when the target has it and isn't one of the slow AMD cores.
+// The array versions do enough work per call to check the CPU instead: the first call in
+// the process times both on it and keeps the faster, separately for 2D and 3D, since the
+// magic-bits loops vectorise. MORTON_IMPL=bmi2 or MORTON_IMPL=magic in the environment
+// overrides that choice.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MORTON_HAVE_BMI2 1
+#define MORTON_BMI2 __attribute__((target("bmi2")))
+#else
+#define MORTON_HAVE_BMI2 0
+#endif
+
+#if defined(__BMI2__) && !defined(__znver1) && !defined(__znver2) && !defined(__bdver4)
+#define MORTON_SCALAR_BMI2 1
+#else
+#define MORTON_SCALAR_BMI2 0
+#endif
+
+#define MORTON_FLATTEN __attribute__((flatten))
+
+#define MORTON_SELECT_VALUES 1024 // codes timed per implementation when selecting one
+#define MORTON_SELECT_ROUNDS 8    // of which the fastest counts
+
+enum morton_impl {
+    morton_impl_unknown, morton_impl_magic, morton_impl_bmi2,
+};
+
+// The array variants that choose an implementation each
+enum morton_family {
+    morton_family_2d_array, morton_family_3d_array, morton_families,
+};
+
 struct morton2d_32 {
   uint64_t value;
 };
@@ -58,23 +100,233 @@ static uint64_t expand_bits_2(const uint32_t x32) {
     return x;
 }
 
+static uint64_t morton2d_32_encode_magic(uint32_t x, uint32_t y) {
+    return (expand_bits_2(y) << 1) | expand_bits_2(x);
+}
+
+static void morton2d_32_decode_magic(uint64_t code, uint32_t *x, uint32_t *y) {
+    *x = compact_bits_2(code);
+    *y = compact_bits_2(code >> 1);
+}
+
+static uint32_t compact_bits_3(uint64_t x) {
+    x &= 0x1249249249249249;
+    x = (x ^ (x >>  2)) & 0x10c30c30c30c30c3;
+    x = (x ^ (x >>  4)) & 0x100f00f00f00f00f;
+    x = (x ^ (x >>  8)) & 0x001f0000ff0000ff;
+    x = (x ^ (x >> 16)) & 0x001f00000000ffff;
+    x = (x ^ (x >> 32)) & 0x00000000001fffff;
+    return (uint32_t) x;
+}
+
+static uint64_t expand_bits_3(const uint32_t x32) {
+    uint64_t x = x32 & 0x1fffff;
+    x = (x ^ (x << 32)) & 0x001f00000000ffff;
+    x = (x ^ (x << 16)) & 0x001f0000ff0000ff;
+    x = (x ^ (x <<  8)) & 0x100f00f00f00f00f;
+    x = (x ^ (x <<  4)) & 0x10c30c30c30c30c3;
+    x = (x ^ (x <<  2)) & 0x1249249249249249;
+    return x;
+}
+
+static uint64_t morton3d_21_encode_magic(uint32_t x, uint32_t y, uint32_t z) {
+    return (expand_bits_3(z) << 2) | (expand_bits_3(y) << 1) | expand_bits_3(x);
+}
+
+static void morton3d_21_decode_magic(uint64_t code, uint32_t *x, uint32_t *y, uint32_t *z) {
+    *x = compact_bits_3(code);
+    *y = compact_bits_3(code >> 1);
+    *z = compact_bits_3(code >> 2);
+}
+
+// Array versions, which the compiler can vectorise once everything in the loop is inlined
+MORTON_FLATTEN static void morton2d_32_encode_array_magic(uint64_t *codes, const uint32_t *x, const uint32_t *y, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        codes[i] = morton2d_32_encode_magic(x[i], y[i]);
+    }
+}
+
+MORTON_FLATTEN static void morton2d_32_decode_array_magic(const uint64_t *codes, uint32_t *x, uint32_t *y, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        morton2d_32_decode_magic(codes[i], &x[i], &y[i]);
+    }
+}
+
+MORTON_FLATTEN static void morton3d_21_encode_array_magic(uint64_t *codes, const uint32_t *x, const uint32_t *y, const uint32_t *z, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        codes[i] = morton3d_21_encode_magic(x[i], y[i], z[i]);
+    }
+}
+
+MORTON_FLATTEN static void morton3d_21_decode_array_magic(const uint64_t *codes, uint32_t *x, uint32_t *y, uint32_t *z, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        morton3d_21_decode_magic(codes[i], &x[i], &y[i], &z[i]);
+    }
+}
+
+#if MORTON_HAVE_BMI2
+MORTON_BMI2 static uint64_t morton2d_32_encode_bmi2(uint32_t x, uint32_t y) {
+    return _pdep_u64(x, __morton_2_x_mask) | _pdep_u64(y, __morton_2_y_mask);
+}
+
+MORTON_BMI2 static void morton2d_32_decode_bmi2(uint64_t code, uint32_t *x, uint32_t *y) {
+    *x = (uint32_t) _pext_u64(code, __morton_2_x_mask);
+    *y = (uint32_t) _pext_u64(code, __morton_2_y_mask);
+}
+
+MORTON_BMI2 static uint64_t morton3d_21_encode_bmi2(uint32_t x, uint32_t y, uint32_t z) {
+    return _pdep_u64(x, __morton_3_x_mask) | _pdep_u64(y, __morton_3_y_mask) | _pdep_u64(z, __morton_3_z_mask);
+}
+
+MORTON_BMI2 static void morton3d_21_decode_bmi2(uint64_t code, uint32_t *x, uint32_t *y, uint32_t *z) {
+    *x = (uint32_t) _pext_u64(code, __morton_3_x_mask);
+    *y = (uint32_t) _pext_u64(code, __morton_3_y_mask);
+    *z = (uint32_t) _pext_u64(code, __morton_3_z_mask);
+}
+
+MORTON_BMI2 MORTON_FLATTEN static void morton2d_32_encode_array_bmi2(uint64_t *codes, const uint32_t *x, const uint32_t *y, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        codes[i] = morton2d_32_encode_bmi2(x[i], y[i]);
+    }
+}
+
+MORTON_BMI2 MORTON_FLATTEN static void morton2d_32_decode_array_bmi2(const uint64_t *codes, uint32_t *x, uint32_t *y, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        morton2d_32_decode_bmi2(codes[i], &x[i], &y[i]);
+    }
+}
+
+MORTON_BMI2 MORTON_FLATTEN static void morton3d_21_encode_array_bmi2(uint64_t *codes, const uint32_t *x, const uint32_t *y, const uint32_t *z, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        codes[i] = morton3d_21_encode_bmi2(x[i], y[i], z[i]);
+    }
+}
+
+MORTON_BMI2 MORTON_FLATTEN static void morton3d_21_decode_array_bmi2(const uint64_t *codes, uint32_t *x, uint32_t *y, uint32_t *z, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        morton3d_21_decode_bmi2(codes[i], &x[i], &y[i], &z[i]);
+    }
+}
+#endif
+
+static bool morton_cpu_has_bmi2() {
+#if MORTON_HAVE_BMI2
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("bmi2");
+#else
+    return false;
+#endif
+}
+
+static volatile uint64_t morton_select_sink; // keeps the timed work from being dropped
+
+// One run of encoding and decoding MORTON_SELECT_VALUES codes of the family with impl
+static uint64_t morton_time_run(enum morton_impl impl, enum morton_family family, uint32_t seed) {
+    uint32_t x[MORTON_SELECT_VALUES], y[MORTON_SELECT_VALUES], z[MORTON_SELECT_VALUES];
+    uint64_t codes[MORTON_SELECT_VALUES];
+    uint64_t sink = 0;
+    const bool bmi2 = impl == morton_impl_bmi2;
+    (void) bmi2;
+    for (uint32_t i = 0; i < MORTON_SELECT_VALUES; i++) {
+        const uint32_t v = (i + seed) * 2654435761u;
+        x[i] = v & 0x1fffff;
+        y[i] = ~v & 0x1fffff;
+        z[i] = (v >> 11) & 0x1fffff;
+    }
+    switch (family) {
+    case morton_family_2d_array:
+#if MORTON_HAVE_BMI2
+        if (bmi2) {
+            morton2d_32_encode_array_bmi2(codes, x, y, MORTON_SELECT_VALUES);
+            morton2d_32_decode_array_bmi2(codes, x, y, MORTON_SELECT_VALUES);
+        } else
+#endif
+        {
+            morton2d_32_encode_array_magic(codes, x, y, MORTON_SELECT_VALUES);
+            morton2d_32_decode_array_magic(codes, x, y, MORTON_SELECT_VALUES);
+        }
+        sink = x[seed % MORTON_SELECT_VALUES] ^ y[0];
+        break;
+    case morton_family_3d_array:
+#if MORTON_HAVE_BMI2
+        if (bmi2) {
+            morton3d_21_encode_array_bmi2(codes, x, y, z, MORTON_SELECT_VALUES);
+            morton3d_21_decode_array_bmi2(codes, x, y, z, MORTON_SELECT_VALUES);
+        } else
+#endif
+        {
+            morton3d_21_encode_array_magic(codes, x, y, z, MORTON_SELECT_VALUES);
+            morton3d_21_decode_array_magic(codes, x, y, z, MORTON_SELECT_VALUES);
+        }
+        sink = x[seed % MORTON_SELECT_VALUES] ^ z[0];
+        break;
+    default:
+        abort();
+    }
+    return sink;
+}
+
+// Nanoseconds for the faster of MORTON_SELECT_ROUNDS runs of the family with impl
+static int64_t morton_time_impl(enum morton_impl impl, enum morton_family family) {
+    int64_t best = INT64_MAX;
+    uint64_t sink = 0;
+    for (size_t round = 0; round < MORTON_SELECT_ROUNDS; round++) {
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sink += morton_time_run(impl, family, (uint32_t) sink);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        const int64_t ns = (int64_t) (stop.tv_sec - start.tv_sec) * 1000000000LL + (stop.tv_nsec - start.tv_nsec);
+        best = ns < best ? ns : best;
+    }
+    morton_select_sink = sink;
+    return best;
+}
+
+static enum morton_impl morton_select(enum morton_family family) {
+    const bool bmi2 = morton_cpu_has_bmi2();
+    const char *const forced = getenv("MORTON_IMPL");
+    if (forced && strcmp(forced, "magic") == 0) {
+        return morton_impl_magic;
+    } else if (forced && strcmp(forced, "bmi2") == 0 && bmi2) {
+        return morton_impl_bmi2;
+    }
+    if (!bmi2) {
+        return morton_impl_magic;
+    }
+    return morton_time_impl(morton_impl_bmi2, family) <= morton_time_impl(morton_impl_magic, family) ? morton_impl_bmi2 : morton_impl_magic;
+}
+
+// The selection for each family. Being inline rather than static, this is one array for
+// the whole program however many translation units include the header, so the timing
+// happens once per process.
+inline enum morton_impl *morton_selected() {
+    static enum morton_impl selected[morton_families];
+    return selected;
+}
+
+static enum morton_impl morton_impl_get(enum morton_family family) {
+    enum morton_impl *const selected = morton_selected();
+    enum morton_impl impl = (enum morton_impl) __atomic_load_n(&selected[family], __ATOMIC_RELAXED);
+    if (__builtin_expect(impl == morton_impl_unknown, 0)) {
+        impl = morton_select(family);
+        __atomic_store_n(&selected[family], impl, __ATOMIC_RELAXED);
+    }
+    return impl;
+}
+
 static void morton2d_32_encode(struct morton2d_32 *code, uint32_t x, uint32_t y) {
-#ifdef __AVX2__
-    code->value =
-        _pdep_u64(x, __morton_2_x_mask) |
-        _pdep_u64(y, __morton_2_y_mask);
+#if MORTON_SCALAR_BMI2
+    code->value = morton2d_32_encode_bmi2(x, y);
 #else
-    code->value = (expand_bits_2(y) << 1) | expand_bits_2(x);
+    code->value = morton2d_32_encode_magic(x, y);
 #endif
 }
 
 static void morton2d_32_decode(const struct morton2d_32 *code, uint32_t *x, uint32_t *y) {
-#ifdef __AVX2__
-    *x = (uint32_t) _pext_u64(code->value, __morton_2_x_mask);
-    *y = (uint32_t) _pext_u64(code->value, __morton_2_y_mask);
+#if MORTON_SCALAR_BMI2
+    morton2d_32_decode_bmi2(code->value, x, y);
 #else
-    *x = compact_bits_2(code->value);
-    *y = compact_bits_2(code->value >> 1);
+    morton2d_32_decode_magic(code->value, x, y);
 #endif
 }
 
@@ -95,24 +347,60 @@ struct morton3d_21 {
 };
 
 static void morton3d_21_encode(struct morton3d_21 *code, uint32_t x, uint32_t y, uint32_t z) {
-#ifdef __AVX2__
-    code->value =
-        _pdep_u64(x, __morton_3_x_mask) |
-        _pdep_u64(y, __morton_3_y_mask) |
-        _pdep_u64(z, __morton_3_z_mask);
+#if MORTON_SCALAR_BMI2
+    code->value = morton3d_21_encode_bmi2(x, y, z);
 #else
-    assert(false && "morton_3_encode not implemented for non-AVX2 capable processors.");
+    code->value = morton3d_21_encode_magic(x, y, z);
 #endif
 }
 
 static void morton3d_21_decode(const struct morton3d_21 *code, uint32_t *x, uint32_t *y, uint32_t *z) {
-#ifdef __AVX2__
-    *x = _pext_u64(code->value, __morton_3_x_mask);
-    *y = _pext_u64(code->value, __morton_3_y_mask);
-    *z = _pext_u64(code->value, __morton_3_z_mask);
+#if MORTON_SCALAR_BMI2
+    morton3d_21_decode_bmi2(code->value, x, y, z);
 #else
-    assert(false && "morton_3_decode not implemented for non-AVX2 capable processors.");
+    morton3d_21_decode_magic(code->value, x, y, z);
+#endif
+}
+
+// Encoding and decoding whole arrays, with the implementation looked up once for them all
+static void morton2d_32_encode_array(uint64_t *codes, const uint32_t *x, const uint32_t *y, size_t n) {
+#if MORTON_HAVE_BMI2
+    if (morton_impl_get(morton_family_2d_array) == morton_impl_bmi2) {
+        morton2d_32_encode_array_bmi2(codes, x, y, n);
+        return;
+    }
+#endif
+    morton2d_32_encode_array_magic(codes, x, y, n);
+}
+
+static void morton2d_32_decode_array(const uint64_t *codes, uint32_t *x, uint32_t *y, size_t n) {
+#if MORTON_HAVE_BMI2
+    if (morton_impl_get(morton_family_2d_array) == morton_impl_bmi2) {
+        morton2d_32_decode_array_bmi2(codes, x, y, n);
+        return;
+    }
+#endif
+    morton2d_32_decode_array_magic(codes, x, y, n);
+}
+
+static void morton3d_21_encode_array(uint64_t *codes, const uint32_t *x, const uint32_t *y, const uint32_t *z, size_t n) {
+#if MORTON_HAVE_BMI2
+    if (morton_impl_get(morton_family_3d_array) == morton_impl_bmi2) {
+        morton3d_21_encode_array_bmi2(codes, x, y, z, n);
+        return;
+    }
+#endif
+    morton3d_21_encode_array_magic(codes, x, y, z, n);
+}
+
+static void morton3d_21_decode_array(const uint64_t *codes, uint32_t *x, uint32_t *y, uint32_t *z, size_t n) {
+#if MORTON_HAVE_BMI2
+    if (morton_impl_get(morton_family_3d_array) == morton_impl_bmi2) {
+        morton3d_21_decode_array_bmi2(codes, x, y, z, n);
+        return;
+    }
 #endif
+    morton3d_21_decode_array_magic(codes, x, y, z, n);
 }
 
 static void morton3d_21_add(struct morton3d_21 *left, const struct morton3d_21 *right) {
@@ -17,6 +17,10 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <vector.hh>
 #include <morton.hh>
@@ -34,6 +38,8 @@ struct __attribute__((packed)) net_tree_cell {
     uint64_t level;
 };
 
+#define NET_POSITION_BITS 10 // per axis of net_encoded_position
+
 struct __attribute__((packed)) net_point {
     uint32_t net_encoded_position;
     uint32_t net_encoded_color;
@@ -79,68 +85,204 @@ static struct colour net_decode_color(uint32_t c) {
     return result;
 }
 
-static uint32_t net_encode_position_2f(vec2f v, struct net_tree_cell cell) {
-    uint64_t size = 1 << cell.level;
-    vec2f c = morton_2_decode(cell.code);
-    v.x -= c.x;
-    v.y -= c.y;
-    v.x /= size;
-    v.y /= size;
-    v.x *= (1 << 10);
-    v.y *= (1 << 10);
+// A position is stored as NET_POSITION_BITS an axis, counting in 1 << NET_POSITION_BITS
+// steps across its cell from the cell's corner. What that takes depends only on the cell,
+// so a net_cell_context works it out once for all the points in a message. DIMS is 2 or 3.
+template <int DIMS> struct net_dims;
+
+template <> struct net_dims<2> {
+    typedef vec2f vec;
+    static vec origin(uint64_t code) { return morton_2_decode(code); }
+};
+
+template <> struct net_dims<3> {
+    typedef vec3f vec;
+    static vec origin(uint64_t code) { return morton_3_decode(code); }
+};
+
+template <int DIMS>
+struct net_cell_context {
+    typename net_dims<DIMS>::vec origin;
+    float size;
+    float scale;         // world units per step
+    float inverse_scale; // steps per world unit
+};
+
+template <int DIMS>
+static struct net_cell_context<DIMS> net_cell_context_make(struct net_tree_cell cell) {
+    const uint64_t size = 1 << cell.level;
+    struct net_cell_context<DIMS> ctx;
+    ctx.origin = net_dims<DIMS>::origin(cell.code);
+    ctx.size = size;
+    // Both powers of two, so scaling by them gives exactly what dividing would
+    ctx.scale = ctx.size / (1 << NET_POSITION_BITS);
+    ctx.inverse_scale = (1 << NET_POSITION_BITS) / ctx.size;
+    return ctx;
+}
+
+static uint32_t net_encode_position(vec2f v, const struct net_cell_context<2> &ctx) {
     return
-        (((uint32_t)v.x) <<  0) |
-        (((uint32_t)v.y) << 10);
+        (((uint32_t) ((v.x - ctx.origin.x) * ctx.inverse_scale)) <<  0) |
+        (((uint32_t) ((v.y - ctx.origin.y) * ctx.inverse_scale)) << 10);
 }
 
-static uint32_t net_encode_position_3f(vec3f v, struct net_tree_cell cell) {
-    uint64_t size = 1 << cell.level;
-    vec3f c = morton_3_decode(cell.code);
-    v.x -= c.x;
-    v.y -= c.y;
-    v.z -= c.z;
-    v.x /= size;
-    v.y /= size;
-    v.z /= size;
-    v.x *= (1 << 10);
-    v.y *= (1 << 10);
-    v.z *= (1 << 10);
+static uint32_t net_encode_position(vec3f v, const struct net_cell_context<3> &ctx) {
     return
-        (((uint32_t)v.x) <<  0) |
-        (((uint32_t)v.y) << 10) |
-        (((uint32_t)v.z) << 20);
+        (((uint32_t) ((v.x - ctx.origin.x) * ctx.inverse_scale)) <<  0) |
+        (((uint32_t) ((v.y - ctx.origin.y) * ctx.inverse_scale)) << 10) |
+        (((uint32_t) ((v.z - ctx.origin.z) * ctx.inverse_scale)) << 20);
 }
 
-static vec2f net_decode_position_2f(uint32_t p, struct net_tree_cell cell) {
-    uint64_t size = 1 << cell.level;
-    vec2f c = morton_2_decode(cell.code);
-    vec2f v = {0};
-    v.x = (p >>  0) & ((1 << 10) - 1);
-    v.y = (p >> 10) & ((1 << 10) - 1);
-    v.x /= (1 << 10);
-    v.y /= (1 << 10);
-    v.x *= size;
-    v.y *= size;
-    v.x += c.x;
-    v.y += c.y;
+static vec2f net_decode_position(uint32_t p, const struct net_cell_context<2> &ctx) {
+    vec2f v;
+    v.x = ctx.origin.x + (float) ((p >>  0) & ((1 << 10) - 1)) * ctx.scale;
+    v.y = ctx.origin.y + (float) ((p >> 10) & ((1 << 10) - 1)) * ctx.scale;
     return v;
 }
 
+static vec3f net_decode_position(uint32_t p, const struct net_cell_context<3> &ctx) {
+    vec3f v;
+    v.x = ctx.origin.x + (float) ((p >>  0) & ((1 << 10) - 1)) * ctx.scale;
+    v.y = ctx.origin.y + (float) ((p >> 10) & ((1 << 10) - 1)) * ctx.scale;
+    v.z = ctx.origin.z + (float) ((p >> 20) & ((1 << 10) - 1)) * ctx.scale;
+    return v;
+}
+
+// For a single point. Anything encoding or decoding more than one from a cell should make
+// a net_cell_context and use that.
+static uint32_t net_encode_position_2f(vec2f v, struct net_tree_cell cell) {
+    return net_encode_position(v, net_cell_context_make<2>(cell));
+}
+
+static uint32_t net_encode_position_3f(vec3f v, struct net_tree_cell cell) {
+    return net_encode_position(v, net_cell_context_make<3>(cell));
+}
+
+static vec2f net_decode_position_2f(uint32_t p, struct net_tree_cell cell) {
+    return net_decode_position(p, net_cell_context_make<2>(cell));
+}
+
 static vec3f net_decode_position_3f(uint32_t p, struct net_tree_cell cell) {
-    uint64_t size = 1 << cell.level;
-    vec3f c = morton_3_decode(cell.code);
-    vec3f v = {0};
-    v.x = (p >>  0) & ((1 << 10) - 1);
-    v.y = (p >> 10) & ((1 << 10) - 1);
-    v.z = (p >> 20) & ((1 << 10) - 1);
-    v.x /= (1 << 10);
-    v.y /= (1 << 10);
-    v.z /= (1 << 10);
-    v.x *= size;
-    v.y *= size;
-    v.z *= size;
-    v.x += c.x;
-    v.y += c.y;
-    v.z += c.z;
+    return net_decode_position(p, net_cell_context_make<3>(cell));
+}
+
+// Where net_decode_points_2f/3f put a message's points, as one array per component. Each
+// has to have room for num_points; z is only written by net_decode_points_3f.
+struct net_points_soa {
+    float *x, *y, *z;
+    float *r, *g, *b;
+    uint32_t *id;
+};
+
+static void net_points_soa_set_z(const struct net_points_soa *, size_t, vec2f) {
+}
+
+static void net_points_soa_set_z(const struct net_points_soa *out, size_t i, vec3f v) {
+    out->z[i] = v.z;
+}
+
+static vec3f net_vec3f(vec2f v) {
+    vec3f result = {0};
+    result.x = v.x;
+    result.y = v.y;
+    return result;
+}
+
+static vec3f net_vec3f(vec3f v) {
     return v;
 }
+
+// Decodes points[first, n) one at a time
+template <int DIMS>
+static void net_decode_points_scalar(const struct net_point *points, size_t first, size_t n, const struct net_cell_context<DIMS> &ctx,
+                                     const struct net_points_soa *out) {
+    for (size_t i = first; i < n; i++) {
+        struct net_point point;
+        memcpy(&point, &points[i], sizeof(point));
+        const typename net_dims<DIMS>::vec v = net_decode_position(point.net_encoded_position, ctx);
+        out->x[i] = v.x;
+        out->y[i] = v.y;
+        net_points_soa_set_z(out, i, v);
+        const struct colour c = net_decode_color(point.net_encoded_color);
+        out->r[i] = c.r;
+        out->g[i] = c.g;
+        out->b[i] = c.b;
+        out->id[i] = point.id;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Eight points at a time: three loads of 96 bytes, and blends and permutes to pull the
+// positions, colours and ids out into their own vectors. Returns how many were done.
+__attribute__((target("avx2"))) static size_t net_decode_points_avx2(const struct net_point *points, size_t n, vec3f origin, float scale,
+                                                                     bool three_d, const struct net_points_soa *out) {
+    const __m256i position_order = _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5);
+    const __m256i colour_order = _mm256_setr_epi32(1, 4, 7, 2, 5, 0, 3, 6);
+    const __m256i id_order = _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7);
+    const __m256i position_mask = _mm256_set1_epi32((1 << NET_POSITION_BITS) - 1);
+    const __m256i byte_mask = _mm256_set1_epi32(255);
+    const __m256 scales = _mm256_set1_ps(scale);
+    const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+    const __m256 full = _mm256_set1_ps(255.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i *const src = (const __m256i *) &points[i];
+        const __m256i a = _mm256_loadu_si256(src);
+        const __m256i b = _mm256_loadu_si256(src + 1);
+        const __m256i c = _mm256_loadu_si256(src + 2);
+        // Point j's position, colour and id are the 3j, 3j + 1 and 3j + 2th of the 24
+        const __m256i positions = _mm256_permutevar8x32_epi32(_mm256_blend_epi32(_mm256_blend_epi32(a, b, 0x92), c, 0x24), position_order);
+        const __m256i colours = _mm256_permutevar8x32_epi32(_mm256_blend_epi32(_mm256_blend_epi32(a, b, 0x24), c, 0x49), colour_order);
+        const __m256i ids = _mm256_permutevar8x32_epi32(_mm256_blend_epi32(_mm256_blend_epi32(a, b, 0x49), c, 0x92), id_order);
+
+        const __m256 px = _mm256_cvtepi32_ps(_mm256_and_si256(positions, position_mask));
+        const __m256 py = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(positions, NET_POSITION_BITS), position_mask));
+        _mm256_storeu_ps(out->x + i, _mm256_add_ps(ox, _mm256_mul_ps(px, scales)));
+        _mm256_storeu_ps(out->y + i, _mm256_add_ps(oy, _mm256_mul_ps(py, scales)));
+        if (three_d) {
+            const __m256 pz = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(positions, 2 * NET_POSITION_BITS), position_mask));
+            _mm256_storeu_ps(out->z + i, _mm256_add_ps(oz, _mm256_mul_ps(pz, scales)));
+        }
+        // Divided rather than multiplied by 1/255 to come out exactly as net_decode_color does
+        const __m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(colours, 16), byte_mask));
+        const __m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(colours, 8), byte_mask));
+        const __m256 bl = _mm256_cvtepi32_ps(_mm256_and_si256(colours, byte_mask));
+        _mm256_storeu_ps(out->r + i, _mm256_div_ps(r, full));
+        _mm256_storeu_ps(out->g + i, _mm256_div_ps(g, full));
+        _mm256_storeu_ps(out->b + i, _mm256_div_ps(bl, full));
+        _mm256_storeu_si256((__m256i *) (out->id + i), ids);
+    }
+    return i;
+}
+#endif
+
+static bool net_cpu_has_avx2() {
+#if defined(__x86_64__) || defined(__i386__)
+    // Asked once rather than for every message
+    static const bool has_avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+    return has_avx2;
+#else
+    return false;
+#endif
+}
+
+// Decodes every point in a message, giving the same values as net_decode_position and
+// net_decode_color would one at a time
+template <int DIMS>
+static void net_decode_points(const struct client_message *message, const struct net_cell_context<DIMS> &ctx, const struct net_points_soa *out) {
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (net_cpu_has_avx2()) {
+        done = net_decode_points_avx2(message->points, message->num_points, net_vec3f(ctx.origin), ctx.scale, DIMS == 3, out);
+    }
+#endif
+    net_decode_points_scalar(message->points, done, message->num_points, ctx, out);
+}
+
+static void net_decode_points_2f(const struct client_message *message, const struct net_points_soa *out) {
+    net_decode_points(message, net_cell_context_make<2>(message->cell), out);
+}
+
+static void net_decode_points_3f(const struct client_message *message, const struct net_points_soa *out) {
+    net_decode_points(message, net_cell_context_make<3>(message->cell), out);
+}
@@ -24,11 +24,22 @@ static struct timespec timer_get() {
     clock_gettime(CLOCK_REALTIME, &time_struct);
     return time_struct;
 }
+// For measuring intervals, which timer_get can't do across a clock step
+static struct timespec timer_get_monotonic() {
+    struct timespec time_struct;
+    clock_gettime(CLOCK_MONOTONIC, &time_struct);
+    return time_struct;
+}
 static float timer_diff(struct timespec stop_time, struct timespec start_time) {
     return
         (float)((int64_t)stop_time.tv_sec - (int64_t)start_time.tv_sec) +
         (float)((int64_t)stop_time.tv_nsec - (int64_t)start_time.tv_nsec) / 1e9;
 }
+static int64_t timer_diff_ns(struct timespec stop_time, struct timespec start_time) {
+    return
+        ((int64_t)stop_time.tv_sec - (int64_t)start_time.tv_sec) * 1000000000LL +
+        ((int64_t)stop_time.tv_nsec - (int64_t)start_time.tv_nsec);
+}
 static struct timespec timer_add(struct timespec start_time, uint64_t nanos) {
     start_time.tv_nsec += nanos;
     start_time.tv_sec += start_time.tv_nsec / 1e9;
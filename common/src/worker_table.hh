@@ -0,0 +1,146 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define WORKER_TABLE_NONE UINT32_MAX
+
+// Maps worker ids onto dense slots 0, 1, 2... in the order the workers are first seen,
+// with open addressing and linear probing. Per-worker data then lives in plain arrays
+// indexed by slot, so memory follows the number of workers rather than the largest id,
+// and walking every worker is a walk over contiguous memory.
+// This needs to make sense when zeroed
+struct worker_table {
+    uint64_t *keys;
+    uint32_t *values;     // slot + 1, or 0 for an empty entry
+    uint64_t *worker_ids; // by slot
+    size_t cap;           // zero or a power of two
+    size_t count;
+};
+
+static size_t worker_table_hash(const uint64_t id) {
+    const uint64_t h = id * 0x9E3779B97F4A7C15ULL;
+    return (size_t) (h ^ (h >> 32));
+}
+
+static uint32_t worker_table_find(const struct worker_table *t, const uint64_t id) {
+    if (t->cap == 0) {
+        return WORKER_TABLE_NONE;
+    }
+    const size_t mask = t->cap - 1;
+    for (size_t i = worker_table_hash(id) & mask;; i = (i + 1) & mask) {
+        if (t->values[i] == 0) {
+            return WORKER_TABLE_NONE;
+        } else if (t->keys[i] == id) {
+            return t->values[i] - 1;
+        }
+    }
+}
+
+// Keeps the load factor at or below a half
+static void worker_table_grow(struct worker_table *t) {
+    struct worker_table grown = *t;
+    grown.cap = t->cap ? t->cap * 2 : 16;
+    grown.keys = (uint64_t *) malloc(grown.cap * sizeof(*grown.keys));
+    grown.values = (uint32_t *) calloc(grown.cap, sizeof(*grown.values));
+    grown.worker_ids = (uint64_t *) realloc(t->worker_ids, grown.cap / 2 * sizeof(*grown.worker_ids));
+    assert(grown.keys && grown.values && grown.worker_ids);
+    const size_t mask = grown.cap - 1;
+    for (size_t slot = 0; slot < t->count; slot++) {
+        size_t i = worker_table_hash(grown.worker_ids[slot]) & mask;
+        while (grown.values[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        grown.keys[i] = grown.worker_ids[slot];
+        grown.values[i] = slot + 1;
+    }
+    free(t->keys);
+    free(t->values);
+    *t = grown;
+}
+
+// Returns the slot for id, giving it the next free one if it is new
+static uint32_t worker_table_insert(struct worker_table *t, const uint64_t id) {
+    const uint32_t found = worker_table_find(t, id);
+    if (found != WORKER_TABLE_NONE) {
+        return found;
+    }
+    if ((t->count + 1) * 2 > t->cap) {
+        worker_table_grow(t);
+    }
+    assert(t->count < WORKER_TABLE_NONE - 1);
+    const size_t mask = t->cap - 1;
+    size_t i = worker_table_hash(id) & mask;
+    while (t->values[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    const uint32_t slot = t->count++;
+    t->keys[i] = id;
+    t->values[i] = slot + 1;
+    t->worker_ids[slot] = id;
+    return slot;
+}
+
+// Forgets id, returning the slot it had or WORKER_TABLE_NONE. Slots stay dense: the worker
+// in the last slot, if that was another, takes over the freed one, so callers move their
+// per-slot data from count (after the call) to the returned slot the same way.
+static uint32_t worker_table_remove(struct worker_table *t, const uint64_t id) {
+    if (t->cap == 0) {
+        return WORKER_TABLE_NONE;
+    }
+    const size_t mask = t->cap - 1;
+    size_t i = worker_table_hash(id) & mask;
+    while (t->values[i] != 0 && t->keys[i] != id) {
+        i = (i + 1) & mask;
+    }
+    if (t->values[i] == 0) {
+        return WORKER_TABLE_NONE;
+    }
+    const uint32_t slot = t->values[i] - 1;
+    // Shift later entries of the run back over the gap, so probes for them still reach
+    // them, unless that would take one before where its probe starts
+    for (size_t j = (i + 1) & mask; t->values[j] != 0; j = (j + 1) & mask) {
+        const size_t home = worker_table_hash(t->keys[j]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            t->keys[i] = t->keys[j];
+            t->values[i] = t->values[j];
+            i = j;
+        }
+    }
+    t->values[i] = 0;
+    const uint32_t last = --t->count;
+    if (slot != last) {
+        const uint64_t moved = t->worker_ids[last];
+        t->worker_ids[slot] = moved;
+        size_t k = worker_table_hash(moved) & mask;
+        while (t->keys[k] != moved || t->values[k] == 0) {
+            k = (k + 1) & mask;
+        }
+        t->values[k] = slot + 1;
+    }
+    return slot;
+}
+
+static void worker_table_free(struct worker_table *t) {
+    free(t->keys);
+    free(t->values);
+    free(t->worker_ids);
+    *t = worker_table();
+}
@@ -0,0 +1,644 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// A stand-in for an Aether simulation and its multiplexer, for load testing librepclient
+// and the clients without a cluster. Workers each own a Morton-coded cell of a grid and
+// move their agents about it, handing them over when they cross into a neighbour's cell.
+// Every tick each worker sends a client_message to every connected client, framed the
+// way the multiplexer does it: a multiplexer_header, then the message as u32-prefixed
+// segments ended by an empty one. Clients send aether_event_t back, each u32-prefixed:
+// clicks spawn agents, EVENT_DEL_AGENT removes one and the cursor pushes agents away.
+//
+// In real time, a client that falls too far behind has ticks left out for it. With
+// --batch, ticks go as fast as the slowest client takes them instead, once one has
+// connected.
+
+#include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <arguments.hh>
+#include <event.hh>
+#include <net.hh>
+#include <tcp.hh>
+#include <timer.hh>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+#define SERVER_BACKLOG_LIMIT (64 * 1024 * 1024) // bytes a client can be behind by
+#define SERVER_READ_SIZE (64 * 1024)
+#define CLICK_AGENTS 16
+#define CURSOR_RADIUS 2.0f
+#define GHOST_FRACTION 8 // agents this close to an edge, as a fraction of the cell, are ghosted next door
+#define FLUSH_TIMEOUT_MS 5000 // for the last messages once the ticks are done
+
+// As read by repclient
+struct __attribute__((packed)) multiplexer_header {
+    uint64_t id;
+    uint64_t len; // of the segments that follow, terminator included
+};
+typedef uint32_t prefix_t;
+
+struct server_agent {
+    vec2f p;
+    vec2f v; // per second
+    uint32_t id;
+};
+
+struct server_worker {
+    uint64_t id;
+    struct net_tree_cell cell;
+    vec2f origin;
+    uint32_t colour;
+    std::vector<struct server_agent> agents;
+    uint64_t ghosts;
+};
+
+// A connected client and what hasn't been sent to it yet.
+// This needs to make sense when zeroed
+struct server_client {
+    int fd;
+    uint8_t *out;
+    size_t out_pos;
+    size_t out_len;
+    size_t out_cap;
+    uint8_t *in;
+    size_t in_len;
+    size_t in_cap;
+    uint64_t skipped; // ticks left out for being too far behind
+};
+
+struct server_world {
+    uint64_t cols;
+    uint64_t rows;
+    float cell_size;
+    vec2f min; // corner of the grid
+    float dt;  // seconds per tick
+    std::vector<struct server_worker> workers;
+    uint32_t next_agent_id;
+    uint64_t rng;
+    bool cursor_set;
+    vec2f cursor;
+};
+
+struct server_state {
+    int listenfd;
+    struct server_world world;
+    std::vector<struct server_client> clients;
+    std::vector<struct pollfd> pollfds;
+    uint8_t *frame;
+    size_t frame_len;
+    size_t frame_cap;
+    uint64_t bytes_sent;
+    uint64_t events;
+};
+
+// xorshift64*
+static uint64_t random_u64(struct server_world *world) {
+    world->rng ^= world->rng >> 12;
+    world->rng ^= world->rng << 25;
+    world->rng ^= world->rng >> 27;
+    return world->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static float random_float(struct server_world *world) {
+    return (random_u64(world) >> 40) / (float) (1 << 24);
+}
+
+static void grow(uint8_t **buf, size_t *cap, size_t wanted) {
+    if (wanted > *cap) {
+        *cap = MAX(wanted, *cap * 2);
+        *buf = (uint8_t *) realloc(*buf, *cap);
+        assert(*buf);
+    }
+}
+
+// The worker owning the cell p is in, or -1 if nobody does
+static int64_t worker_at(const struct server_world *world, vec2f p) {
+    const float x = floorf((p.x - world->min.x) / world->cell_size);
+    const float y = floorf((p.y - world->min.y) / world->cell_size);
+    if (x < 0 || y < 0 || x >= world->cols || y >= world->rows) {
+        return -1;
+    }
+    const uint64_t index = (uint64_t) y * world->cols + (uint64_t) x;
+    return index < world->workers.size() ? (int64_t) index : -1;
+}
+
+static void spawn_agent(struct server_world *world, size_t worker, vec2f p) {
+    const float angle = random_float(world) * 2 * M_PI;
+    const float speed = (0.1f + random_float(world)) * world->cell_size / 4;
+    struct server_agent agent;
+    agent.p = p;
+    agent.v.x = cosf(angle) * speed;
+    agent.v.y = sinf(angle) * speed;
+    agent.id = world->next_agent_id++;
+    world->workers[worker].agents.push_back(agent);
+}
+
+static void world_init(struct server_world *world, const struct arguments *arguments) {
+    world->cols = ceil(sqrt((double) arguments->workers));
+    world->rows = (arguments->workers + world->cols - 1) / world->cols;
+    world->cell_size = 1 << arguments->cell_level;
+    // Centred on the origin, which is where the clients look, with cells on their own grid
+    world->min.x = -(float) (world->cols / 2) * world->cell_size;
+    world->min.y = -(float) (world->rows / 2) * world->cell_size;
+    world->dt = 1.0f / arguments->tickrate;
+    world->next_agent_id = 1;
+    world->rng = 0x9E3779B97F4A7C15ULL;
+    world->cursor_set = false;
+    world->workers.resize(arguments->workers);
+    for (size_t i = 0; i < world->workers.size(); i++) {
+        struct server_worker *const w = &world->workers[i];
+        w->id = i + 1;
+        w->origin.x = world->min.x + (i % world->cols) * world->cell_size;
+        w->origin.y = world->min.y + (i / world->cols) * world->cell_size;
+        w->cell.code = morton_2_encode(w->origin);
+        w->cell.level = arguments->cell_level;
+        struct colour c;
+        c.r = 0.3f + 0.7f * random_float(world);
+        c.g = 0.3f + 0.7f * random_float(world);
+        c.b = 0.3f + 0.7f * random_float(world);
+        w->colour = net_encode_color(c);
+        w->ghosts = 0;
+        for (uint64_t j = 0; j < arguments->agents; j++) {
+            vec2f p;
+            p.x = w->origin.x + random_float(world) * world->cell_size;
+            p.y = w->origin.y + random_float(world) * world->cell_size;
+            spawn_agent(world, i, p);
+        }
+    }
+}
+
+// Moves every agent on by a tick, handing over the ones that leave their worker's cell
+static void world_tick(struct server_world *world) {
+    std::vector<std::pair<size_t, struct server_agent>> moving;
+    for (size_t i = 0; i < world->workers.size(); i++) {
+        std::vector<struct server_agent> &agents = world->workers[i].agents;
+        for (size_t j = 0; j < agents.size();) {
+            struct server_agent *const a = &agents[j];
+            if (world->cursor_set) {
+                const float dx = a->p.x - world->cursor.x;
+                const float dy = a->p.y - world->cursor.y;
+                const float d = sqrtf(dx * dx + dy * dy);
+                if (d > 0 && d < CURSOR_RADIUS) {
+                    const float speed = sqrtf(a->v.x * a->v.x + a->v.y * a->v.y);
+                    a->v.x = dx / d * speed;
+                    a->v.y = dy / d * speed;
+                }
+            }
+            vec2f p = a->p;
+            p.x += a->v.x * world->dt;
+            p.y += a->v.y * world->dt;
+            const int64_t owner = worker_at(world, p);
+            if (owner < 0) {
+                // Bounce off the edge of the grid, and off cells nobody owns
+                vec2f px = a->p, py = a->p;
+                px.x = p.x;
+                py.y = p.y;
+                if (worker_at(world, px) < 0) {
+                    a->v.x = -a->v.x;
+                }
+                if (worker_at(world, py) < 0) {
+                    a->v.y = -a->v.y;
+                }
+                j++;
+                continue;
+            }
+            a->p = p;
+            if ((size_t) owner != i) {
+                moving.push_back(std::make_pair((size_t) owner, *a));
+                agents[j] = agents.back();
+                agents.pop_back();
+                continue;
+            }
+            j++;
+        }
+    }
+    for (size_t i = 0; i < moving.size(); i++) {
+        world->workers[moving[i].first].agents.push_back(moving[i].second);
+    }
+
+    const float margin = world->cell_size / GHOST_FRACTION;
+    for (size_t i = 0; i < world->workers.size(); i++) {
+        world->workers[i].ghosts = 0;
+    }
+    for (size_t i = 0; i < world->workers.size(); i++) {
+        const struct server_worker *const w = &world->workers[i];
+        for (size_t j = 0; j < w->agents.size(); j++) {
+            const vec2f p = w->agents[j].p;
+            const float near_x = p.x - w->origin.x < margin ? -1 : w->origin.x + world->cell_size - p.x < margin ? 1 : 0;
+            const float near_y = p.y - w->origin.y < margin ? -1 : w->origin.y + world->cell_size - p.y < margin ? 1 : 0;
+            const float nears[3][2] = { {near_x, 0}, {0, near_y}, {near_x, near_y} };
+            for (size_t k = 0; k < 3; k++) {
+                if (nears[k][0] == 0 && nears[k][1] == 0) {
+                    continue;
+                }
+                vec2f q;
+                q.x = w->origin.x + (nears[k][0] + 0.5f) * world->cell_size;
+                q.y = w->origin.y + (nears[k][1] + 0.5f) * world->cell_size;
+                const int64_t neighbour = worker_at(world, q);
+                if (neighbour >= 0) {
+                    world->workers[neighbour].ghosts++;
+                }
+            }
+        }
+    }
+}
+
+static void world_remove_agent(struct server_world *world, uint32_t id) {
+    for (size_t i = 0; i < world->workers.size(); i++) {
+        std::vector<struct server_agent> &agents = world->workers[i].agents;
+        for (size_t j = 0; j < agents.size(); j++) {
+            if (agents[j].id == id) {
+                agents[j] = agents.back();
+                agents.pop_back();
+                return;
+            }
+        }
+    }
+}
+
+static void handle_event(struct server_state *server, const uint8_t *data, size_t length) {
+    aether_event_t event;
+    if (length != sizeof(event)) {
+        return;
+    }
+    memcpy(&event, data, sizeof(event));
+    struct server_world *const world = &server->world;
+    server->events++;
+    switch (event.type) {
+        case EVENT_CURSOR_MOVE:
+            world->cursor_set = true;
+            world->cursor.x = event.cursor_move.position.x;
+            world->cursor.y = event.cursor_move.position.y;
+            break;
+        case EVENT_MOUSE_CLICK: {
+            vec2f p;
+            p.x = event.mouse_click.position.x;
+            p.y = event.mouse_click.position.y;
+            const int64_t owner = worker_at(world, p);
+            if (event.mouse_click.action == BUTTON_PRESSED && owner >= 0) {
+                for (size_t i = 0; i < CLICK_AGENTS; i++) {
+                    spawn_agent(world, owner, p);
+                }
+            }
+        } break;
+        case EVENT_DEL_AGENT:
+            world_remove_agent(world, event.del_agent.id);
+            break;
+    }
+}
+
+static void frame_append(struct server_state *server, const void *data, size_t length) {
+    grow(&server->frame, &server->frame_cap, server->frame_len + length);
+    memcpy(server->frame + server->frame_len, data, length);
+    server->frame_len += length;
+}
+
+// Adds a worker's message to the frame, the header and the points as separate segments
+// so that clients have to put them back together as they would from the multiplexer
+static void frame_message(struct server_state *server, const struct server_worker *w, uint64_t cell_status) {
+    const uint64_t num_points = cell_status == CELL_ALIVE ? w->agents.size() : 0;
+    struct client_message message;
+    message.cell = w->cell;
+    message.num_points = num_points;
+    message.cell_status = cell_status;
+    message.stats.num_agents = num_points;
+    message.stats.num_agents_ghost = cell_status == CELL_ALIVE ? w->ghosts : 0;
+    const prefix_t header_size = sizeof(message);
+    const prefix_t points_size = num_points * sizeof(struct net_point);
+    const prefix_t end = 0;
+
+    struct multiplexer_header header;
+    header.id = w->id;
+    header.len = sizeof(header_size) + header_size + sizeof(end) + (num_points ? sizeof(points_size) + points_size : 0);
+    frame_append(server, &header, sizeof(header));
+    frame_append(server, &header_size, sizeof(header_size));
+    frame_append(server, &message, sizeof(message));
+    if (num_points) {
+        frame_append(server, &points_size, sizeof(points_size));
+        grow(&server->frame, &server->frame_cap, server->frame_len + points_size);
+        struct net_point *const points = (struct net_point *) (server->frame + server->frame_len);
+        // Kept just inside the cell so the position fits in NET_POSITION_BITS
+        const float top = server->world.cell_size * (1 - 0.5f / (1 << NET_POSITION_BITS));
+        const struct net_cell_context<2> ctx = net_cell_context_make<2>(w->cell);
+        for (uint64_t i = 0; i < num_points; i++) {
+            const struct server_agent *const a = &w->agents[i];
+            vec2f p;
+            p.x = w->origin.x + MIN(MAX(a->p.x - w->origin.x, 0.0f), top);
+            p.y = w->origin.y + MIN(MAX(a->p.y - w->origin.y, 0.0f), top);
+            struct net_point point;
+            point.net_encoded_position = net_encode_position(p, ctx);
+            point.net_encoded_color = w->colour;
+            point.id = a->id;
+            memcpy(&points[i], &point, sizeof(point));
+        }
+        server->frame_len += points_size;
+    }
+    frame_append(server, &end, sizeof(end));
+}
+
+static int listen_on(const char *host, const char *port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *servinfo;
+    const int rv = getaddrinfo(host, port, &hints, &servinfo);
+    if (rv != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        exit(EXIT_FAILURE);
+    }
+    int sockfd = -1;
+    for (struct addrinfo *p = servinfo; p != NULL; p = p->ai_next) {
+        sockfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+        if (sockfd == -1) {
+            perror("socket");
+            continue;
+        }
+        int one = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1 || listen(sockfd, 16) == -1) {
+            perror("bind");
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (sockfd == -1) {
+        fprintf(stderr, "failed to listen on %s:%s\n", host, port);
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+static void accept_clients(struct server_state *server) {
+    while (true) {
+        const int fd = accept4(server->listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct server_client client = {0};
+        client.fd = fd;
+        server->clients.push_back(client);
+        fprintf(stderr, "client connected, %zu now\n", server->clients.size());
+    }
+}
+
+// Returns false once the client has gone
+static bool client_send(struct server_state *server, struct server_client *c) {
+    while (c->out_pos < c->out_len) {
+        const ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        c->out_pos += n;
+        server->bytes_sent += n;
+    }
+    if (c->out_pos == c->out_len) {
+        c->out_pos = c->out_len = 0;
+    } else if (c->out_pos > c->out_cap / 2) {
+        memmove(c->out, c->out + c->out_pos, c->out_len - c->out_pos);
+        c->out_len -= c->out_pos;
+        c->out_pos = 0;
+    }
+    return true;
+}
+
+// Returns false once the client has gone
+static bool client_receive(struct server_state *server, struct server_client *c) {
+    while (true) {
+        grow(&c->in, &c->in_cap, c->in_len + SERVER_READ_SIZE);
+        const ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if (n == 0) {
+            return false;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->in_len += n;
+        size_t pos = 0;
+        prefix_t length;
+        while (c->in_len - pos >= sizeof(length)) {
+            memcpy(&length, c->in + pos, sizeof(length));
+            if (c->in_len - pos - sizeof(length) < length) {
+                break;
+            }
+            handle_event(server, c->in + pos + sizeof(length), length);
+            pos += sizeof(length) + length;
+        }
+        memmove(c->in, c->in + pos, c->in_len - pos);
+        c->in_len -= pos;
+    }
+}
+
+static void client_close(struct server_client *c) {
+    close(c->fd);
+    free(c->out);
+    free(c->in);
+}
+
+// Waits up to timeout_ms for clients to connect, send events or take more of what they
+// are owed
+static void service(struct server_state *server, int timeout_ms) {
+    server->pollfds.resize(server->clients.size() + 1);
+    server->pollfds[0].fd = server->listenfd;
+    server->pollfds[0].events = POLLIN;
+    for (size_t i = 0; i < server->clients.size(); i++) {
+        const struct server_client *const c = &server->clients[i];
+        server->pollfds[i + 1].fd = c->fd;
+        server->pollfds[i + 1].events = POLLIN | (c->out_pos < c->out_len ? POLLOUT : 0);
+        server->pollfds[i + 1].revents = 0;
+    }
+    if (poll(server->pollfds.data(), server->pollfds.size(), timeout_ms) == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        perror("poll");
+        exit(EXIT_FAILURE);
+    }
+    const size_t polled = server->pollfds.size() - 1;
+    for (size_t i = polled; i-- > 0;) {
+        struct server_client *const c = &server->clients[i];
+        const short revents = server->pollfds[i + 1].revents;
+        bool open = true;
+        if (revents & (POLLIN | POLLHUP | POLLERR)) {
+            open = client_receive(server, c);
+        }
+        if (open && (revents & POLLOUT)) {
+            open = client_send(server, c);
+        }
+        if (!open) {
+            client_close(c);
+            server->clients.erase(server->clients.begin() + i);
+            fprintf(stderr, "client disconnected, %zu left\n", server->clients.size());
+        }
+    }
+    if (server->pollfds[0].revents & POLLIN) {
+        accept_clients(server);
+    }
+}
+
+static size_t backlog(const struct server_client *c) {
+    return c->out_len - c->out_pos;
+}
+
+// Hands the frame to every client, or in real time to those that aren't too far behind
+static void broadcast(struct server_state *server, bool realtime) {
+    if (!realtime) {
+        while (true) {
+            bool behind = false;
+            for (size_t i = 0; i < server->clients.size(); i++) {
+                behind |= backlog(&server->clients[i]) > SERVER_BACKLOG_LIMIT;
+            }
+            if (!behind) {
+                break;
+            }
+            service(server, -1);
+        }
+    }
+    for (size_t i = 0; i < server->clients.size(); i++) {
+        struct server_client *const c = &server->clients[i];
+        if (backlog(c) > SERVER_BACKLOG_LIMIT) {
+            c->skipped++;
+            continue;
+        }
+        grow(&c->out, &c->out_cap, c->out_len + server->frame_len);
+        memcpy(c->out + c->out_len, server->frame, server->frame_len);
+        c->out_len += server->frame_len;
+    }
+    service(server, 0);
+}
+
+int main(int argc, char **argv) {
+    struct arguments arguments;
+    memset(&arguments, 0, sizeof(arguments));
+    arguments.workers = 4;
+    arguments.ticks = 0;
+    arguments.tickrate = 30;
+    arguments.cell_level = 3;
+    arguments.agents = 200;
+    arguments.realtime = true;
+    argument_parse(argc, argv, &arguments);
+    if (arguments.workers == 0 || arguments.tickrate == 0 || arguments.cell_level > 16) {
+        fprintf(stderr, "server: need at least one worker, a tickrate and a cell level of at most 16\n");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct server_state server;
+    server.listenfd = listen_on(arguments.host, arguments.port);
+    world_init(&server.world, &arguments);
+    server.frame = NULL;
+    server.frame_len = server.frame_cap = 0;
+    server.bytes_sent = 0;
+    server.events = 0;
+    fprintf(stderr, "listening on %s:%s with %lu workers of %lu agents in a %lux%lu grid of cells %.0f across\n",
+            arguments.host, arguments.port, (unsigned long) arguments.workers, (unsigned long) arguments.agents,
+            (unsigned long) server.world.cols, (unsigned long) server.world.rows, server.world.cell_size);
+
+    if (!arguments.realtime) {
+        while (server.clients.empty()) {
+            service(&server, -1);
+        }
+    }
+    const int64_t tick_ns = 1000000000LL / arguments.tickrate;
+    struct timespec next_tick = timer_get_monotonic();
+    struct timespec last_report = next_tick;
+    uint64_t last_bytes = 0;
+    for (uint64_t tick = 0; arguments.ticks == 0 || tick < arguments.ticks; tick++) {
+        world_tick(&server.world);
+        server.frame_len = 0;
+        for (size_t i = 0; i < server.world.workers.size(); i++) {
+            frame_message(&server, &server.world.workers[i], CELL_ALIVE);
+        }
+        broadcast(&server, arguments.realtime);
+
+        if (arguments.realtime) {
+            next_tick = timer_add(next_tick, tick_ns);
+            int64_t wait;
+            while ((wait = timer_diff_ns(next_tick, timer_get_monotonic())) > 0) {
+                service(&server, (wait + 999999) / 1000000);
+            }
+        }
+        const struct timespec now = timer_get_monotonic();
+        const int64_t since = timer_diff_ns(now, last_report);
+        if (since >= 1000000000LL) {
+            uint64_t agents = 0, skipped = 0;
+            for (size_t i = 0; i < server.world.workers.size(); i++) {
+                agents += server.world.workers[i].agents.size();
+            }
+            for (size_t i = 0; i < server.clients.size(); i++) {
+                skipped += server.clients[i].skipped;
+            }
+            fprintf(stderr, "tick %lu: %zu clients, %lu agents, %.1f MB/s sent, %lu events, %lu ticks skipped\n",
+                    (unsigned long) tick, server.clients.size(), (unsigned long) agents,
+                    (server.bytes_sent - last_bytes) / (since / 1e9) / 1e6, (unsigned long) server.events, (unsigned long) skipped);
+            last_report = now;
+            last_bytes = server.bytes_sent;
+        }
+    }
+
+    // Tell the clients the cells are gone, and give them a while to take it all
+    server.frame_len = 0;
+    for (size_t i = 0; i < server.world.workers.size(); i++) {
+        frame_message(&server, &server.world.workers[i], CELL_DYING);
+    }
+    broadcast(&server, false);
+    const struct timespec flush_start = timer_get_monotonic();
+    while (timer_diff_ns(timer_get_monotonic(), flush_start) < FLUSH_TIMEOUT_MS * 1000000LL) {
+        bool pending = false;
+        for (size_t i = 0; i < server.clients.size(); i++) {
+            pending |= backlog(&server.clients[i]) > 0;
+        }
+        if (!pending) {
+            break;
+        }
+        service(&server, 100);
+    }
+    for (size_t i = 0; i < server.clients.size(); i++) {
+        client_close(&server.clients[i]);
+    }
+    close(server.listenfd);
+    free(server.frame);
+    return 0;
+}
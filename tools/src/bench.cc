@@ -0,0 +1,222 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Replays a recording through librepclient as fast as it will go, decoding every point
+// the way the clients do, and reports how quickly messages get through. Nothing is drawn
+// and playback isn't paced, so what is measured is the ingest path on its own: reading,
+// decoding compressed records, repclient_tick and net_decode_points_2f, or with --scalar
+// net_decode_position_2f/net_decode_color point by point.
+//
+// A message's latency is from the repclient_tick call that returned it until its last
+// point has been decoded.
+
+#include <argp.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <net.hh>
+#include <timer.hh>
+#include <repclient.hh>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+struct bench_arguments {
+    const char *input;
+    long passes;
+    bool mmap_playback;
+    bool scalar;
+};
+
+struct bench_point {
+    vec2f p;
+    struct colour c;
+};
+
+// Where decoded points go
+struct bench_decoded {
+    std::vector<struct bench_point> points; // with --scalar
+    std::vector<float> components[5];       // otherwise, x, y, r, g and b
+    std::vector<uint32_t> ids;
+};
+
+struct bench_pass {
+    uint64_t messages;
+    uint64_t points;
+    uint64_t bytes;
+    int64_t elapsed; // nanoseconds
+};
+
+// Keeps the compiler from dropping the decoding
+static volatile float bench_sink;
+
+// Decodes a message as the OpenGL client does. Returns how many points it held.
+static uint64_t decode_message(const void *data, size_t length, bool scalar, struct bench_decoded *decoded) {
+    const struct client_message *const message = (const struct client_message *) data;
+    if (length < sizeof(*message)
+        || message->num_points > (length - sizeof(*message)) / sizeof(struct net_point)
+        || message->cell_status != CELL_ALIVE
+        || message->num_points == 0) {
+        return 0;
+    }
+    if (scalar) {
+        std::vector<struct bench_point> &points = decoded->points;
+        points.resize(message->num_points);
+        for (uint64_t i = 0; i < message->num_points; ++i) {
+            points[i].p = net_decode_position_2f(message->points[i].net_encoded_position, message->cell);
+            points[i].c = net_decode_color(message->points[i].net_encoded_color);
+        }
+        bench_sink = points[message->num_points - 1].p.x;
+    } else {
+        for (size_t i = 0; i < 5; i++) {
+            decoded->components[i].resize(message->num_points);
+        }
+        decoded->ids.resize(message->num_points);
+        const struct net_points_soa soa = {
+            decoded->components[0].data(), decoded->components[1].data(), NULL,
+            decoded->components[2].data(), decoded->components[3].data(), decoded->components[4].data(),
+            decoded->ids.data(),
+        };
+        net_decode_points_2f(message, &soa);
+        bench_sink = soa.x[message->num_points - 1];
+    }
+    return message->num_points;
+}
+
+static struct bench_pass run_pass(const struct bench_arguments *arguments, std::vector<int64_t> *latencies) {
+    struct repclient_options opts = {};
+    opts.playback_unthrottled = true;
+    opts.mmap_playback = arguments->mmap_playback;
+    struct repclient_state state = repclient_init_playback_opts(arguments->input, &opts);
+    struct bench_decoded decoded;
+    struct bench_pass pass = {0};
+
+    const struct timespec start = timer_get_monotonic();
+    while (true) {
+        const struct timespec before = timer_get_monotonic();
+        uint64_t worker_id;
+        size_t length;
+        void *const data = repclient_tick(&state, &worker_id, &length);
+        // Unthrottled playback only comes up empty at the end of the recording
+        if (!data) {
+            break;
+        }
+        pass.points += decode_message(data, length, arguments->scalar, &decoded);
+        latencies->push_back(timer_diff_ns(timer_get_monotonic(), before));
+        pass.messages++;
+        pass.bytes += length;
+    }
+    pass.elapsed = timer_diff_ns(timer_get_monotonic(), start);
+    repclient_destroy(&state);
+    return pass;
+}
+
+static double percentile(const std::vector<int64_t> &sorted, double p) {
+    const size_t rank = MIN((size_t) (p * sorted.size()), sorted.size() - 1);
+    return sorted[rank] / 1000.0;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct bench_arguments *arguments = (struct bench_arguments *) state->input;
+    switch (key) {
+        case 'p':
+            arguments->passes = atol(arg);
+            if (arguments->passes < 1) {
+                argp_error(state, "PASSES has to be at least 1");
+            }
+            break;
+        case 'm':
+            arguments->mmap_playback = true;
+            break;
+        case 's':
+            arguments->scalar = true;
+            break;
+
+        case ARGP_KEY_ARG:
+            if (state->arg_num == 0) {
+                arguments->input = arg;
+            } else {
+                argp_usage(state);
+            }
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 1) {
+                argp_usage(state);
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void argument_parse(int argc, char **argv, struct bench_arguments *arguments) {
+    static char doc[] = "Measures how fast librepclient takes in an Aether recording\v"
+        "Throughput is from the fastest pass, so that one slow pass, say while the "
+        "recording is first read into the page cache, doesn't hide a regression. "
+        "Latencies are over every message of every pass.";
+    static char args_doc[] = "RECORDING";
+    static struct argp_option options[] = {
+        {"passes", 'p', "PASSES", 0, "Times to replay the recording, 3 by default"},
+        {"mmap",   'm', 0,        0, "Play back from a mapping of the recording"},
+        {"scalar", 's', 0,        0, "Decode points one at a time rather than in bulk"},
+        {0}
+    };
+    static struct argp argp = {options, parse_opt, args_doc, doc};
+    argp_parse(&argp, argc, argv, 0, 0, arguments);
+}
+
+int main(int argc, char **argv) {
+    struct bench_arguments arguments = {0};
+    arguments.passes = 3;
+    argument_parse(argc, argv, &arguments);
+
+    if (access(arguments.input, R_OK) == -1) {
+        perror(arguments.input);
+        exit(EXIT_FAILURE);
+    }
+    std::vector<int64_t> latencies;
+    struct bench_pass best = {0};
+    for (long i = 0; i < arguments.passes; i++) {
+        const struct bench_pass pass = run_pass(&arguments, &latencies);
+        printf("pass %ld: %lu messages, %lu points, %lu bytes in %.3f s\n", i + 1,
+               (unsigned long) pass.messages, (unsigned long) pass.points, (unsigned long) pass.bytes, pass.elapsed / 1e9);
+        if (i == 0 || pass.elapsed < best.elapsed) {
+            best = pass;
+        }
+    }
+    if (best.messages == 0) {
+        fprintf(stderr, "bench: %s has no messages in it\n", arguments.input);
+        exit(EXIT_FAILURE);
+    }
+    const double seconds = MAX(best.elapsed, (int64_t) 1) / 1e9;
+    printf("messages/s: %.0f\n", best.messages / seconds);
+    printf("points/s:   %.0f\n", best.points / seconds);
+    printf("bytes/s:    %.0f\n", best.bytes / seconds);
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("latency us: p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+           percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99),
+           percentile(latencies, 0.999), latencies.back() / 1000.0);
+    return 0;
+}
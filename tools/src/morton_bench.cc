@@ -0,0 +1,415 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Times every implementation of the Morton code operations in morton.hh on this host,
+// alongside whichever one morton.hh picks for itself, and checks they all agree. Array
+// versions are listed with [] after the operation.
+
+#include <argp.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <morton.hh>
+#include <timer.hh>
+
+#define MIN_ROUND_NS 20000000 // each round repeats the values until it has taken this long
+
+struct morton_bench_arguments {
+    size_t count;
+    long rounds;
+};
+
+struct morton_data {
+    std::vector<uint32_t> x, y, z;
+    std::vector<uint64_t> codes2, codes3;
+    std::vector<uint64_t> deltas2, deltas3;
+    // Where the array versions put their results
+    std::vector<uint64_t> out_codes;
+    std::vector<uint32_t> out_x, out_y, out_z;
+};
+
+// One way of doing one operation over every value, returning a checksum of the results
+struct morton_case {
+    const char *operation;
+    const char *impl;
+    bool available;
+    uint64_t (*run)(struct morton_data *data);
+};
+
+static uint64_t encode2_magic(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->x.size(); i++) {
+        sum += morton2d_32_encode_magic(d->x[i], d->y[i]);
+    }
+    return sum;
+}
+
+static uint64_t decode2_magic(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes2.size(); i++) {
+        uint32_t x, y;
+        morton2d_32_decode_magic(d->codes2[i], &x, &y);
+        sum += x ^ ((uint64_t) y << 32);
+    }
+    return sum;
+}
+
+static uint64_t encode3_magic(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->x.size(); i++) {
+        sum += morton3d_21_encode_magic(d->x[i], d->y[i], d->z[i]);
+    }
+    return sum;
+}
+
+static uint64_t decode3_magic(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes3.size(); i++) {
+        uint32_t x, y, z;
+        morton3d_21_decode_magic(d->codes3[i], &x, &y, &z);
+        sum += x ^ ((uint64_t) y << 21) ^ ((uint64_t) z << 42);
+    }
+    return sum;
+}
+
+static uint64_t sum_codes(const struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->out_codes.size(); i++) {
+        sum += d->out_codes[i];
+    }
+    return sum;
+}
+
+static uint64_t sum_coordinates(const struct morton_data *d, int shift) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->out_x.size(); i++) {
+        sum += d->out_x[i] ^ ((uint64_t) d->out_y[i] << shift) ^ (shift < 32 ? (uint64_t) d->out_z[i] << (2 * shift) : 0);
+    }
+    return sum;
+}
+
+// The array versions, counting what they put out as part of the work
+#define MORTON_ARRAY_CASES(NAME, SUFFIX) \
+    static uint64_t encode2_array_##NAME(struct morton_data *d) { \
+        morton2d_32_encode_array##SUFFIX(d->out_codes.data(), d->x.data(), d->y.data(), d->x.size()); \
+        return sum_codes(d); \
+    } \
+    static uint64_t decode2_array_##NAME(struct morton_data *d) { \
+        morton2d_32_decode_array##SUFFIX(d->codes2.data(), d->out_x.data(), d->out_y.data(), d->codes2.size()); \
+        return sum_coordinates(d, 32); \
+    } \
+    static uint64_t encode3_array_##NAME(struct morton_data *d) { \
+        morton3d_21_encode_array##SUFFIX(d->out_codes.data(), d->x.data(), d->y.data(), d->z.data(), d->x.size()); \
+        return sum_codes(d); \
+    } \
+    static uint64_t decode3_array_##NAME(struct morton_data *d) { \
+        morton3d_21_decode_array##SUFFIX(d->codes3.data(), d->out_x.data(), d->out_y.data(), d->out_z.data(), d->codes3.size()); \
+        return sum_coordinates(d, 21); \
+    }
+
+MORTON_ARRAY_CASES(magic, _magic)
+MORTON_ARRAY_CASES(selected, )
+#if MORTON_HAVE_BMI2
+MORTON_ARRAY_CASES(bmi2, _bmi2)
+#endif
+
+#if MORTON_HAVE_BMI2
+static uint64_t encode2_bmi2(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->x.size(); i++) {
+        sum += morton2d_32_encode_bmi2(d->x[i], d->y[i]);
+    }
+    return sum;
+}
+
+static uint64_t decode2_bmi2(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes2.size(); i++) {
+        uint32_t x, y;
+        morton2d_32_decode_bmi2(d->codes2[i], &x, &y);
+        sum += x ^ ((uint64_t) y << 32);
+    }
+    return sum;
+}
+
+static uint64_t encode3_bmi2(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->x.size(); i++) {
+        sum += morton3d_21_encode_bmi2(d->x[i], d->y[i], d->z[i]);
+    }
+    return sum;
+}
+
+static uint64_t decode3_bmi2(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes3.size(); i++) {
+        uint32_t x, y, z;
+        morton3d_21_decode_bmi2(d->codes3[i], &x, &y, &z);
+        sum += x ^ ((uint64_t) y << 21) ^ ((uint64_t) z << 42);
+    }
+    return sum;
+}
+#endif
+
+static uint64_t encode2_selected(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->x.size(); i++) {
+        struct morton2d_32 code;
+        morton2d_32_encode(&code, d->x[i], d->y[i]);
+        sum += code.value;
+    }
+    return sum;
+}
+
+static uint64_t decode2_selected(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes2.size(); i++) {
+        const struct morton2d_32 code = { d->codes2[i] };
+        uint32_t x, y;
+        morton2d_32_decode(&code, &x, &y);
+        sum += x ^ ((uint64_t) y << 32);
+    }
+    return sum;
+}
+
+static uint64_t add2(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes2.size(); i++) {
+        sum += morton_2_add(d->codes2[i], d->deltas2[i]);
+    }
+    return sum;
+}
+
+static uint64_t sub2(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes2.size(); i++) {
+        sum += morton_2_sub(d->codes2[i], d->deltas2[i]);
+    }
+    return sum;
+}
+
+static uint64_t encode3_selected(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->x.size(); i++) {
+        struct morton3d_21 code;
+        morton3d_21_encode(&code, d->x[i], d->y[i], d->z[i]);
+        sum += code.value;
+    }
+    return sum;
+}
+
+static uint64_t decode3_selected(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes3.size(); i++) {
+        const struct morton3d_21 code = { d->codes3[i] };
+        uint32_t x, y, z;
+        morton3d_21_decode(&code, &x, &y, &z);
+        sum += x ^ ((uint64_t) y << 21) ^ ((uint64_t) z << 42);
+    }
+    return sum;
+}
+
+static uint64_t add3(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes3.size(); i++) {
+        sum += morton_3_add(d->codes3[i], d->deltas3[i]);
+    }
+    return sum;
+}
+
+static uint64_t sub3(struct morton_data *d) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->codes3.size(); i++) {
+        sum += morton_3_sub(d->codes3[i], d->deltas3[i]);
+    }
+    return sum;
+}
+
+static void make_data(struct morton_data *d, size_t count) {
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    d->x.resize(count);
+    d->y.resize(count);
+    d->z.resize(count);
+    d->codes2.resize(count);
+    d->codes3.resize(count);
+    d->deltas2.resize(count);
+    d->deltas3.resize(count);
+    d->out_codes.resize(count);
+    d->out_x.resize(count);
+    d->out_y.resize(count);
+    d->out_z.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        // xorshift64*
+        uint64_t r[4];
+        for (size_t j = 0; j < 4; j++) {
+            rng ^= rng >> 12;
+            rng ^= rng << 25;
+            rng ^= rng >> 27;
+            r[j] = rng * 0x2545F4914F6CDD1DULL;
+        }
+        // 3D codes hold 21 bits an axis
+        d->x[i] = (uint32_t) r[0] & 0x1fffff;
+        d->y[i] = (uint32_t) (r[0] >> 32) & 0x1fffff;
+        d->z[i] = (uint32_t) r[1] & 0x1fffff;
+        d->codes2[i] = r[2];
+        d->codes3[i] = r[3] & 0x7fffffffffffffffULL;
+        d->deltas2[i] = morton2d_32_encode_magic((uint32_t) r[1] & 0xff, (uint32_t) (r[1] >> 8) & 0xff);
+        d->deltas3[i] = r[1] & 0x3ffff;
+    }
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct morton_bench_arguments *arguments = (struct morton_bench_arguments *) state->input;
+    switch (key) {
+        case 'n':
+            arguments->count = atol(arg);
+            if (arguments->count < 1) {
+                argp_error(state, "COUNT has to be at least 1");
+            }
+            break;
+        case 'r':
+            arguments->rounds = atol(arg);
+            if (arguments->rounds < 1) {
+                argp_error(state, "ROUNDS has to be at least 1");
+            }
+            break;
+        case ARGP_KEY_ARG:
+            argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void argument_parse(int argc, char **argv, struct morton_bench_arguments *arguments) {
+    static char doc[] = "Times the Morton code operations in morton.hh\v"
+        "Each is run over the same random values, and the fastest round counts. "
+        "\"selected\" is what morton.hh uses: for single values, whichever it was built with; for arrays, the one "
+        "it picked on this host, which MORTON_IMPL=bmi2 or MORTON_IMPL=magic in the environment overrides.";
+    static struct argp_option options[] = {
+        {"count",  'n', "COUNT",  0, "Values to run each operation over, 65536 by default"},
+        {"rounds", 'r', "ROUNDS", 0, "Rounds to time each operation for, 5 by default"},
+        {0}
+    };
+    static struct argp argp = {options, parse_opt, NULL, doc};
+    argp_parse(&argp, argc, argv, 0, 0, arguments);
+}
+
+int main(int argc, char **argv) {
+    struct morton_bench_arguments arguments = {0};
+    arguments.count = 1 << 16;
+    arguments.rounds = 5;
+    argument_parse(argc, argv, &arguments);
+
+    struct morton_data data;
+    make_data(&data, arguments.count);
+    const bool bmi2 = morton_cpu_has_bmi2();
+    static const char *const families[morton_families] = { "2D arrays", "3D arrays" };
+    printf("BMI2 %s, built with %s for single values, selected", bmi2 ? "available" : "unavailable",
+           MORTON_SCALAR_BMI2 ? "bmi2" : "magic");
+    for (int family = 0; family < morton_families; family++) {
+        const bool bmi2_selected = morton_impl_get((enum morton_family) family) == morton_impl_bmi2;
+        printf("%s %s for %s", family ? "," : "", bmi2_selected ? "bmi2" : "magic", families[family]);
+    }
+    printf("\n");
+
+    const struct morton_case cases[] = {
+        {"encode2", "magic",    true, encode2_magic},
+#if MORTON_HAVE_BMI2
+        {"encode2", "bmi2",     bmi2, encode2_bmi2},
+#endif
+        {"encode2", "selected", true, encode2_selected},
+        {"decode2", "magic",    true, decode2_magic},
+#if MORTON_HAVE_BMI2
+        {"decode2", "bmi2",     bmi2, decode2_bmi2},
+#endif
+        {"decode2", "selected", true, decode2_selected},
+        {"add2",    "masked",   true, add2},
+        {"sub2",    "masked",   true, sub2},
+        {"encode3", "magic",    true, encode3_magic},
+#if MORTON_HAVE_BMI2
+        {"encode3", "bmi2",     bmi2, encode3_bmi2},
+#endif
+        {"encode3", "selected", true, encode3_selected},
+        {"decode3", "magic",    true, decode3_magic},
+#if MORTON_HAVE_BMI2
+        {"decode3", "bmi2",     bmi2, decode3_bmi2},
+#endif
+        {"decode3", "selected", true, decode3_selected},
+        {"add3",    "masked",   true, add3},
+        {"sub3",    "masked",   true, sub3},
+        {"encode2[]", "magic",    true, encode2_array_magic},
+#if MORTON_HAVE_BMI2
+        {"encode2[]", "bmi2",     bmi2, encode2_array_bmi2},
+#endif
+        {"encode2[]", "selected", true, encode2_array_selected},
+        {"decode2[]", "magic",    true, decode2_array_magic},
+#if MORTON_HAVE_BMI2
+        {"decode2[]", "bmi2",     bmi2, decode2_array_bmi2},
+#endif
+        {"decode2[]", "selected", true, decode2_array_selected},
+        {"encode3[]", "magic",    true, encode3_array_magic},
+#if MORTON_HAVE_BMI2
+        {"encode3[]", "bmi2",     bmi2, encode3_array_bmi2},
+#endif
+        {"encode3[]", "selected", true, encode3_array_selected},
+        {"decode3[]", "magic",    true, decode3_array_magic},
+#if MORTON_HAVE_BMI2
+        {"decode3[]", "bmi2",     bmi2, decode3_array_bmi2},
+#endif
+        {"decode3[]", "selected", true, decode3_array_selected},
+    };
+    const size_t num_cases = sizeof(cases) / sizeof(cases[0]);
+
+    bool agree = true;
+    printf("%-10s %-9s %8s %9s\n", "op", "impl", "ns/op", "Mops/s");
+    for (size_t i = 0; i < num_cases; i++) {
+        const struct morton_case *const c = &cases[i];
+        if (!c->available) {
+            continue;
+        }
+        const uint64_t expected = c->run(&data);
+        for (size_t j = 0; j < i; j++) {
+            if (cases[j].available && strcmp(cases[j].operation, c->operation) == 0 && cases[j].run(&data) != expected) {
+                fprintf(stderr, "morton_bench: %s %s disagrees with %s\n", c->operation, c->impl, cases[j].impl);
+                agree = false;
+            }
+        }
+        double best = 0;
+        for (long round = 0; round < arguments.rounds; round++) {
+            const struct timespec start = timer_get_monotonic();
+            uint64_t ops = 0;
+            int64_t elapsed;
+            do {
+                if (c->run(&data) != expected) {
+                    fprintf(stderr, "morton_bench: %s %s isn't deterministic\n", c->operation, c->impl);
+                    exit(EXIT_FAILURE);
+                }
+                ops += data.x.size();
+            } while ((elapsed = timer_diff_ns(timer_get_monotonic(), start)) < MIN_ROUND_NS);
+            const double ns = (double) elapsed / ops;
+            best = round == 0 || ns < best ? ns : best;
+        }
+        printf("%-10s %-9s %8.3f %9.1f\n", c->operation, c->impl, best, 1000 / best);
+    }
+    return agree ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,316 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Copies part of a recording into a new one: a range of time, some of the workers, or
+// both. The input is streamed through a mapping that is let go of as it goes, so memory
+// use doesn't depend on how big the recording is.
+//
+// Compressed recordings code each message against its worker's previous one, so a
+// worker's first record in the range is decoded from its last keyframe and written out
+// as a keyframe. Everything after that is copied as it is.
+
+#include <argp.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <net.hh>
+#include <worker_table.hh>
+#include <repclient.hh>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+#define NS_PER_SECOND 1000000000ULL
+// How much of the input is read between letting go of what's been read
+#define RELEASE_STEP (64 * 1024 * 1024)
+
+struct slice_arguments {
+    const char *input;
+    const char *output;
+    uint64_t start;
+    uint64_t end; // UINT64_MAX for the end of the recording
+    bool rebase;
+    struct worker_table workers; // empty to keep every worker
+};
+
+// A worker that is being kept.
+// This needs to make sense when zeroed
+struct slice_worker {
+    struct codec_worker codec; // decoded up to its first record in the range
+    bool started; // records are copied as they are once one has been written
+    struct recording_index_entry written; // offsets in the output, 0 until there are some
+};
+
+static uint64_t parse_seconds(const char *arg, struct argp_state *state) {
+    char *end;
+    const double seconds = strtod(arg, &end);
+    if (end == arg || *end != '\0' || !(seconds >= 0)) {
+        argp_error(state, "'%s' isn't a number of seconds", arg);
+    }
+    return seconds * NS_PER_SECOND < (double) UINT64_MAX ? (uint64_t) (seconds * NS_PER_SECOND) : UINT64_MAX;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct slice_arguments *arguments = (struct slice_arguments *) state->input;
+    switch (key) {
+        case 's':
+            arguments->start = parse_seconds(arg, state);
+            break;
+        case 'e':
+            arguments->end = parse_seconds(arg, state);
+            break;
+        case 'w': {
+            char *end;
+            const uint64_t id = strtoull(arg, &end, 0);
+            if (end == arg || *end != '\0' || id > RECORDING_WORKER_MASK) {
+                argp_error(state, "'%s' isn't a worker id", arg);
+            }
+            worker_table_insert(&arguments->workers, id);
+        } break;
+        case 'r':
+            arguments->rebase = true;
+            break;
+
+        case ARGP_KEY_ARG:
+            if (state->arg_num == 0) {
+                arguments->input = arg;
+            } else if (state->arg_num == 1) {
+                arguments->output = arg;
+            } else {
+                argp_usage(state);
+            }
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 2) {
+                argp_usage(state);
+            }
+            if (arguments->end <= arguments->start) {
+                argp_error(state, "the range ends before it starts");
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void argument_parse(int argc, char **argv, struct slice_arguments *arguments) {
+    static char doc[] = "Copies part of an Aether recording into a new one\v"
+        "Times are in seconds from the start of the recording. The range includes START and "
+        "leaves out END. Without any --worker, every worker is kept.";
+    static char args_doc[] = "INPUT OUTPUT";
+    static struct argp_option options[] = {
+        {"start",   's', "START",  0, "Leave out everything before START"},
+        {"end",     'e', "END",    0, "Leave out everything from END on"},
+        {"worker",  'w', "ID",     0, "Keep worker ID, and any others given"},
+        {"rebase",  'r', 0,        0, "Make START time 0 in the new recording"},
+        {0}
+    };
+    static struct argp argp = {options, parse_opt, args_doc, doc};
+    argp_parse(&argp, argc, argv, 0, 0, arguments);
+}
+
+// Where to read from so that every kept worker can be decoded by start
+static uint64_t start_offset(const struct slice_arguments *arguments, const struct recording_info *info) {
+    struct recording_index idx = recording_index();
+    uint64_t offset = info->data_offset;
+    if (arguments->start && recording_index_load(&idx, arguments->input)) {
+        const struct recording_index_point *point = recording_index_find(&idx, arguments->start);
+        uint64_t keyframe = point ? point->offset : info->data_offset;
+        for (size_t i = 0; point && i < point->num_entries; i++) {
+            const struct recording_index_entry *const entry = &idx.entries[point->first_entry + i];
+            if (!arguments->workers.count || worker_table_find(&arguments->workers, entry->worker_id) != WORKER_TABLE_NONE) {
+                keyframe = MIN(keyframe, entry->keyframe);
+            }
+        }
+        const struct recording_index_point *before = recording_index_find_offset(&idx, keyframe);
+        offset = before ? before->offset : info->data_offset;
+    }
+    recording_index_free(&idx);
+    return offset;
+}
+
+int main(int argc, char **argv) {
+    struct slice_arguments arguments = {0};
+    arguments.end = UINT64_MAX;
+    argument_parse(argc, argv, &arguments);
+
+    const int fd = open(arguments.input, O_RDONLY);
+    if (fd == -1) {
+        perror(arguments.input);
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    const size_t map_len = st.st_size;
+    uint8_t *const map = map_len ? (uint8_t *) mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    madvise(map, map_len, MADV_SEQUENTIAL);
+    struct recording_info info = recording_info();
+    if (recording_info_read(&info, fd, map, map_len) != recording_ok) {
+        fprintf(stderr, "slice: %s isn't a recording\n", arguments.input);
+        exit(EXIT_FAILURE);
+    }
+
+    const int outfd = open(arguments.output, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (outfd == -1) {
+        perror(arguments.output);
+        exit(EXIT_FAILURE);
+    }
+    const int idxfd = recording_index_create(arguments.output);
+    const uint64_t rebase = arguments.rebase ? arguments.start : 0;
+    struct recording_file_header header;
+    recording_file_header_init(&header);
+    if (info.version == 1) {
+        header.position_bits = NET_POSITION_BITS;
+        header.point_size = sizeof(struct net_point);
+        header.message_size = sizeof(struct client_message);
+    } else {
+        header.dims = info.header.dims;
+        header.position_bits = info.header.position_bits;
+        header.point_size = info.header.point_size;
+        header.message_size = info.header.message_size;
+        header.clock_base = info.header.clock_base ? info.header.clock_base + rebase : 0;
+    }
+    recording_file_header_seal(&header);
+    struct recording_writer writer = recording_writer();
+    writer.fd = outfd;
+    recording_writer_start(&writer, &header);
+
+    struct worker_table seen = worker_table();
+    struct slice_worker *workers = NULL;
+    size_t workers_cap = 0;
+    struct codec_scratch scratch = codec_scratch();
+    uint8_t *coded = NULL;
+    size_t coded_cap = 0;
+    uint64_t next_index_time = 0, last_time = 0;
+    size_t num_read = 0, num_written = 0;
+
+    const uint64_t offset = start_offset(&arguments, &info);
+    struct recording_cursor cursor = { offset, offset };
+    const long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t released = 0;
+    struct recording_record record;
+    while (recording_read_record(&info, fd, map, map_len, &cursor, &record, true) == recording_ok) {
+        cursor.offset = record.next;
+        num_read++;
+        if (record.time >= arguments.end) {
+            break;
+        }
+        if (cursor.offset - released >= RELEASE_STEP) {
+            const uint64_t upto = cursor.offset / page_size * page_size;
+            madvise(map + released, upto - released, MADV_DONTNEED);
+            released = upto;
+        }
+        const uint64_t worker_id = record.worker_id & RECORDING_WORKER_MASK;
+        if (arguments.workers.count && worker_table_find(&arguments.workers, worker_id) == WORKER_TABLE_NONE) {
+            continue;
+        }
+        const uint32_t slot = worker_table_insert(&seen, worker_id);
+        if (slot == workers_cap) {
+            workers_cap = MAX(workers_cap * 2, 64);
+            workers = (struct slice_worker *) realloc(workers, workers_cap * sizeof(*workers));
+            assert(workers);
+            memset(workers + slot, 0, (workers_cap - slot) * sizeof(*workers));
+        }
+        struct slice_worker *const w = &workers[slot];
+
+        uint64_t id = record.worker_id;
+        const uint8_t *data = map + record.data;
+        size_t length = record.length;
+        if (!w->started && (record.worker_id & RECORDING_COMPRESSED)) {
+            const bool decoded = codec_decode(&w->codec, &scratch, data, length, !(record.worker_id & RECORDING_DELTA));
+            if (record.time < arguments.start || !decoded) {
+                continue;
+            }
+            if (record.worker_id & RECORDING_DELTA) {
+                const struct repclient_segment message = { w->codec.prev, w->codec.prev_len };
+                length = codec_encode(&w->codec, &scratch, &message, 1, message.len, true, &coded, &coded_cap);
+                data = coded;
+                id = worker_id | RECORDING_COMPRESSED;
+            }
+        } else if (record.time < arguments.start) {
+            continue;
+        }
+        if (!w->started) {
+            w->started = true;
+            w->written.worker_id = worker_id;
+            codec_worker_free(&w->codec);
+        }
+
+        const uint64_t time = record.time - rebase;
+        // Index points fall between chunks, as they do when recording
+        if (time >= next_index_time) {
+            recording_writer_close_chunk(&writer);
+            if (idxfd != -1) {
+                struct recording_index_entry *entries = (struct recording_index_entry *) malloc(MAX(seen.count, 1) * sizeof(*entries));
+                assert(entries);
+                size_t num_entries = 0;
+                for (size_t i = 0; i < seen.count; i++) {
+                    if (workers[i].written.offset) {
+                        entries[num_entries++] = workers[i].written;
+                    }
+                }
+                recording_index_write_point(idxfd, writer.offset, last_time, entries, num_entries);
+                free(entries);
+            }
+            next_index_time = time + RECORDING_INDEX_INTERVAL;
+        }
+        recording_writer_append(&writer, id, time, data, length);
+        // The record ends where the recording does
+        w->written.offset = writer.offset - sizeof(struct recording_record_header) - length;
+        if (!(id & RECORDING_DELTA)) {
+            w->written.keyframe = w->written.offset;
+        }
+        last_time = time;
+        num_written++;
+    }
+    recording_writer_finish(&writer);
+    printf("kept %zu of the %zu records read, %lu bytes\n", num_written, num_read, (unsigned long) writer.offset);
+
+    recording_writer_free(&writer);
+    if (idxfd != -1) {
+        close(idxfd);
+    }
+    close(outfd);
+    for (size_t i = 0; i < seen.count; i++) {
+        codec_worker_free(&workers[i].codec);
+    }
+    free(workers);
+    free(coded);
+    codec_scratch_free(&scratch);
+    worker_table_free(&seen);
+    worker_table_free(&arguments.workers);
+    recording_info_free(&info);
+    if (map) {
+        munmap(map, map_len);
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,661 @@
+/*
+   Copyright 2018 Hadean Supercomputing Inc.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Scans a recording for what it would take to carry it: how much each worker sends and
+// how evenly, how big messages are, how many points they hold, and the agent totals the
+// workers report over time. Recordings with a chunk table are split between threads a
+// run of chunks at a time, and the results put together in order afterwards.
+//
+// A compressed record can only be decoded on top of its worker's last keyframe, and
+// every worker has one at least every RECORDING_KEYFRAME_INTERVAL. So each thread starts
+// decoding that much before its chunks, without counting what it decodes there.
+
+#include <argp.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+
+#include <net.hh>
+#include <worker_table.hh>
+#include <repclient.hh>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+#define NS_PER_SECOND 1000000000ULL
+#define UNITS_PER_THREAD 4
+#define LOG2_BUCKETS 65 // 0, then one for each power of two
+// Gaps between a worker's messages are bucketed by microseconds, with 1 << GAP_SUB_BITS
+// buckets for each power of two so that percentiles come out within 25%
+#define GAP_SUB_BITS 2
+#define GAP_BUCKETS ((64 - GAP_SUB_BITS + 1) << GAP_SUB_BITS)
+
+enum stats_format {
+    format_json, format_csv,
+};
+
+enum stats_table {
+    table_workers, table_sizes, table_points, table_agents,
+};
+
+struct stats_arguments {
+    const char *input;
+    enum stats_format format;
+    enum stats_table table; // the one printed as CSV
+    uint64_t interval;      // nanoseconds per row of agent totals
+    long jobs;
+};
+
+// This needs to make sense when zeroed
+struct gap_stats {
+    uint64_t count;
+    double sum;         // of microseconds
+    double sum_squares;
+    uint64_t max;
+    uint32_t buckets[GAP_BUCKETS];
+};
+
+// What has been found out about one worker, by a unit or overall.
+// This needs to make sense when zeroed
+struct worker_stats {
+    uint64_t worker_id;
+    uint64_t records;
+    uint64_t bytes; // decoded
+    uint64_t first_time;
+    uint64_t last_time;
+    struct gap_stats gaps;
+    bool reported;         // has sent a client_message
+    uint64_t first_bucket; // of the agent totals, where it first reported
+    struct client_stats first_stats;
+    struct client_stats last_stats;
+};
+
+// How the agent totals changed in one row
+struct agent_delta {
+    int64_t agents;
+    int64_t ghosts;
+};
+
+// A run of chunks scanned by one thread.
+// This needs to make sense when zeroed
+struct stats_unit {
+    uint64_t warm_offset; // where decoding starts
+    uint64_t offset;      // where counting starts
+    uint64_t end;         // offset of the next unit's first record, UINT64_MAX for the last
+    struct worker_table workers;
+    struct worker_stats *stats; // by slot
+    struct codec_worker *codecs;
+    size_t cap;
+    uint64_t sizes[LOG2_BUCKETS];
+    uint64_t points[LOG2_BUCKETS];
+    uint64_t messages;    // that were client_messages
+    uint64_t total_points;
+    uint64_t max_points;
+    uint64_t undecodable; // deltas with nothing to decode them on top of
+    uint64_t base_bucket;
+    struct agent_delta *deltas; // by row from base_bucket
+    size_t num_deltas;
+    size_t deltas_cap;
+};
+
+struct stats_scan {
+    int fd;
+    const uint8_t *map;
+    size_t map_len;
+    struct recording_info info;
+    uint64_t interval;
+    struct stats_unit *units;
+    size_t num_units;
+    std::atomic<size_t> next_unit;
+};
+
+static size_t log2_bucket(uint64_t v) {
+    return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+static uint64_t log2_bucket_start(size_t b) {
+    return b ? 1ULL << (b - 1) : 0;
+}
+
+static size_t gap_bucket(uint64_t us) {
+    if (us < (1 << GAP_SUB_BITS)) {
+        return us;
+    }
+    const int e = 63 - __builtin_clzll(us);
+    return ((e - GAP_SUB_BITS + 1) << GAP_SUB_BITS) | ((us >> (e - GAP_SUB_BITS)) & ((1 << GAP_SUB_BITS) - 1));
+}
+
+static uint64_t gap_bucket_start(size_t b) {
+    if (b < (1 << GAP_SUB_BITS)) {
+        return b;
+    }
+    const int e = (b >> GAP_SUB_BITS) - 1 + GAP_SUB_BITS;
+    return (1ULL << e) | ((uint64_t) (b & ((1 << GAP_SUB_BITS) - 1)) << (e - GAP_SUB_BITS));
+}
+
+static void gap_add(struct gap_stats *g, uint64_t ns) {
+    const uint64_t us = ns / 1000;
+    g->count++;
+    g->sum += us;
+    g->sum_squares += (double) us * us;
+    g->max = MAX(g->max, us);
+    g->buckets[gap_bucket(us)]++;
+}
+
+static void gap_merge(struct gap_stats *into, const struct gap_stats *from) {
+    into->count += from->count;
+    into->sum += from->sum;
+    into->sum_squares += from->sum_squares;
+    into->max = MAX(into->max, from->max);
+    for (size_t i = 0; i < GAP_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+// In milliseconds, to within a bucket
+static double gap_percentile(const struct gap_stats *g, double p) {
+    const uint64_t rank = ceil(p * g->count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < GAP_BUCKETS; i++) {
+        seen += g->buckets[i];
+        if (seen >= MAX(rank, 1)) {
+            return gap_bucket_start(i) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+static uint32_t stats_slot(struct worker_table *workers, struct worker_stats **stats, struct codec_worker **codecs, size_t *cap, uint64_t worker_id) {
+    const size_t known = workers->count;
+    const uint32_t slot = worker_table_insert(workers, worker_id);
+    if (workers->count == known) {
+        return slot;
+    }
+    if (slot == *cap) {
+        *cap = MAX(*cap * 2, 64);
+        *stats = (struct worker_stats *) realloc(*stats, *cap * sizeof(**stats));
+        assert(*stats);
+        if (codecs) {
+            *codecs = (struct codec_worker *) realloc(*codecs, *cap * sizeof(**codecs));
+            assert(*codecs);
+        }
+    }
+    (*stats)[slot] = worker_stats();
+    (*stats)[slot].worker_id = worker_id;
+    if (codecs) {
+        (*codecs)[slot] = codec_worker();
+    }
+    return slot;
+}
+
+static struct agent_delta *unit_delta(struct stats_unit *unit, uint64_t bucket) {
+    if (unit->num_deltas == 0) {
+        unit->base_bucket = bucket;
+    }
+    assert(bucket >= unit->base_bucket);
+    const size_t row = bucket - unit->base_bucket;
+    if (row >= unit->deltas_cap) {
+        const size_t cap = MAX(row + 1, MAX(unit->deltas_cap * 2, 64));
+        unit->deltas = (struct agent_delta *) realloc(unit->deltas, cap * sizeof(*unit->deltas));
+        assert(unit->deltas);
+        memset(unit->deltas + unit->deltas_cap, 0, (cap - unit->deltas_cap) * sizeof(*unit->deltas));
+        unit->deltas_cap = cap;
+    }
+    unit->num_deltas = MAX(unit->num_deltas, row + 1);
+    return &unit->deltas[row];
+}
+
+static void count_message(const struct stats_scan *scan, struct stats_unit *unit, struct worker_stats *w,
+                          uint64_t time, const uint8_t *msg, size_t length) {
+    if (w->records) {
+        gap_add(&w->gaps, time - w->last_time);
+    } else {
+        w->first_time = time;
+    }
+    w->records++;
+    w->bytes += length;
+    w->last_time = time;
+    unit->sizes[log2_bucket(length)]++;
+
+    struct client_message header;
+    if (length < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, msg, sizeof(header));
+    if (header.num_points > (length - sizeof(header)) / sizeof(struct net_point)
+        || sizeof(header) + header.num_points * sizeof(struct net_point) != length) {
+        return;
+    }
+    unit->messages++;
+    unit->points[log2_bucket(header.num_points)]++;
+    unit->total_points += header.num_points;
+    unit->max_points = MAX(unit->max_points, header.num_points);
+
+    const uint64_t bucket = time / scan->interval;
+    if (!w->reported) {
+        w->reported = true;
+        w->first_bucket = bucket;
+        w->first_stats = header.stats;
+    } else {
+        struct agent_delta *const delta = unit_delta(unit, bucket);
+        delta->agents += (int64_t) (header.stats.num_agents - w->last_stats.num_agents);
+        delta->ghosts += (int64_t) (header.stats.num_agents_ghost - w->last_stats.num_agents_ghost);
+    }
+    w->last_stats = header.stats;
+}
+
+static void scan_unit(struct stats_scan *scan, struct stats_unit *unit) {
+    struct codec_scratch scratch = codec_scratch();
+    struct recording_cursor cursor = { unit->warm_offset, unit->warm_offset };
+    struct recording_record record;
+    while (recording_read_record(&scan->info, scan->fd, scan->map, scan->map_len, &cursor, &record, true) == recording_ok) {
+        if (record.offset >= unit->end) {
+            break;
+        }
+        cursor.offset = record.next;
+        const bool counted = record.offset >= unit->offset;
+        const uint32_t slot = stats_slot(&unit->workers, &unit->stats, &unit->codecs, &unit->cap, record.worker_id & RECORDING_WORKER_MASK);
+        const uint8_t *msg = scan->map + record.data;
+        size_t length = record.length;
+        if (record.worker_id & RECORDING_COMPRESSED) {
+            struct codec_worker *const codec = &unit->codecs[slot];
+            if (!codec_decode(codec, &scratch, msg, length, !(record.worker_id & RECORDING_DELTA))) {
+                unit->undecodable += counted;
+                continue;
+            }
+            msg = codec->prev;
+            length = codec->prev_len;
+        }
+        if (counted) {
+            count_message(scan, unit, &unit->stats[slot], record.time, msg, length);
+        }
+    }
+    for (size_t i = 0; i < unit->workers.count; i++) {
+        codec_worker_free(&unit->codecs[i]);
+    }
+    free(unit->codecs);
+    unit->codecs = NULL;
+    codec_scratch_free(&scratch);
+}
+
+static void *scan_thread(void *arg) {
+    struct stats_scan *const scan = (struct stats_scan *) arg;
+    size_t i;
+    while ((i = scan->next_unit.fetch_add(1)) < scan->num_units) {
+        scan_unit(scan, &scan->units[i]);
+    }
+    return NULL;
+}
+
+// Splits the recording into units along its chunk table, or leaves it whole without one
+static void plan_units(struct stats_scan *scan, long jobs) {
+    const struct recording_info *info = &scan->info;
+    const size_t num_chunks = info->num_chunks;
+    scan->num_units = num_chunks ? MIN(num_chunks, (size_t) jobs * UNITS_PER_THREAD) : 1;
+    scan->units = (struct stats_unit *) calloc(scan->num_units, sizeof(*scan->units));
+    assert(scan->units);
+    if (!num_chunks) {
+        scan->units[0].warm_offset = scan->units[0].offset = info->data_offset;
+        scan->units[0].end = UINT64_MAX;
+        return;
+    }
+    size_t warm = 0;
+    for (size_t u = 0; u < scan->num_units; u++) {
+        const size_t first = u * num_chunks / scan->num_units;
+        const size_t next = (u + 1) * num_chunks / scan->num_units;
+        const uint64_t first_time = info->chunks[first].first_time;
+        const uint64_t from = first_time > RECORDING_KEYFRAME_INTERVAL ? first_time - RECORDING_KEYFRAME_INTERVAL : 0;
+        while (info->chunks[warm].last_time < from) {
+            warm++;
+        }
+        struct stats_unit *const unit = &scan->units[u];
+        unit->warm_offset = info->chunks[warm].offset;
+        unit->offset = info->chunks[first].offset;
+        unit->end = next < num_chunks ? info->chunks[next].offset : UINT64_MAX;
+    }
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct stats_arguments *arguments = (struct stats_arguments *) state->input;
+    switch (key) {
+        case 'f':
+            if (strcmp(arg, "json") == 0) {
+                arguments->format = format_json;
+            } else if (strcmp(arg, "csv") == 0) {
+                arguments->format = format_csv;
+            } else {
+                argp_error(state, "FORMAT is json or csv");
+            }
+            break;
+        case 't':
+            if (strcmp(arg, "workers") == 0) {
+                arguments->table = table_workers;
+            } else if (strcmp(arg, "sizes") == 0) {
+                arguments->table = table_sizes;
+            } else if (strcmp(arg, "points") == 0) {
+                arguments->table = table_points;
+            } else if (strcmp(arg, "agents") == 0) {
+                arguments->table = table_agents;
+            } else {
+                argp_error(state, "TABLE is workers, sizes, points or agents");
+            }
+            break;
+        case 'i': {
+            const double seconds = atof(arg);
+            if (!(seconds * NS_PER_SECOND >= 1)) {
+                argp_error(state, "'%s' isn't a number of seconds", arg);
+            }
+            arguments->interval = seconds * NS_PER_SECOND;
+        } break;
+        case 'j':
+            arguments->jobs = atol(arg);
+            if (arguments->jobs < 1) {
+                argp_error(state, "JOBS has to be at least 1");
+            }
+            break;
+
+        case ARGP_KEY_ARG:
+            if (state->arg_num == 0) {
+                arguments->input = arg;
+            } else {
+                argp_usage(state);
+            }
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 1) {
+                argp_usage(state);
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void argument_parse(int argc, char **argv, struct stats_arguments *arguments) {
+    static char doc[] = "Reports on the traffic in an Aether recording\v"
+        "JSON has every table; CSV has the one picked with --table. Message sizes are "
+        "of the messages as they arrived, whether or not the recording is compressed.";
+    static char args_doc[] = "RECORDING";
+    static struct argp_option options[] = {
+        {"format",   'f', "FORMAT",   0, "json (the default) or csv"},
+        {"table",    't', "TABLE",    0, "For CSV: workers (the default), sizes, points or agents"},
+        {"interval", 'i', "SECONDS",  0, "Time between rows of agent totals, 1 by default"},
+        {"jobs",     'j', "JOBS",     0, "Threads to scan with, one per CPU by default"},
+        {0}
+    };
+    static struct argp argp = {options, parse_opt, args_doc, doc};
+    argp_parse(&argp, argc, argv, 0, 0, arguments);
+}
+
+// Everything the units found out, put together in recording order
+struct stats_totals {
+    struct worker_table workers;
+    struct worker_stats *stats;
+    size_t cap;
+    uint64_t sizes[LOG2_BUCKETS];
+    uint64_t points[LOG2_BUCKETS];
+    uint64_t messages;
+    uint64_t total_points;
+    uint64_t max_points;
+    uint64_t undecodable;
+    struct agent_delta *deltas; // by row from 0
+    size_t num_deltas;
+    uint64_t first_bucket; // the first row anyone reported in
+};
+
+static struct agent_delta *totals_delta(struct stats_totals *t, uint64_t bucket) {
+    if (bucket >= t->num_deltas) {
+        const size_t cap = MAX(bucket + 1, t->num_deltas * 2);
+        t->deltas = (struct agent_delta *) realloc(t->deltas, cap * sizeof(*t->deltas));
+        assert(t->deltas);
+        memset(t->deltas + t->num_deltas, 0, (cap - t->num_deltas) * sizeof(*t->deltas));
+        t->num_deltas = cap;
+    }
+    t->first_bucket = MIN(t->first_bucket, bucket);
+    return &t->deltas[bucket];
+}
+
+static void merge_unit(struct stats_totals *t, const struct stats_unit *unit) {
+    for (size_t i = 0; i < unit->workers.count; i++) {
+        const struct worker_stats *const w = &unit->stats[i];
+        if (!w->records) {
+            continue;
+        }
+        const uint32_t slot = stats_slot(&t->workers, &t->stats, NULL, &t->cap, w->worker_id);
+        struct worker_stats *const g = &t->stats[slot];
+        if (g->records) {
+            gap_add(&g->gaps, w->first_time - g->last_time);
+        } else {
+            g->first_time = w->first_time;
+        }
+        gap_merge(&g->gaps, &w->gaps);
+        g->records += w->records;
+        g->bytes += w->bytes;
+        g->last_time = w->last_time;
+        if (w->reported) {
+            struct agent_delta *const delta = totals_delta(t, w->first_bucket);
+            delta->agents += (int64_t) (w->first_stats.num_agents - (g->reported ? g->last_stats.num_agents : 0));
+            delta->ghosts += (int64_t) (w->first_stats.num_agents_ghost - (g->reported ? g->last_stats.num_agents_ghost : 0));
+            g->reported = true;
+            g->last_stats = w->last_stats;
+        }
+    }
+    for (size_t i = 0; i < unit->num_deltas; i++) {
+        struct agent_delta *const delta = totals_delta(t, unit->base_bucket + i);
+        delta->agents += unit->deltas[i].agents;
+        delta->ghosts += unit->deltas[i].ghosts;
+    }
+    for (size_t i = 0; i < LOG2_BUCKETS; i++) {
+        t->sizes[i] += unit->sizes[i];
+        t->points[i] += unit->points[i];
+    }
+    t->messages += unit->messages;
+    t->total_points += unit->total_points;
+    t->max_points = MAX(t->max_points, unit->max_points);
+    t->undecodable += unit->undecodable;
+}
+
+static void print_histogram(const char *name, const uint64_t *buckets, bool json, bool last) {
+    size_t used = 0;
+    for (size_t i = 0; i < LOG2_BUCKETS; i++) {
+        if (buckets[i]) {
+            used = i + 1;
+        }
+    }
+    if (json) {
+        printf("  \"%s\": [", name);
+    } else {
+        printf("min,max,count\n");
+    }
+    for (size_t i = 0; i < used; i++) {
+        const uint64_t max = i ? log2_bucket_start(i) * 2 - 1 : 0;
+        if (json) {
+            printf("%s\n    {\"min\": %lu, \"max\": %lu, \"count\": %lu}", i ? "," : "",
+                   (unsigned long) log2_bucket_start(i), (unsigned long) max, (unsigned long) buckets[i]);
+        } else {
+            printf("%lu,%lu,%lu\n", (unsigned long) log2_bucket_start(i), (unsigned long) max, (unsigned long) buckets[i]);
+        }
+    }
+    if (json) {
+        printf("%s]%s\n", used ? "\n  " : "", last ? "" : ",");
+    }
+}
+
+static void print_workers(const struct stats_totals *t, double seconds, bool json) {
+    if (json) {
+        printf("  \"workers\": [");
+    } else {
+        printf("worker_id,records,bytes,bytes_per_second,mean_size,gap_mean_ms,gap_stddev_ms,gap_p50_ms,gap_p99_ms,gap_max_ms\n");
+    }
+    for (size_t i = 0; i < t->workers.count; i++) {
+        const struct worker_stats *const w = &t->stats[i];
+        const struct gap_stats *const g = &w->gaps;
+        const double mean = g->count ? g->sum / g->count : 0;
+        const double stddev = g->count ? sqrt(MAX(g->sum_squares / g->count - mean * mean, 0.0)) : 0;
+        const double rate = seconds > 0 ? w->bytes / seconds : 0;
+        if (json) {
+            printf("%s\n    {\"worker_id\": %lu, \"records\": %lu, \"bytes\": %lu, \"bytes_per_second\": %.1f, \"mean_size\": %.1f, "
+                   "\"gap_mean_ms\": %.3f, \"gap_stddev_ms\": %.3f, \"gap_p50_ms\": %.3f, \"gap_p99_ms\": %.3f, \"gap_max_ms\": %.3f}",
+                   i ? "," : "", (unsigned long) w->worker_id, (unsigned long) w->records, (unsigned long) w->bytes, rate,
+                   (double) w->bytes / w->records, mean / 1000, stddev / 1000,
+                   gap_percentile(g, 0.5), gap_percentile(g, 0.99), g->max / 1000.0);
+        } else {
+            printf("%lu,%lu,%lu,%.1f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                   (unsigned long) w->worker_id, (unsigned long) w->records, (unsigned long) w->bytes, rate,
+                   (double) w->bytes / w->records, mean / 1000, stddev / 1000,
+                   gap_percentile(g, 0.5), gap_percentile(g, 0.99), g->max / 1000.0);
+        }
+    }
+    if (json) {
+        printf("%s],\n", t->workers.count ? "\n  " : "");
+    }
+}
+
+static void print_agents(const struct stats_totals *t, uint64_t interval, bool json) {
+    if (json) {
+        printf("  \"agents\": [");
+    } else {
+        printf("time,num_agents,num_agents_ghost\n");
+    }
+    int64_t agents = 0, ghosts = 0;
+    for (size_t i = t->first_bucket; i < t->num_deltas; i++) {
+        agents += t->deltas[i].agents;
+        ghosts += t->deltas[i].ghosts;
+        const double time = (double) i * interval / NS_PER_SECOND;
+        if (json) {
+            printf("%s\n    {\"time\": %.3f, \"num_agents\": %ld, \"num_agents_ghost\": %ld}", i > t->first_bucket ? "," : "",
+                   time, (long) agents, (long) ghosts);
+        } else {
+            printf("%.3f,%ld,%ld\n", time, (long) agents, (long) ghosts);
+        }
+    }
+    if (json) {
+        printf("%s]\n", t->num_deltas > t->first_bucket ? "\n  " : "");
+    }
+}
+
+int main(int argc, char **argv) {
+    struct stats_arguments arguments = {0};
+    arguments.format = format_json;
+    arguments.table = table_workers;
+    arguments.interval = NS_PER_SECOND;
+    arguments.jobs = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    argument_parse(argc, argv, &arguments);
+
+    struct stats_scan scan;
+    scan.fd = open(arguments.input, O_RDONLY);
+    if (scan.fd == -1) {
+        perror(arguments.input);
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (fstat(scan.fd, &st) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    scan.map_len = st.st_size;
+    scan.map = scan.map_len ? (const uint8_t *) mmap(NULL, scan.map_len, PROT_READ, MAP_SHARED, scan.fd, 0) : NULL;
+    if (scan.map == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    scan.info = recording_info();
+    if (recording_info_read(&scan.info, scan.fd, scan.map, scan.map_len) != recording_ok) {
+        fprintf(stderr, "stats: %s isn't a recording\n", arguments.input);
+        exit(EXIT_FAILURE);
+    }
+    scan.interval = arguments.interval;
+    scan.next_unit = 0;
+    plan_units(&scan, arguments.jobs);
+
+    const size_t num_threads = MIN((size_t) arguments.jobs, scan.num_units);
+    pthread_t *threads = (pthread_t *) malloc(num_threads * sizeof(*threads));
+    assert(threads);
+    for (size_t i = 0; i < num_threads; i++) {
+        const int res = pthread_create(&threads[i], NULL, scan_thread, &scan);
+        if (res != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(res));
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    struct stats_totals totals = {0};
+    totals.first_bucket = UINT64_MAX;
+    for (size_t i = 0; i < scan.num_units; i++) {
+        merge_unit(&totals, &scan.units[i]);
+    }
+    uint64_t first_time = UINT64_MAX, last_time = 0, records = 0, bytes = 0;
+    for (size_t i = 0; i < totals.workers.count; i++) {
+        first_time = MIN(first_time, totals.stats[i].first_time);
+        last_time = MAX(last_time, totals.stats[i].last_time);
+        records += totals.stats[i].records;
+        bytes += totals.stats[i].bytes;
+    }
+    const double seconds = records ? (double) (last_time - first_time) / NS_PER_SECOND : 0;
+
+    const bool json = arguments.format == format_json;
+    if (json) {
+        printf("{\n  \"recording\": {\"version\": %u, \"seconds\": %.3f, \"records\": %lu, \"bytes\": %lu, \"bytes_per_second\": %.1f, "
+               "\"undecodable\": %lu, \"chunks\": %zu},\n",
+               scan.info.version, seconds, (unsigned long) records, (unsigned long) bytes, seconds > 0 ? bytes / seconds : 0.0,
+               (unsigned long) totals.undecodable, scan.info.num_chunks);
+        print_workers(&totals, seconds, true);
+        print_histogram("message_sizes", totals.sizes, true, false);
+        printf("  \"num_points\": {\"messages\": %lu, \"mean\": %.1f, \"max\": %lu},\n",
+               (unsigned long) totals.messages, totals.messages ? (double) totals.total_points / totals.messages : 0.0,
+               (unsigned long) totals.max_points);
+        print_histogram("num_points_histogram", totals.points, true, false);
+        print_agents(&totals, arguments.interval, true);
+        printf("}\n");
+    } else {
+        switch (arguments.table) {
+            case table_workers: print_workers(&totals, seconds, false); break;
+            case table_sizes: print_histogram("message_sizes", totals.sizes, false, true); break;
+            case table_points: print_histogram("num_points", totals.points, false, true); break;
+            case table_agents: print_agents(&totals, arguments.interval, false); break;
+        }
+    }
+
+    for (size_t i = 0; i < scan.num_units; i++) {
+        worker_table_free(&scan.units[i].workers);
+        free(scan.units[i].stats);
+        free(scan.units[i].deltas);
+    }
+    free(scan.units);
+    worker_table_free(&totals.workers);
+    free(totals.stats);
+    free(totals.deltas);
+    recording_info_free(&scan.info);
+    if (scan.map) {
+        munmap((void *) scan.map, scan.map_len);
+    }
+    close(scan.fd);
+    return 0;
+}